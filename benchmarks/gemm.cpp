@@ -0,0 +1,81 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include <cblas.h>
+
+#include "gemm.hpp"
+#include "parallel.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Compares native_gemm with the system's CBLAS on square matrices of a few //
+// sizes, counting 2 n^3 floating point operations per product. Both use    //
+// every thread: CBLAS its own, and native_gemm the pool's (set it with     //
+// WEAK_NUM_THREADS). Then compares tiny_gemm with CBLAS.                   //
+//////////////////////////////////////////////////////////////////////////////
+
+static double gigaflops(size_t flops_per_run, const std::function<void()>& run) {
+    using clock = std::chrono::steady_clock;
+    run();
+    size_t runs = 0;
+    auto start = clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        run();
+        runs++;
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < 0.5);
+    return (double) flops_per_run * runs / elapsed.count() / 1e9;
+}
+
+int main() {
+    const size_t sizes[] = {64, 256, 512, 1024};
+
+    printf("threads: %zu\n", num_threads());
+    printf("%6s %12s %12s %8s\n", "n", "cblas GF/s", "native GF/s", "ratio");
+    for (size_t n : sizes) {
+        std::vector<double> a (n * n), b (n * n), out (n * n);
+        for (size_t i = 0; i < n * n; i++) {
+            a[i] = (double) (i % 7) - 3.;
+            b[i] = (double) (i % 5) * 0.5;
+        }
+        size_t flops = 2 * n * n * n;
+        double cblas = gigaflops(flops, [&]() {
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, n, n, 1., a.data(), n, b.data(), n, 0., out.data(), n);
+        });
+        double native = gigaflops(flops, [&]() {
+            native_gemm(n, n, n, a.data(), n, 1, b.data(), n, 1, out.data());
+        });
+        printf("%6zu %12.2f %12.2f %8.2f\n", n, cblas, native, native / cblas);
+    }
+
+    // Tiny products are dominated by the cost of the call, so they're
+    // counted in products per microsecond
+    printf("\n%6s %12s %12s %8s\n", "n", "cblas /us", "tiny /us", "ratio");
+    for (size_t n = 2; n <= GEMM_TINY_MAX; n++) {
+        std::vector<double> a (n * n, 1.5), b (n * n, 0.5), out (n * n);
+        const size_t products = 1000;
+        double cblas = gigaflops(products * 1000, [&]() {
+            for (size_t i = 0; i < products; i++) cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, n, n, 1., a.data(), n, b.data(), n, 0., out.data(), n);
+        });
+        double tiny = gigaflops(products * 1000, [&]() {
+            for (size_t i = 0; i < products; i++) tiny_gemm(n, n, n, a.data(), n, 1, b.data(), n, 1, out.data());
+        });
+        printf("%6zu %12.2f %12.2f %8.2f\n", n, cblas, tiny, tiny / cblas);
+    }
+    return 0;
+}
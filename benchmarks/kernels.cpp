@@ -0,0 +1,65 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "kernels.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Measures the throughput of every elementwise kernel, for every kernel    //
+// set this CPU supports, on an array that fits in L1 cache and one that    //
+// doesn't fit in any cache. Throughput counts every byte read or written.  //
+//////////////////////////////////////////////////////////////////////////////
+
+static double gigabytes_per_second(size_t bytes_per_run, const std::function<void()>& run) {
+    using clock = std::chrono::steady_clock;
+    run();
+    size_t runs = 0;
+    auto start = clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        run();
+        runs++;
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < 0.2);
+    return (double) bytes_per_run * runs / elapsed.count() / 1e9;
+}
+
+int main() {
+    const char* op_names[] = {"add", "subtract", "multiply", "divide", "min", "max", "power"};
+    const char* layout_names[] = {"array-array", "scalar-array", "array-scalar"};
+    const size_t sizes[] = {2048, 1 << 23};
+
+    printf("%-8s %-10s %-13s %10s %8s\n", "set", "kernel", "operands", "elements", "GB/s");
+    for (const KernelSet* set : supported_kernels()) {
+        for (size_t n : sizes) {
+            std::vector<double> left (n, 1.5), right (n, 0.75), out (n);
+            for (size_t op = 0; op < NUM_KERNEL_OPS; op++) {
+                for (size_t layout = 0; layout < NUM_KERNEL_LAYOUTS; layout++) {
+                    size_t arrays_read = layout == ARRAY_ARRAY ? 2 : 1;
+                    double rate = gigabytes_per_second((arrays_read + 1) * n * sizeof(double), [&]() {
+                        kernel_binary(*set, (KernelOp) op, (KernelLayout) layout, left.data(), right.data(), out.data(), n);
+                    });
+                    printf("%-8s %-10s %-13s %10zu %8.2f\n", set->name, op_names[op], layout_names[layout], n, rate);
+                }
+            }
+            double rate = gigabytes_per_second(2 * n * sizeof(double), [&]() { set->negate(left.data(), out.data(), n); });
+            printf("%-8s %-10s %-13s %10zu %8.2f\n", set->name, "negate", "array", n, rate);
+            rate = gigabytes_per_second(2 * n * sizeof(double), [&]() { set->square(left.data(), out.data(), n); });
+            printf("%-8s %-10s %-13s %10zu %8.2f\n", set->name, "square", "array", n, rate);
+        }
+    }
+    return 0;
+}
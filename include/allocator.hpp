@@ -0,0 +1,86 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+//////////////////////////////////////////////////////////////////////////////
+// Where ndarray elements are stored. Buffers are aligned to a cache line,  //
+// so vector loads never straddle two lines. Their sizes are rounded up to  //
+// a power of two, and each thread keeps a short free list of released      //
+// buffers for each of those sizes, so a loop making a temporary of the     //
+// same shape every iteration takes it from the free list instead of the    //
+// system. Buffers bigger than the largest size class always come from the  //
+// system.                                                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+const size_t BUFFER_ALIGNMENT = 64;
+
+// At least bytes of memory aligned to BUFFER_ALIGNMENT
+void* allocate_buffer(size_t bytes);
+// Releases memory from allocate_buffer, with the same number of bytes
+void free_buffer(void* buffer, size_t bytes);
+
+// Running totals across every thread, for checking that steady-state loops
+// don't reach the system allocator
+struct AllocationCounts {
+    // Buffers taken from the system allocator
+    size_t system_allocations;
+    // Buffers taken from a free list instead
+    size_t reused;
+    // Buffers given back to the system allocator
+    size_t system_frees;
+};
+
+AllocationCounts allocation_counts();
+
+// An allocator for std::vector using allocate_buffer. Elements are left
+// uninitialized when a vector is created or resized, since code building an
+// ndarray writes every element itself straight after.
+template <typename T>
+struct BufferAllocator {
+    typedef T value_type;
+    BufferAllocator() = default;
+    template <typename U>
+    BufferAllocator(const BufferAllocator<U>&) {}
+    T* allocate(size_t n) {
+        return static_cast<T*>(allocate_buffer(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        free_buffer(p, n * sizeof(T));
+    }
+    template <typename U>
+    void construct(U* p) {
+        ::new ((void*) p) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new ((void*) p) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const BufferAllocator<T>&, const BufferAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const BufferAllocator<T>&, const BufferAllocator<U>&) {
+    return false;
+}
+
+#endif // ALLOCATOR_H_
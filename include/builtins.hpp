@@ -0,0 +1,39 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BUILTINS_H_
+#define BUILTINS_H_
+
+#include <string>
+
+#include "variable.hpp"
+#include "token.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Builtins are functions implemented natively, like sum and max. They're   //
+// called like any other function, but a function the program defines with //
+// the same name takes precedence, so adding a builtin never breaks a       //
+// program that already uses its name.                                      //
+//////////////////////////////////////////////////////////////////////////////
+
+typedef Variable (*BuiltinFunction)(const Variable* args, size_t num_args, const Token& loc);
+
+struct Builtin {
+    size_t min_args;
+    size_t max_args;
+    BuiltinFunction call;
+};
+
+// The builtin with the given name, or null if there isn't one
+const Builtin* find_builtin(const std::string& name);
+
+#endif // BUILTINS_H_
@@ -0,0 +1,118 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "token.hpp"
+#include "variable.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Every opcode understood by the VM. The list is written as an X-macro so  //
+// that the enum below and the VM's dispatch table can never disagree on    //
+// ordering. Operands live in the a/b/c fields of an Instruction, and loc   //
+// indexes the token blamed for any runtime error raised by the opcode.     //
+//////////////////////////////////////////////////////////////////////////////
+
+#define WEAK_OPCODES(X) \
+    X(OP_CONSTANT)      /* push constants[a] */ \
+    X(OP_NIL)           /* push nil */ \
+    X(OP_POP)           /* discard the top of the stack */ \
+    X(OP_GET_LOCAL)     /* push slot a, which must be declared */ \
+    X(OP_MOVE_LOCAL)    /* like OP_GET_LOCAL, but leaves nil in slot a */ \
+    X(OP_CHECK_LOCAL)   /* assert slot a is declared */ \
+    X(OP_SET_LOCAL)     /* store the top of the stack into slot a, leaving it on the stack */ \
+    X(OP_DECLARE_LOCAL) /* pop into slot a, unless slot a is already declared */ \
+    X(OP_GET_INDEX)     /* pop a indices and an ndarray, push the indexed element */ \
+    X(OP_GET_LOCAL_INDEX) /* pop b indices, push the element of slot a at them */ \
+    X(OP_GET_SLICE)     /* pop the parts of a indices (three for each slice, marked by the bits of b and then c) and an ndarray, push the view */ \
+    X(OP_SET_INDEX)     /* pop b indices, store the top of the stack into slot a at them */ \
+    X(OP_ARRAY)         /* pop a doubles, push them as a 1d ndarray */ \
+    X(OP_ADD)           /* arithmetic leaves an ndarray result lazy if c is set */ \
+    X(OP_SUBTRACT) \
+    X(OP_MULTIPLY) \
+    X(OP_DIVIDE) \
+    X(OP_POWER) \
+    X(OP_MATMUL) \
+    X(OP_AS_SHAPE) \
+    X(OP_EQUAL) \
+    X(OP_NOT_EQUAL) \
+    X(OP_GREATER) \
+    X(OP_GREATER_EQUAL) \
+    X(OP_LESS) \
+    X(OP_LESS_EQUAL) \
+    X(OP_NEGATE)        /* leaves an ndarray result lazy if c is set */ \
+    X(OP_NOT) \
+    X(OP_SHAPE) \
+    X(OP_CHECK_BOOL)    /* assert the top of the stack is a bool, with message b */ \
+    X(OP_JUMP)          /* jump to a */ \
+    X(OP_JUMP_IF_FALSE) /* pop, jump to a if false */ \
+    X(OP_AND_JUMP)      /* jump to a if the top is false, otherwise pop */ \
+    X(OP_OR_JUMP)       /* jump to a if the top is true, otherwise pop */ \
+    X(OP_PREPARE_CALL)  /* look up function a (or else builtin a), checking it takes b arguments (error at token c) */ \
+    X(OP_CALL)          /* call the prepared function with the top a values */ \
+    X(OP_CALL_OP)       /* call operator a with the top two values */ \
+    X(OP_DEFINE_FUNC)   /* define function a as functions[b] */ \
+    X(OP_DEFINE_OP)     /* define operator a as functions[b] */ \
+    X(OP_PRINT) \
+    X(OP_ASSERT) \
+    X(OP_RETURN)
+
+#define WEAK_OPCODE_ENUM(name) name,
+enum OpCode : uint8_t {
+    WEAK_OPCODES(WEAK_OPCODE_ENUM)
+    NUM_OPCODES
+};
+#undef WEAK_OPCODE_ENUM
+
+// Messages used by OP_CHECK_BOOL, kept out of the instruction stream
+enum CheckMessage : uint32_t {
+    CHECK_IF,
+    CHECK_WHILE,
+    CHECK_ASSERT,
+    CHECK_LEFT,
+    CHECK_RIGHT
+};
+
+struct Instruction {
+    // Address of the VM's handler for op, filled in before execution
+    // so dispatch is a single indirect jump (direct threading)
+    const void* handler;
+    OpCode op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t loc;
+};
+
+struct FunctionProto {
+    std::string name;
+    uint32_t arity;
+    uint32_t num_slots;
+    std::vector<Instruction> code;
+};
+
+struct Program {
+    // functions[0] is the top level of the program
+    std::vector<std::unique_ptr<FunctionProto>> functions;
+    std::vector<Variable> constants;
+    std::vector<Token> locations;
+    // Function and operator names, interned so the VM can look them up by index
+    std::vector<std::string> names;
+};
+
+#endif // BYTECODE_H_
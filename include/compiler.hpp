@@ -0,0 +1,49 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef COMPILER_H_
+#define COMPILER_H_
+
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "operations.hpp"
+#include "fusion.hpp"
+#include "resolver.hpp"
+#include "stmt.hpp"
+#include "expr.hpp"
+#include "util.hpp"
+
+class Compiler {
+public:
+    std::unique_ptr<Program> compile(const std::vector<Stmt*>& stmts);
+private:
+    Program* program;
+    FunctionProto* current;
+    std::unordered_map<std::string, uint32_t> name_ids;
+
+    void compile_stmt(Stmt* stmt);
+    void compile_block(const std::vector<Stmt*>& stmts);
+    void compile_expr(Expr* expr);
+    void compile_elementwise(Expr* expr, bool root);
+    uint32_t compile_function(std::string name, std::vector<const Token*> params, const std::vector<Stmt*>& stmts, size_t num_slots);
+
+    size_t emit(OpCode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t loc = 0);
+    void patch_jump(size_t jump);
+    uint32_t add_constant(Variable constant);
+    uint32_t add_location(const Token& token);
+    uint32_t name_id(const std::string& name);
+};
+
+#endif // COMPILER_H_
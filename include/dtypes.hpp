@@ -0,0 +1,106 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef DTYPES_H_
+#define DTYPES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kernels.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// The element types of ndarrays. Arithmetic on arrays of the same dtype    //
+// keeps that dtype, and mixing dtypes gives the narrowest one that holds   //
+// both, so f32 data stays 4 bytes per element through a whole computation. //
+// f64 arrays run on the SIMD kernels of kernels.hpp, and f32 and i64       //
+// arrays on the plain loops below, which compilers vectorize themselves.   //
+//////////////////////////////////////////////////////////////////////////////
+
+enum DType : uint8_t {
+    DTYPE_F64,
+    DTYPE_F32,
+    DTYPE_I64,
+    DTYPE_BOOL,
+    NUM_DTYPES
+};
+
+size_t dtype_size(DType dtype);
+// Also the name of the builtin converting an array to the dtype
+const char* dtype_name(DType dtype);
+
+// The dtype of arithmetic between arrays of these dtypes: f64 with anything
+// is f64, f32 with bool is f32, f32 with i64 is f64, and bool with bool or
+// i64 is i64
+DType promote(DType left, DType right);
+// The dtype of arithmetic between an array and a number. Numbers adapt to
+// the array, so f32 stays f32, and integers and bools only become f64 if
+// the number isn't an integer.
+DType promote_scalar(DType array, double scalar);
+// The dtype op is computed in for operands of the given dtype. Division
+// and powers of integers give f64, like Weak's other numbers.
+DType arithmetic_dtype(KernelOp op, DType operands);
+
+// Reads one element as a number
+double load_element(DType dtype, const void* in);
+// Writes value as an element, returning false if it's an i64 element and
+// value isn't an integer in range
+bool store_element(DType dtype, double value, void* out);
+// Converts n elements, returning false if converting to i64 and an element
+// isn't an integer in range, in which case out is left part written
+bool convert_elements(DType from, const void* in, DType to, void* out, size_t n);
+
+// Like kernel_binary and kernel_broadcast for f32 and i64 elements. Scalar
+// operands point at a single element of the same dtype. i64 arrays support
+// KERNEL_ADD, KERNEL_SUBTRACT, KERNEL_MULTIPLY, KERNEL_MIN and KERNEL_MAX,
+// and wrap around on overflow.
+void typed_binary(DType dtype, KernelOp op, KernelLayout layout, const void* left, const void* right, void* out, size_t n);
+void typed_broadcast(DType dtype, KernelOp op, const std::vector<size_t>& shape, const void* left, const std::vector<size_t>& left_strides, const void* right, const std::vector<size_t>& right_strides, void* out);
+void typed_negate(DType dtype, const void* in, void* out, size_t n);
+
+// Comparisons computed element by element, giving bool arrays ("masks")
+enum CompareOp {
+    COMPARE_LESS,
+    COMPARE_LESS_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_GREATER_EQUAL,
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL
+};
+
+// out = left op right over an array of the given shape, as 1s and 0s, with
+// operands of any dtype read through strides as in typed_broadcast. A scalar
+// operand is an element with strides of 0.
+void typed_compare(DType dtype, CompareOp op, const std::vector<size_t>& shape, const void* left, const std::vector<size_t>& left_strides, const void* right, const std::vector<size_t>& right_strides, uint8_t* out);
+// out = a where mask is set and b elsewhere, reading all three through
+// strides like typed_compare. a, b and out have elements of dtype.
+void typed_select(DType dtype, const std::vector<size_t>& shape, const uint8_t* mask, const std::vector<size_t>& mask_strides, const void* a, const std::vector<size_t>& a_strides, const void* b, const std::vector<size_t>& b_strides, void* out);
+// The number of elements set in a mask of n elements
+size_t count_set(const uint8_t* mask, size_t n);
+// Copies the elements of in whose mask element is set, in order, to the
+// start of out. Returns how many were copied.
+size_t typed_compress(DType dtype, const void* in, const uint8_t* mask, size_t n, void* out);
+// Sets each element of out whose mask element is set to *value
+void typed_fill_masked(DType dtype, const void* value, const uint8_t* mask, size_t n, void* out);
+
+// Copies count blocks of block elements into out, the ith starting at element
+// offsets[i] of in
+void typed_gather(DType dtype, const void* in, const size_t* offsets, size_t count, size_t block, void* out);
+// Writes count blocks of block elements from values into out, an array of n
+// elements, the ith starting at element offsets[i]. Each value is added to
+// the element instead if add is set, which isn't supported for bools. If
+// scalar is set, values is a single element written everywhere.
+void typed_scatter(DType dtype, void* out, size_t n, const size_t* offsets, size_t count, size_t block, const void* values, bool scalar, bool add);
+
+#endif // DTYPES_H_
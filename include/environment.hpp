@@ -16,52 +16,19 @@
 #include <unordered_map>
 #include <stdexcept>
 #include <iostream>
-#ifndef WEB_TARGET
-    #include <cblas.h>
-#endif
+#include <memory>
 #include <string>
-#include <math.h>
+#include <vector>
 
 #include "variable.hpp"
+#include "operations.hpp"
+#include "fusion.hpp"
+#include "resolver.hpp"
+#include "builtins.hpp"
 #include "parser.hpp"
 #include "error.hpp"
 #include "util.hpp"
 
-#define FUNC_EXISTS(func) (func_symbol_table.find(func) != func_symbol_table.end())
-#define OP_EXISTS(op) (op_symbol_table.find(op) != op_symbol_table.end())
-#define VAR_EXISTS(var) (var_symbol_table.find(var) != var_symbol_table.end())
-
-#define ELEMENTWISE_OP(OP) { \
-    if (left_var.is_double() && right_var.is_double()) { \
-	return Variable(std::get<double>(left_var.value) OP std::get<double>(right_var.value)); \
-    } \
-    if (left_var.is_double() && right_var.is_ndarray()) { \
-	auto right_arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value).first; \
-	for (size_t i = 0; i < right_arr.size(); i++) { \
-	    right_arr.at(i) = std::get<double>(left_var.value) OP right_arr.at(i); \
-	} \
-	return Variable(std::pair<std::vector<double>, std::vector<size_t>>(right_arr, std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value).second)); \
-    } \
-    if (left_var.is_ndarray() && right_var.is_double()) { \
-	auto left_arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value).first; \
-	for (size_t i = 0; i < left_arr.size(); i++) { \
-	    left_arr.at(i) = left_arr.at(i) OP std::get<double>(right_var.value); \
-	} \
-	return Variable(std::pair<std::vector<double>, std::vector<size_t>>(left_arr, std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value).second)); \
-    } \
-    if (left_var.is_ndarray() && right_var.is_ndarray()) { \
-	auto left_var_pair = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value); \
-	auto right_var_pair = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value); \
-	runtime_assert(left_var_pair.second == right_var_pair.second, binary->op, "Expressions evaluate to arrays of differing sizes"); \
-	std::vector<double> zipped; \
-	for (size_t i = 0; i < left_var_pair.first.size(); i++) { \
-	    zipped.push_back(left_var_pair.first.at(i) OP right_var_pair.first.at(i)); \
-	} \
-	return Variable(std::pair<std::vector<double>, std::vector<size_t>>(zipped, left_var_pair.second)); \
-    } \
-    runtime_assert(false, binary->op, "At least one of left and right expressions are neither numbers nor ndarrays"); \
-}
-
 class Environment {
 public:
     Environment();
@@ -75,13 +42,30 @@ public:
     void execute_stmt(Stmt* stmt);
     std::unordered_map<std::string, FuncDecl*> func_symbol_table; 
     std::unordered_map<std::string, OpDecl*> op_symbol_table; 
-    std::unordered_map<std::string, Variable> var_symbol_table;
+    // Maps top level variable names to their slot in slots
+    std::unordered_map<std::string, size_t> var_symbol_table;
 private:
+    struct CallFrame {
+        size_t base;
+        // Functions and operators declared inside this call, which are
+        // visible to it and to everything it calls until it returns
+        std::unique_ptr<std::unordered_map<std::string, FuncDecl*>> local_funcs;
+        std::unique_ptr<std::unordered_map<std::string, OpDecl*>> local_ops;
+    };
+
     bool hit_return;
     Variable return_val;
+    std::vector<Variable> slots;
+    std::vector<char> declared;
+    std::vector<CallFrame> frames;
+    size_t num_local_decls;
+    Resolver resolver;
+    FuncDecl* lookup_func(const std::string& name);
+    OpDecl* lookup_op(const std::string& name);
+    void execute(Stmt* stmt);
     Variable evaluate_expr(Expr* expr);
-    void runtime_assert(bool cond, Token loc, std::string error_msg);
-    std::string create_error(std::string error_msg, Token loc);
+    Variable evaluate_elementwise(Expr* expr, bool root);
+    Variable call(const std::vector<Stmt*>& stmts, size_t num_slots, std::vector<Variable>& args);
     std::ostream& out;
 };
 
@@ -46,6 +46,8 @@ public:
     Token name;
     std::vector<Expr*> idx;
     Expr* value;
+    // Local slot of the variable being assigned, filled in by the Resolver
+    size_t slot;
 };
 
 class Binary : public Expr {
@@ -92,6 +94,19 @@ public:
     
 };
 
+// A range of indices start:stop:step inside an array access. Missing parts
+// are left null.
+class Slice : public Expr {
+public:
+    Slice(Expr* start, Token colon, Expr* stop, Expr* step);
+    std::pair<std::string, std::string> to_string();
+    ~Slice();
+    Expr* start;
+    Token colon;
+    Expr* stop;
+    Expr* step;
+};
+
 class Unary : public Expr {
 public:
     Unary(Token op, Expr* right);
@@ -107,6 +122,11 @@ public:
     std::pair<std::string, std::string> to_string();
     ~Var();
     Token name;
+    // Local slot of the variable, filled in by the Resolver
+    size_t slot;
+    // Set by the Resolver when the variable is about to be overwritten and
+    // this is its last read, so its value can be moved out of its slot
+    bool last_use;
 };
 
 class Nil : public Expr {
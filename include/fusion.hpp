@@ -0,0 +1,69 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef FUSION_H_
+#define FUSION_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "variable.hpp"
+#include "operations.hpp"
+#include "expr.hpp"
+#include "util.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Elementwise expressions like `4 * mat + 1` are evaluated lazily: each    //
+// operator on an ndarray only records what it would do and checks the      //
+// shapes involved, so errors are raised exactly where eager evaluation     //
+// would raise them. The outermost operator of the expression (its root)    //
+// then computes every element in one pass over the inputs, a block at a    //
+// time, instead of writing out a full temporary array for each operator.  //
+//////////////////////////////////////////////////////////////////////////////
+
+struct FusedOp {
+    enum Kind : uint8_t {
+        ARRAY,  // push arrays[array]
+        SCALAR, // push scalar
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        POWER,
+        NEGATE
+    };
+    Kind kind;
+    uint32_t array;
+    double scalar;
+};
+
+struct LazyArray {
+    std::vector<size_t> shape;
+    // Postfix code computing one element, in terms of the input arrays
+    std::vector<FusedOp> code;
+    // Arrays with fewer elements than shape are broadcast to it
+    std::vector<NDArray> arrays;
+};
+
+// Whether expr is an operator that can be part of a fused expression
+bool is_elementwise(Expr* expr);
+
+// Like arithmetic() and negate(), except ndarray results are left lazy
+// unless root is set, in which case the whole expression is computed
+Variable fused_arithmetic(TokenType op, Variable left, Variable right, const Token& loc, bool root);
+Variable fused_negate(Variable val, const Token& loc, bool root);
+
+// Computes the lazy expression, possibly overwriting one of its arrays
+NDArray materialize(LazyArray& lazy);
+
+#endif // FUSION_H_
@@ -0,0 +1,74 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef GEMM_H_
+#define GEMM_H_
+
+#include <cstddef>
+#include <ostream>
+
+#include "kernels.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Matrix products that don't need BLAS. Tiny products are fully unrolled,  //
+// since calling into BLAS would cost far more than the arithmetic. For     //
+// larger ones, blocks of both operands are copied ("packed") into the      //
+// order the GEMM kernel reads them, sized so the block of b being used     //
+// stays in cache while every block of a passes over it, and the kernel     //
+// then computes small tiles of the result in registers. Threads compute    //
+// separate blocks of the result. CBLAS takes over for the largest products.//
+//////////////////////////////////////////////////////////////////////////////
+
+// Which implementation @ uses for matrix products
+enum BlasBackend {
+    BLAS_AUTO,   // whichever is fastest for the size of the product
+    BLAS_CBLAS,  // always the system's CBLAS library
+    BLAS_NATIVE  // never CBLAS, which is all the web build has
+};
+
+BlasBackend blas_backend();
+void set_blas_backend(BlasBackend backend);
+
+// The implementations a product can be computed with
+enum GemmMethod {
+    GEMM_TINY,    // tiny_gemm, fully unrolled for the exact shape
+    GEMM_NATIVE,  // native_gemm
+    GEMM_CBLAS
+};
+
+// Products with no dimension larger than this have their own tiny_gemm
+const size_t GEMM_TINY_MAX = 4;
+
+// With BLAS_AUTO, products of at least this many multiplications (rows x
+// cols x depth) use CBLAS, and smaller ones native_gemm. Defaults to the
+// WEAK_GEMM_CBLAS_MIN environment variable if it's set.
+size_t gemm_cblas_min();
+void set_gemm_cblas_min(size_t multiplications);
+
+GemmMethod gemm_method(size_t rows, size_t cols, size_t depth);
+
+// Times native_gemm against CBLAS on square products of increasing size,
+// printing the results and the gemm_cblas_min they suggest
+void calibrate_gemm(std::ostream& out);
+
+// out = a b for a product with no dimension above GEMM_TINY_MAX, adding up
+// each element's products in the same order as native_gemm
+void tiny_gemm(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out);
+
+// out = a b, where a is rows x depth and b is depth x cols, each read through
+// its own row and column strides, and out is a contiguous rows x cols array.
+// Every kernel set gives exactly the same result.
+void native_gemm(const KernelSet& set, size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out);
+void native_gemm(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out);
+
+#endif // GEMM_H_
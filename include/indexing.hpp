@@ -0,0 +1,43 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef INDEXING_H_
+#define INDEXING_H_
+
+#include "variable.hpp"
+#include "token.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Fancy indexing, where some indices of an array access are ndarrays of    //
+// integers rather than numbers. The index arrays are broadcast together,   //
+// and each position in them picks out one element, or one block of the     //
+// dimensions after the indexed ones. Every index is bounds checked in one  //
+// pass that finds where each block starts, and the blocks are then copied  //
+// by native loops split across the thread pool.                            //
+//////////////////////////////////////////////////////////////////////////////
+
+// Whether an array access uses fancy indexing, i.e. one of its indices is an
+// ndarray that isn't a bool mask used on its own
+bool is_fancy_index(const Variable* indices, size_t num_indices);
+// The blocks of array that the indices pick out. The result's shape is that
+// of the index arrays broadcast together, followed by the dimensions that
+// weren't indexed.
+Variable gather(const NDArray& array, const Variable* indices, size_t num_indices, const Token& loc);
+// Writes val, a number or an ndarray broadcast to the shape gather would
+// give, into the blocks of array the indices pick out. When an index
+// repeats, the last value written to it is kept.
+void scatter(NDArray& array, const Variable* indices, size_t num_indices, const Variable& val, const Token& loc);
+// A copy of arr with the values added to the rows the index picks out, like
+// scatter but adding up the values of repeated indices (NumPy's add.at)
+Variable scatter_add(const Variable& arr, const Variable& index, const Variable& val, const Token& loc);
+
+#endif // INDEXING_H_
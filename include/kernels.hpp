@@ -0,0 +1,115 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#include <cstddef>
+#include <vector>
+#include <math.h>
+
+// SIMD kernels are built for x86 with GCC or clang, which let each function
+// target its own instruction set. Everything else uses the scalar kernels.
+#if !defined(WEB_TARGET) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define WEAK_X86_KERNELS
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Loops over runs of doubles for elementwise arithmetic. There is a set of //
+// kernels for each instruction set, and the widest one the CPU supports is //
+// picked the first time a kernel runs. Every set computes exactly the same //
+// results, since each element sees the same IEEE operation.                //
+//////////////////////////////////////////////////////////////////////////////
+
+enum KernelOp {
+    KERNEL_ADD,
+    KERNEL_SUBTRACT,
+    KERNEL_MULTIPLY,
+    KERNEL_DIVIDE,
+    KERNEL_MIN,
+    KERNEL_MAX,
+    KERNEL_POWER,
+    NUM_KERNEL_OPS
+};
+
+// Which operands of a binary kernel are arrays. A scalar operand is passed as
+// a pointer to its single value.
+enum KernelLayout {
+    ARRAY_ARRAY,
+    SCALAR_ARRAY,
+    ARRAY_SCALAR,
+    NUM_KERNEL_LAYOUTS
+};
+
+typedef void (*BinaryKernel)(const double* left, const double* right, double* out, size_t n);
+typedef void (*UnaryKernel)(const double* in, double* out, size_t n);
+typedef double (*ReduceKernel)(const double* in, size_t n);
+typedef double (*DotKernel)(const double* left, const double* right, size_t n);
+typedef void (*GemmKernel)(size_t k, const double* a, const double* b, double* out, size_t ldc);
+
+// Reductions keep this many partial results, element i going to partial
+// result i % REDUCE_LANES, which are then combined pairwise. Every kernel set
+// follows this order whatever its vector width, so they all agree exactly.
+const size_t REDUCE_LANES = 16;
+
+// No GEMM kernel computes a tile of more than this many rows or columns
+const size_t GEMM_MAX_TILE = 16;
+
+struct KernelSet {
+    const char* name;
+    // KERNEL_POWER has no vector version in general, so its entries are
+    // only used for the exponents special cased by kernel_binary
+    BinaryKernel binary[KERNEL_POWER][NUM_KERNEL_LAYOUTS];
+    UnaryKernel negate;
+    UnaryKernel square;
+    UnaryKernel reciprocal;
+    ReduceKernel sum;
+    ReduceKernel product;
+    ReduceKernel min;
+    ReduceKernel max;
+    DotKernel dot;
+    // Computes a gemm_rows x gemm_cols tile of a matrix product (see
+    // gemm.hpp). The tile's size doesn't change the order each element's
+    // products are added up in, so every set gives the same products.
+    GemmKernel gemm;
+    size_t gemm_rows;
+    size_t gemm_cols;
+};
+
+// The kernel set for this CPU
+const KernelSet& kernels();
+// Every kernel set this CPU can run, narrowest first
+std::vector<const KernelSet*> supported_kernels();
+
+// The kernels below that don't take a kernel set use this CPU's, and split
+// long runs across the thread pool (see parallel.hpp)
+
+// out[i] = left[i] op right[i] for i < n, using the given kernel set
+void kernel_binary(const KernelSet& set, KernelOp op, KernelLayout layout, const double* left, const double* right, double* out, size_t n);
+void kernel_binary(KernelOp op, KernelLayout layout, const double* left, const double* right, double* out, size_t n);
+
+// out = left op right over an array of the given shape, reading each operand
+// with its own element strides. A stride of 0 repeats the operand along that
+// dimension, which is how broadcast operands are read without expanding them.
+void kernel_broadcast(KernelOp op, const std::vector<size_t>& shape, const double* left, const std::vector<size_t>& left_strides, const double* right, const std::vector<size_t>& right_strides, double* out);
+
+void kernel_negate(const double* in, double* out, size_t n);
+
+// Folds in[0..n) with KERNEL_ADD, KERNEL_MULTIPLY, KERNEL_MIN or KERNEL_MAX.
+// min and max skip NaNs, so they give +-infinity if every element is NaN.
+double kernel_reduce(const KernelSet& set, KernelOp op, const double* in, size_t n);
+// Runs longer than PARALLEL_GRAIN are reduced a chunk of that length at a
+// time, and the results of the chunks are then reduced
+double kernel_reduce(KernelOp op, const double* in, size_t n);
+double kernel_dot(const double* left, const double* right, size_t n);
+
+#endif // KERNELS_H_
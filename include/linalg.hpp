@@ -0,0 +1,46 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef LINALG_H_
+#define LINALG_H_
+
+#include "variable.hpp"
+#include "token.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Factorizations of dense matrices and the solvers built on them. Each     //
+// factorization works through the matrix a block of columns at a time: the //
+// block is factored with plain loops, and the rest of the matrix is then   //
+// updated with triangular solves and matrix products, which do almost all  //
+// of the arithmetic. Those run on CBLAS when gemm_method picks it for      //
+// their size, and otherwise on native_gemm, which is all the web build     //
+// has. Every function takes its matrix as an f64 copy and gives f64.       //
+//////////////////////////////////////////////////////////////////////////////
+
+// x such that a @ x is b, where b is a vector or a matrix with a row for
+// each row of a. A matrix with more rows than columns gives the least
+// squares solution.
+Variable solve(const Variable& a, const Variable& b, const Token& loc);
+Variable inverse(const Variable& a, const Token& loc);
+Variable determinant(const Variable& a, const Token& loc);
+// The factor named by part ("p", "l" or "u") of the LU factorization with
+// partial pivoting of a square matrix, where a is p @ l @ u
+Variable lu(const Variable& a, const Variable& part, const Token& loc);
+// The lower triangular l of a symmetric positive definite matrix a, where a
+// is l @ transpose(l). Only the lower triangle of a is read.
+Variable cholesky(const Variable& a, const Token& loc);
+// The factor named by part ("q" or "r") of the reduced QR factorization of
+// a, where q has orthonormal columns, r is upper triangular, and a is q @ r
+Variable qr(const Variable& a, const Variable& part, const Token& loc);
+
+#endif // LINALG_H_
@@ -0,0 +1,87 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef OPERATIONS_H_
+#define OPERATIONS_H_
+
+#include <cstdint>
+#include <stdexcept>
+#include <iostream>
+#ifndef WEB_TARGET
+    #include <cblas.h>
+#endif
+#include <string>
+#include <math.h>
+
+#include "variable.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "gemm.hpp"
+#include "token.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// The operations below implement the semantics of Weak's values, and are   //
+// shared by every execution engine (the tree-walking Environment and the   //
+// bytecode VM). Each takes the token to blame if the operation fails, so   //
+// both engines report identical runtime errors.                            //
+//////////////////////////////////////////////////////////////////////////////
+
+std::string create_runtime_error(const std::string& error_msg, const Token& loc);
+
+inline void runtime_assert(bool cond, const Token& loc, const char* error_msg) {
+    if (!cond) throw std::runtime_error(create_runtime_error(error_msg, loc));
+}
+
+// The shape two ndarrays broadcast to: shapes are aligned at their last
+// dimension, and each pair of sizes must match or include a 1, which is
+// stretched to the other size. Missing leading dimensions count as 1s.
+std::vector<size_t> broadcast_shape(const std::vector<size_t>& left, const std::vector<size_t>& right, const Token& loc);
+// Strides reading array as if it had been broadcast to shape
+std::vector<size_t> broadcast_strides(const NDArray& array, const std::vector<size_t>& shape);
+
+// PLUS, MINUS, STAR, SLASH and EXP on doubles and ndarrays, broadcasting
+// ndarrays of different shapes. Operands are
+// taken by value so that an ndarray passed with std::move can be overwritten.
+Variable arithmetic(TokenType op, Variable left, Variable right, const Token& loc);
+// EQUALS_EQUALS, EXCLA_EQUALS, GREATER_EQUALS, GREATER, LESSER_EQUALS and
+// LESSER. == and != compare whole values, giving a bool. The others compare
+// an ndarray with an ndarray or a number element by element, like
+// elementwise_compare.
+Variable compare(TokenType op, const Variable& left, const Variable& right, const Token& loc);
+// Compares numbers and ndarrays element by element with broadcasting, giving
+// a bool ndarray (a mask) that is 1 wherever the comparison holds
+Variable elementwise_compare(TokenType op, const Variable& left, const Variable& right, const Token& loc);
+// Elements of a where mask is nonzero and of b elsewhere, like NumPy's where
+Variable select(const Variable& mask, const Variable& a, const Variable& b, const Token& loc);
+Variable matmul(const Variable& left, const Variable& right, const Token& loc);
+Variable as_shape(const Variable& left, const Variable& right, const Token& loc);
+
+Variable negate(Variable val, const Token& loc);
+Variable logical_not(const Variable& val, const Token& loc);
+Variable shape_of(const Variable& val, const Token& loc);
+Variable transpose(const Variable& val, const Token& loc);
+
+// Reads one element, or if the only index is a bool mask of arr's shape, a
+// 1d array of the elements the mask is set at. Integer ndarrays among the
+// indices gather a block for each of their elements (see indexing.hpp).
+Variable index_read(const Variable& arr, const Variable* indices, size_t num_indices, const Token& loc);
+// Reads a view of arr. Index i is a slice if bit i of slices is set, in which
+// case it takes three entries of parts (start, stop and step, each nil if
+// left out), and otherwise one. Dimensions indexed by a number are dropped.
+Variable slice_read(const Variable& arr, const Variable* parts, size_t num_indices, uint64_t slices, const Token& loc);
+// Writes one element, every element a bool mask is set at, or if integer
+// ndarrays are among the indices, scatters val into the blocks they pick out
+void index_write(Variable& arr, const Variable* indices, size_t num_indices, const Variable& val, const Token& loc);
+
+void print_variable(std::ostream& out, const Variable& var);
+
+#endif // OPERATIONS_H_
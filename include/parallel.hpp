@@ -0,0 +1,55 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <cstddef>
+#include <functional>
+
+//////////////////////////////////////////////////////////////////////////////
+// A pool of worker threads that large kernels are split across. A loop is  //
+// cut into chunks, and each thread starts on its own share of the chunks,  //
+// stealing chunks from the end of another thread's share once its own runs //
+// out. Which thread computes a chunk never changes the result: elementwise //
+// chunks write separate elements, and reductions split their input into    //
+// chunks of a fixed size whatever the number of threads.                   //
+//////////////////////////////////////////////////////////////////////////////
+
+// Loops over fewer elements than this run on the calling thread, and this is
+// the size of the chunks that reductions are split into
+const size_t PARALLEL_GRAIN = 1 << 15;
+
+// The number of threads loops are split across, including the calling one.
+// Defaults to the WEAK_NUM_THREADS environment variable if it's set, or else
+// the number of cores.
+size_t num_threads();
+// Sets the number of threads to use, where 0 means the default
+void set_num_threads(size_t threads);
+
+// Runs a loop on the pool, see parallel_for
+void pool_for(size_t n, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+// Calls body(begin, end) for chunks of at least grain indices covering
+// [0, n), spread across the pool. Returns once every chunk is done. Loops
+// started inside a body run on the thread running that body. body must not
+// throw. Loops too short to split call body directly, without wrapping it in
+// a std::function, which could allocate.
+template <typename F>
+void parallel_for(size_t n, size_t grain, const F& body) {
+    if (n == 0) return;
+    if (n <= grain || num_threads() == 1) return body(0, n);
+    pool_for(n, grain, body);
+}
+
+#endif // PARALLEL_H_
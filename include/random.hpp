@@ -0,0 +1,50 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RANDOM_H_
+#define RANDOM_H_
+
+#include "variable.hpp"
+#include "token.hpp"
+
+#include <cstdint>
+
+//////////////////////////////////////////////////////////////////////////////
+// Random numbers come from Philox4x32-10, a counter-based generator: block //
+// i of a stream is a fixed function of the seed, the stream and i, with no //
+// state carried from one block to the next. Each builtin call draws from a //
+// new stream, and element i of its result only depends on the blocks near //
+// i, so fills are split across threads however they like and still give   //
+// the same numbers for a given seed.                                       //
+//////////////////////////////////////////////////////////////////////////////
+
+// Writes blocks first to first + blocks - 1 of a stream to out, each block as
+// two words. The counter of block i is (low half of i, high half of i, low
+// half of stream, high half of stream) and the key is the halves of seed.
+void philox(uint64_t seed, uint64_t stream, uint64_t first, size_t blocks, uint64_t* out);
+
+// Restarts the random numbers from seed, so the same calls after it give the
+// same numbers. Until seed is called, the seed is picked at random.
+Variable seed_random(const Variable& seed, const Token& loc);
+// The shape arguments below are a number for a 1d ndarray, or an ndarray of
+// sizes as with sa
+
+// An f64 ndarray of numbers uniform in [0, 1)
+Variable random_uniform(const Variable& shape, const Token& loc);
+// An f64 ndarray of numbers from the standard normal distribution
+Variable random_normal(const Variable& shape, const Token& loc);
+// An i64 ndarray of integers uniform in [low, high)
+Variable random_integers(const Variable& low, const Variable& high, const Variable& shape, const Token& loc);
+// A copy of arr with the entries of its first dimension in random order
+Variable shuffle(const Variable& arr, const Token& loc);
+
+#endif // RANDOM_H_
@@ -0,0 +1,52 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef REDUCTIONS_H_
+#define REDUCTIONS_H_
+
+#include "variable.hpp"
+#include "operations.hpp"
+#include "kernels.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Reductions fold the elements of an ndarray into a number, or fold one of //
+// its dimensions away. Whole runs of elements are handed to the reduction  //
+// kernels, and reducing a dimension that isn't the last one folds whole    //
+// rows together with the elementwise kernels, so no element is visited by //
+// interpreted code.                                                        //
+//////////////////////////////////////////////////////////////////////////////
+
+enum Reduction {
+    REDUCE_SUM,
+    REDUCE_PRODUCT,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_MEAN,
+    REDUCE_ARGMIN,
+    REDUCE_ARGMAX,
+    REDUCE_NORM
+};
+
+// Reduces every element of arr to a number, or if axis isn't null, reduces
+// along that dimension to an ndarray without it. min, max and their arg
+// versions skip NaNs. Arrays of every dtype are reduced in f64, and give an
+// f64 result.
+Variable reduce(Reduction op, const Variable& arr, const Variable* axis, const Token& loc);
+// The number of non-zero elements of arr, such as the elements set in a mask
+Variable count_nonzero(const Variable& arr, const Token& loc);
+// Whether any or all elements of arr are non-zero
+Variable any_of(const Variable& arr, const Token& loc);
+Variable all_of(const Variable& arr, const Token& loc);
+// The sum of the products of the elements of two arrays of the same shape
+Variable dot(const Variable& left, const Variable& right, const Token& loc);
+
+#endif // REDUCTIONS_H_
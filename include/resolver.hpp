@@ -0,0 +1,55 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stmt.hpp"
+#include "expr.hpp"
+#include "fusion.hpp"
+#include "util.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// The Resolver runs over the AST produced by the Parser and assigns every  //
+// variable a slot number within the function (or top level) it belongs to. //
+// Weak functions only see their own parameters and locals, so each body is //
+// resolved independently, with its parameters in the first slots. The      //
+// slots are stored on the Var, Assign and VarDecl nodes so that the engines //
+// can keep locals in a flat array instead of looking them up by name. It    //
+// also spots assignments like `mat = mat * 2`, where the variable's old     //
+// value can be handed to the operator instead of copied.                    //
+//////////////////////////////////////////////////////////////////////////////
+
+class Resolver {
+public:
+    Resolver(std::unordered_map<std::string, size_t>& globals);
+    void resolve(const std::vector<Stmt*>& stmts);
+    void resolve(Stmt* stmt);
+    size_t slot(const std::string& name);
+    size_t num_slots();
+private:
+    std::unordered_map<std::string, size_t>& globals;
+    size_t num_globals;
+    std::unordered_map<std::string, size_t>* scope;
+    size_t* scope_slots;
+
+    void resolve_block(const std::vector<Stmt*>& stmts);
+    void resolve_expr(Expr* expr);
+    void mark_last_use(Expr* value, size_t slot);
+    size_t resolve_function(std::vector<const Token*> params, const std::vector<Stmt*>& stmts);
+};
+
+#endif // RESOLVER_H_
@@ -0,0 +1,41 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef SPARSE_H_
+#define SPARSE_H_
+
+#include "variable.hpp"
+#include "token.hpp"
+
+//////////////////////////////////////////////////////////////////////////////
+// Sparse matrices (see SparseMatrix in variable.hpp) are built from the    //
+// coordinates of their entries or from a dense matrix, and multiplied with //
+// dense vectors and matrices by kernels that only visit stored entries, so //
+// a product costs time in proportion to the nonzeros it reads. Products    //
+// are split across the thread pool by rows of the result.                  //
+//////////////////////////////////////////////////////////////////////////////
+
+// A sparse matrix of the given shape (an ndarray of two sizes) with
+// values[n] at row rows[n] and column cols[n], as in the COO format.
+// Values given for the same position are added up, and zeros are dropped.
+Variable sparse_from_coordinates(const Variable& rows, const Variable& cols, const Variable& values, const Variable& shape, const Token& loc);
+// The nonzero elements of a 2d ndarray as a sparse matrix
+Variable sparse_from_dense(const Variable& dense, const Token& loc);
+// A sparse matrix as a 2d f64 ndarray
+Variable sparse_to_dense(const Variable& sparse, const Token& loc);
+// matmul when either operand is sparse: a sparse matrix times a 1d or 2d
+// ndarray, or a 1d or 2d ndarray times a sparse matrix. The result is dense.
+Variable sparse_matmul(const Variable& left, const Variable& right, const Token& loc);
+SparseMatrix sparse_transpose(const SparseMatrix& matrix);
+
+#endif // SPARSE_H_
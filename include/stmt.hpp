@@ -47,6 +47,8 @@ public:
     Token name;
     std::vector<Token> params;
     std::vector<Stmt*> stmts;
+    // Number of local slots (parameters first) used by the body, filled in by the Resolver
+    size_t num_slots;
 };
 
 class If : public Stmt {
@@ -68,6 +70,8 @@ public:
     Token left;
     Token right;
     std::vector<Stmt*> stmts;
+    // Number of local slots (left and right first) used by the body, filled in by the Resolver
+    size_t num_slots;
 };
 
 class Print : public Stmt {
@@ -95,6 +99,8 @@ public:
     std::pair<std::string, std::string> to_string();
     Token name;
     Expr* expr;
+    // Local slot of the declared variable, filled in by the Resolver
+    size_t slot;
 };
 
 class While : public Stmt {
@@ -24,6 +24,7 @@ enum TokenType {
     AT,
     COMMA,
     SEMI,
+    COLON,
     LEFT_PAREN,
     RIGHT_PAREN,
     LEFT_BRACE,
@@ -13,24 +13,141 @@
 #ifndef VARIABLE_H_
 #define VARIABLE_H_
 
+#include "allocator.hpp"
+#include "dtypes.hpp"
+
+#include <algorithm>
+#include <memory>
 #include <variant>
 #include <vector>
 #include <string>
 
+//////////////////////////////////////////////////////////////////////////////
+// NDArray is the payload of an ndarray Variable. The elements live in a    //
+// reference counted buffer, so copying an NDArray (and so a Variable) only //
+// copies its shape. The buffer is copied the first time a shared NDArray   //
+// is written to, which keeps Weak's pass-by-copy semantics. Elements are  //
+// stored in row-major order, and the stride of each dimension is computed  //
+// once up front so indexing is a handful of multiply-adds.                 //
+//                                                                          //
+// An NDArray can also be a view of part of another one's buffer, such as  //
+// the result of slicing. A view starts at an offset into the buffer and    //
+// steps through it with its own strides, so its elements need not be      //
+// contiguous. Code that wants a plain row-major run of elements should     //
+// check is_contiguous() or call contiguous().                              //
+//////////////////////////////////////////////////////////////////////////////
+
+class NDArray {
+public:
+    // An f64 array
+    NDArray(std::vector<double> values, std::vector<size_t> shape);
+    // An array whose elements are left uninitialized, for code that is about
+    // to write every one of them through mutable_data()
+    static NDArray uninitialized(std::vector<size_t> shape, DType dtype = DTYPE_F64);
+    size_t size() const;
+    DType dtype() const;
+    // The first element of an f64 array; the rest are found with strides()
+    const double* data() const;
+    // Like data(), but takes a private (and contiguous) copy of the elements
+    // first if the buffer is shared, which can change strides()
+    double* mutable_data();
+    // data() and mutable_data() for arrays of any dtype
+    const void* raw_data() const;
+    void* mutable_raw_data();
+    const std::vector<size_t>& shape() const;
+    const std::vector<size_t>& strides() const;
+    bool is_shared() const;
+    // Whether the elements are laid out row-major without gaps
+    bool is_contiguous() const;
+    // This array if it's contiguous, otherwise a contiguous copy of it
+    NDArray contiguous() const;
+    // This array if it has the given dtype, otherwise a contiguous copy of it
+    // converted to dtype. Elements that don't fit an i64 become 0, and clear
+    // exact if it's given.
+    NDArray as_dtype(DType dtype, bool* exact = nullptr) const;
+    // A view sharing this array's buffer, starting offset elements after
+    // data() and stepping through it with the given strides
+    NDArray view(size_t offset, std::vector<size_t> shape, std::vector<size_t> strides) const;
+private:
+    typedef std::vector<unsigned char, BufferAllocator<unsigned char>> Buffer;
+    NDArray() = default;
+    std::shared_ptr<Buffer> buffer;
+    DType element_type;
+    size_t start;
+    size_t num_elements;
+    std::vector<size_t> dims;
+    std::vector<size_t> row_strides;
+};
+
+// Ordered like the (values, shape) pair NDArray replaced
+bool operator==(const NDArray& left, const NDArray& right);
+bool operator!=(const NDArray& left, const NDArray& right);
+bool operator<(const NDArray& left, const NDArray& right);
+bool operator>(const NDArray& left, const NDArray& right);
+bool operator<=(const NDArray& left, const NDArray& right);
+bool operator>=(const NDArray& left, const NDArray& right);
+
+//////////////////////////////////////////////////////////////////////////////
+// SparseMatrix is the payload of a sparse matrix Variable: a 2d array of   //
+// f64 elements stored in compressed sparse row (CSR) form, so its memory   //
+// grows with its number of nonzero entries rather than with its size. Row  //
+// r's entries are columns[row_starts[r]] to columns[row_starts[r + 1] - 1] //
+// with the matching values, in increasing order of column. Zeros are never //
+// stored, so two matrices are equal when their CSR arrays are. Sparse      //
+// matrices are never modified once built, and copies share their arrays.   //
+//////////////////////////////////////////////////////////////////////////////
+
+class SparseMatrix {
+public:
+    SparseMatrix(size_t rows, size_t cols, std::vector<size_t> row_starts, std::vector<size_t> columns, std::vector<double> values);
+    size_t rows() const;
+    size_t cols() const;
+    // The number of stored entries
+    size_t nnz() const;
+    const std::vector<size_t>& row_starts() const;
+    const std::vector<size_t>& columns() const;
+    const std::vector<double>& values() const;
+private:
+    struct Storage {
+        size_t rows;
+        size_t cols;
+        std::vector<size_t> row_starts;
+        std::vector<size_t> columns;
+        std::vector<double> values;
+    };
+    std::shared_ptr<const Storage> storage;
+};
+
+// Ordered by shape, then row_starts, columns and values
+bool operator==(const SparseMatrix& left, const SparseMatrix& right);
+bool operator!=(const SparseMatrix& left, const SparseMatrix& right);
+bool operator<(const SparseMatrix& left, const SparseMatrix& right);
+bool operator>(const SparseMatrix& left, const SparseMatrix& right);
+bool operator<=(const SparseMatrix& left, const SparseMatrix& right);
+bool operator>=(const SparseMatrix& left, const SparseMatrix& right);
+
+// An elementwise expression over ndarrays that hasn't been evaluated yet,
+// see fusion.hpp. These only exist while an expression is being evaluated.
+struct LazyArray;
+
 class Variable {
 public:
     Variable();
     Variable(std::string var);
     Variable(bool var);
     Variable(double var);
-    Variable(std::pair<std::vector<double>, std::vector<size_t>> var);
+    Variable(NDArray var);
+    Variable(std::shared_ptr<LazyArray> var);
+    Variable(SparseMatrix var);
     ~Variable() = default;
-    bool is_string();
-    bool is_bool();
-    bool is_double();
-    bool is_ndarray();
-    bool is_nil();
-    std::variant<std::string, bool, double, std::pair<std::vector<double>, std::vector<size_t>>, void*> value;
+    bool is_string() const;
+    bool is_bool() const;
+    bool is_double() const;
+    bool is_ndarray() const;
+    bool is_nil() const;
+    bool is_lazy() const;
+    bool is_sparse() const;
+    std::variant<std::string, bool, double, NDArray, void*, std::shared_ptr<LazyArray>, SparseMatrix> value;
 };
 
 #endif // VARIABLE_H_
@@ -0,0 +1,70 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef VM_H_
+#define VM_H_
+
+#include <bit>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "operations.hpp"
+#include "fusion.hpp"
+#include "builtins.hpp"
+
+// GCC and clang support taking the address of a label, which lets every
+// instruction jump straight to the handler of the next one
+#if defined(__GNUC__) || defined(__clang__)
+    #define WEAK_DIRECT_THREADED
+#endif
+
+class VM {
+public:
+    VM();
+    VM(std::ostream& out_override);
+    void run(Program& program);
+private:
+    struct CallFrame {
+        FunctionProto* proto;
+        const Instruction* ip;
+        size_t base;
+        // Functions and operators declared inside this call, which are
+        // visible to it and to everything it calls until it returns
+        std::unique_ptr<std::unordered_map<uint32_t, FunctionProto*>> local_funcs;
+        std::unique_ptr<std::unordered_map<uint32_t, FunctionProto*>> local_ops;
+    };
+
+    std::vector<Variable> stack;
+    std::vector<Variable> locals;
+    std::vector<char> declared;
+    std::vector<CallFrame> frames;
+    // Callees of the calls whose arguments are being evaluated, with null
+    // standing for the next builtin in pending_builtins
+    std::vector<FunctionProto*> pending_calls;
+    std::vector<const Builtin*> pending_builtins;
+    // The builtin for each name, if there is one
+    std::vector<const Builtin*> builtins;
+    std::vector<FunctionProto*> funcs;
+    std::vector<FunctionProto*> ops;
+    size_t num_local_decls;
+    std::ostream& out;
+
+    FunctionProto* lookup(uint32_t name, bool is_op);
+    void define(uint32_t name, FunctionProto* proto, bool is_op);
+    void push_frame(FunctionProto* proto, size_t num_args);
+    void pop_frame();
+};
+
+#endif // VM_H_
@@ -0,0 +1,156 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "allocator.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#if !defined(WEB_TARGET) && defined(__linux__)
+    #define WEAK_MMAP_BUFFERS
+    #include <sys/mman.h>
+#endif
+
+// Size class c holds buffers of MIN_CLASS_BYTES << c bytes, so the largest
+// pooled buffers are 32MB
+static const size_t MIN_CLASS_BYTES = BUFFER_ALIGNMENT;
+static const size_t NUM_CLASSES = 20;
+// Bounds on the free buffers each thread keeps, past which released buffers
+// go back to the system
+static const size_t MAX_FREE_PER_CLASS = 16;
+static const size_t MAX_FREE_BYTES = 64 << 20;
+
+static std::atomic<size_t> system_allocations (0);
+static std::atomic<size_t> reused (0);
+static std::atomic<size_t> system_frees (0);
+
+static void* system_allocate(size_t bytes) {
+    system_allocations.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(bytes, std::align_val_t(BUFFER_ALIGNMENT));
+}
+
+static void system_free(void* buffer) {
+    system_frees.fetch_add(1, std::memory_order_relaxed);
+    ::operator delete(buffer, std::align_val_t(BUFFER_ALIGNMENT));
+}
+
+#ifdef WEAK_MMAP_BUFFERS
+// Buffers too big to pool are mapped straight from the kernel, aligned to
+// and a multiple of this size, so transparent huge pages can back all of
+// them. Their pages are only faulted in when first written, so the threads
+// filling a new array each fault in the pages they write.
+static const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+static size_t mapped_size(size_t bytes) {
+    return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+static void* map_buffer(size_t bytes) {
+    size_t size = mapped_size(bytes);
+    // Map an extra huge page, then unmap what's either side of an aligned run
+    void* mapped = mmap(nullptr, size + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw std::bad_alloc();
+    char* start = (char*) mapped;
+    char* aligned = (char*) (((uintptr_t) start + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES);
+    if (aligned > start) munmap(start, aligned - start);
+    size_t after = start + size + HUGE_PAGE_BYTES - (aligned + size);
+    if (after) munmap(aligned + size, after);
+#ifdef MADV_HUGEPAGE
+    // Only advice: without transparent huge pages this does nothing
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    system_allocations.fetch_add(1, std::memory_order_relaxed);
+    return aligned;
+}
+#endif
+
+static size_t size_class(size_t bytes) {
+    size_t c = 0;
+    while (c < NUM_CLASSES && (MIN_CLASS_BYTES << c) < bytes) c++;
+    return c;
+}
+
+struct FreeLists {
+    std::vector<void*> lists[NUM_CLASSES];
+    size_t free_bytes = 0;
+    FreeLists();
+    ~FreeLists();
+};
+
+// Buffers can still be released while a thread is exiting, after its free
+// lists are gone, and those go straight back to the system
+static thread_local bool lists_destroyed = false;
+static thread_local FreeLists free_lists;
+
+FreeLists::FreeLists() {
+    // So that releasing a buffer never allocates
+    for (std::vector<void*>& list : lists) list.reserve(MAX_FREE_PER_CLASS);
+}
+
+FreeLists::~FreeLists() {
+    for (std::vector<void*>& list : lists) {
+        for (void* buffer : list) system_free(buffer);
+    }
+    lists_destroyed = true;
+}
+
+void* allocate_buffer(size_t bytes) {
+    size_t c = size_class(bytes);
+    if (c == NUM_CLASSES) {
+#ifdef WEAK_MMAP_BUFFERS
+        return map_buffer(bytes);
+#else
+        return system_allocate((bytes + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT);
+#endif
+    }
+    if (!lists_destroyed && !free_lists.lists[c].empty()) {
+        void* buffer = free_lists.lists[c].back();
+        free_lists.lists[c].pop_back();
+        free_lists.free_bytes -= MIN_CLASS_BYTES << c;
+        reused.fetch_add(1, std::memory_order_relaxed);
+        return buffer;
+    }
+    return system_allocate(MIN_CLASS_BYTES << c);
+}
+
+void free_buffer(void* buffer, size_t bytes) {
+    if (!buffer) return;
+    size_t c = size_class(bytes);
+    if (c < NUM_CLASSES && !lists_destroyed) {
+        std::vector<void*>& list = free_lists.lists[c];
+        size_t class_bytes = MIN_CLASS_BYTES << c;
+        if (list.size() < MAX_FREE_PER_CLASS && free_lists.free_bytes + class_bytes <= MAX_FREE_BYTES) {
+            list.push_back(buffer);
+            free_lists.free_bytes += class_bytes;
+            return;
+        }
+    }
+#ifdef WEAK_MMAP_BUFFERS
+    if (c == NUM_CLASSES) {
+        system_frees.fetch_add(1, std::memory_order_relaxed);
+        munmap(buffer, mapped_size(bytes));
+        return;
+    }
+#endif
+    system_free(buffer);
+}
+
+AllocationCounts allocation_counts() {
+    return AllocationCounts {
+        system_allocations.load(std::memory_order_relaxed),
+        reused.load(std::memory_order_relaxed),
+        system_frees.load(std::memory_order_relaxed)
+    };
+}
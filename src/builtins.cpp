@@ -0,0 +1,103 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include <unordered_map>
+
+#include "builtins.hpp"
+#include "reductions.hpp"
+#include "sparse.hpp"
+#include "linalg.hpp"
+#include "indexing.hpp"
+#include "random.hpp"
+
+template <Reduction op>
+static Variable reduction(const Variable* args, size_t num_args, const Token& loc) {
+    return reduce(op, args[0], num_args > 1 ? &args[1] : nullptr, loc);
+}
+
+template <DType dtype>
+static Variable convert(const Variable* args, size_t, const Token& loc) {
+    runtime_assert(args[0].is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    bool exact = true;
+    NDArray converted = std::get<NDArray>(args[0].value).as_dtype(dtype, &exact);
+    runtime_assert(exact, loc, "An element isn't an integer that fits in an i64");
+    return Variable(std::move(converted));
+}
+
+// == and != compare whole values, so elementwise equality is a builtin
+template <TokenType op>
+static Variable compare_elements(const Variable* args, size_t, const Token& loc) {
+    return elementwise_compare(op, args[0], args[1], loc);
+}
+
+// The name of an array's dtype, quoted like a string literal so that it
+// compares equal to one
+static Variable dtype_of(const Variable* args, size_t, const Token& loc) {
+    runtime_assert(args[0].is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    return Variable('"' + std::string(dtype_name(std::get<NDArray>(args[0].value).dtype())) + '"');
+}
+
+// csr(dense) or csr(rows, cols, values, shape)
+static Variable csr(const Variable* args, size_t num_args, const Token& loc) {
+    if (num_args == 1) return sparse_from_dense(args[0], loc);
+    runtime_assert(num_args == 4, loc, "csr takes a dense matrix, or the rows, columns and values of its entries and a shape");
+    return sparse_from_coordinates(args[0], args[1], args[2], args[3], loc);
+}
+
+static Variable nnz(const Variable* args, size_t, const Token& loc) {
+    runtime_assert(args[0].is_sparse(), loc, "Expression evaluates to a non-sparse matrix");
+    return Variable((double) std::get<SparseMatrix>(args[0].value).nnz());
+}
+
+static const std::unordered_map<std::string, Builtin> builtins = {
+    {"sum", {1, 2, reduction<REDUCE_SUM>}},
+    {"prod", {1, 2, reduction<REDUCE_PRODUCT>}},
+    {"min", {1, 2, reduction<REDUCE_MIN>}},
+    {"max", {1, 2, reduction<REDUCE_MAX>}},
+    {"mean", {1, 2, reduction<REDUCE_MEAN>}},
+    {"argmin", {1, 2, reduction<REDUCE_ARGMIN>}},
+    {"argmax", {1, 2, reduction<REDUCE_ARGMAX>}},
+    {"norm", {1, 2, reduction<REDUCE_NORM>}},
+    {"any", {1, 1, [](const Variable* args, size_t, const Token& loc) { return any_of(args[0], loc); }}},
+    {"all", {1, 1, [](const Variable* args, size_t, const Token& loc) { return all_of(args[0], loc); }}},
+    {"count", {1, 1, [](const Variable* args, size_t, const Token& loc) { return count_nonzero(args[0], loc); }}},
+    {"where", {3, 3, [](const Variable* args, size_t, const Token& loc) { return select(args[0], args[1], args[2], loc); }}},
+    {"scatter_add", {3, 3, [](const Variable* args, size_t, const Token& loc) { return scatter_add(args[0], args[1], args[2], loc); }}},
+    {"equal", {2, 2, compare_elements<EQUALS_EQUALS>}},
+    {"not_equal", {2, 2, compare_elements<EXCLA_EQUALS>}},
+    {"transpose", {1, 1, [](const Variable* args, size_t, const Token& loc) { return transpose(args[0], loc); }}},
+    {"dot", {2, 2, [](const Variable* args, size_t, const Token& loc) { return dot(args[0], args[1], loc); }}},
+    {"f64", {1, 1, convert<DTYPE_F64>}},
+    {"f32", {1, 1, convert<DTYPE_F32>}},
+    {"i64", {1, 1, convert<DTYPE_I64>}},
+    {"bool", {1, 1, convert<DTYPE_BOOL>}},
+    {"dtype", {1, 1, dtype_of}},
+    {"csr", {1, 4, csr}},
+    {"dense", {1, 1, [](const Variable* args, size_t, const Token& loc) { return sparse_to_dense(args[0], loc); }}},
+    {"nnz", {1, 1, nnz}},
+    {"seed", {1, 1, [](const Variable* args, size_t, const Token& loc) { return seed_random(args[0], loc); }}},
+    {"rand", {1, 1, [](const Variable* args, size_t, const Token& loc) { return random_uniform(args[0], loc); }}},
+    {"randn", {1, 1, [](const Variable* args, size_t, const Token& loc) { return random_normal(args[0], loc); }}},
+    {"randint", {3, 3, [](const Variable* args, size_t, const Token& loc) { return random_integers(args[0], args[1], args[2], loc); }}},
+    {"shuffle", {1, 1, [](const Variable* args, size_t, const Token& loc) { return shuffle(args[0], loc); }}},
+    {"solve", {2, 2, [](const Variable* args, size_t, const Token& loc) { return solve(args[0], args[1], loc); }}},
+    {"inv", {1, 1, [](const Variable* args, size_t, const Token& loc) { return inverse(args[0], loc); }}},
+    {"det", {1, 1, [](const Variable* args, size_t, const Token& loc) { return determinant(args[0], loc); }}},
+    {"lu", {2, 2, [](const Variable* args, size_t, const Token& loc) { return lu(args[0], args[1], loc); }}},
+    {"chol", {1, 1, [](const Variable* args, size_t, const Token& loc) { return cholesky(args[0], loc); }}},
+    {"qr", {2, 2, [](const Variable* args, size_t, const Token& loc) { return qr(args[0], args[1], loc); }}}
+};
+
+const Builtin* find_builtin(const std::string& name) {
+    auto found = builtins.find(name);
+    return found == builtins.end() ? nullptr : &found->second;
+}
@@ -0,0 +1,271 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "compiler.hpp"
+
+std::unique_ptr<Program> Compiler::compile(const std::vector<Stmt*>& stmts) {
+    std::unique_ptr<Program> result (new Program());
+    program = result.get();
+    current = nullptr;
+    name_ids.clear();
+    std::unordered_map<std::string, size_t> globals;
+    Resolver resolver(globals);
+    resolver.resolve(stmts);
+    compile_function("", {}, stmts, resolver.num_slots());
+    return result;
+}
+
+/**
+ * Compiles a function body into a new FunctionProto, returning its index in
+ * the program. Each function gets its own set of local slots, since Weak
+ * functions can't see the variables of their caller; the slots themselves
+ * were assigned by the Resolver.
+ */
+uint32_t Compiler::compile_function(std::string name, std::vector<const Token*> params, const std::vector<Stmt*>& stmts, size_t num_slots) {
+    FunctionProto* enclosing = current;
+
+    uint32_t index = program->functions.size();
+    program->functions.emplace_back(new FunctionProto());
+    current = program->functions.back().get();
+    current->name = name;
+    current->arity = params.size();
+    current->num_slots = num_slots;
+
+    compile_block(stmts);
+    emit(OP_NIL);
+    emit(OP_RETURN);
+
+    current = enclosing;
+    return index;
+}
+
+void Compiler::compile_block(const std::vector<Stmt*>& stmts) {
+    for (Stmt* stmt : stmts) compile_stmt(stmt);
+}
+
+void Compiler::compile_stmt(Stmt* stmt) {
+    if (CAN_MAKE(ExprStmt*, exprStmt)_FROM(stmt)) {
+        compile_expr(exprStmt->expr);
+        emit(OP_POP);
+    }
+    else if (CAN_MAKE(FuncDecl*, funcDecl)_FROM(stmt)) {
+        std::vector<const Token*> params;
+        for (const Token& param : funcDecl->params) params.push_back(&param);
+        uint32_t index = compile_function(funcDecl->name.lexeme, params, funcDecl->stmts, funcDecl->num_slots);
+        emit(OP_DEFINE_FUNC, name_id(funcDecl->name.lexeme), index);
+    }
+    else if (CAN_MAKE(If*, ifStmt)_FROM(stmt)) {
+        compile_expr(ifStmt->cond);
+        emit(OP_CHECK_BOOL, 0, CHECK_IF, 0, add_location(ifStmt->keyword));
+        size_t skip = emit(OP_JUMP_IF_FALSE);
+        compile_block(ifStmt->stmts);
+        patch_jump(skip);
+    }
+    else if (CAN_MAKE(OpDecl*, opDecl)_FROM(stmt)) {
+        uint32_t index = compile_function(opDecl->name.lexeme, {&opDecl->left, &opDecl->right}, opDecl->stmts, opDecl->num_slots);
+        emit(OP_DEFINE_OP, name_id(opDecl->name.lexeme), index);
+    }
+    else if (CAN_MAKE(Print*, print)_FROM(stmt)) {
+        compile_expr(print->expr);
+        emit(OP_PRINT);
+    }
+    else if (CAN_MAKE(Return*, returnStmt)_FROM(stmt)) {
+        compile_expr(returnStmt->expr);
+        emit(OP_RETURN);
+    }
+    else if (CAN_MAKE(VarDecl*, varDecl)_FROM(stmt)) {
+        compile_expr(varDecl->expr);
+        emit(OP_DECLARE_LOCAL, varDecl->slot);
+    }
+    else if (CAN_MAKE(While*, whileStmt)_FROM(stmt)) {
+        size_t start = current->code.size();
+        compile_expr(whileStmt->cond);
+        emit(OP_CHECK_BOOL, 0, CHECK_WHILE, 0, add_location(whileStmt->keyword));
+        size_t exit = emit(OP_JUMP_IF_FALSE);
+        compile_block(whileStmt->stmts);
+        emit(OP_JUMP, start);
+        patch_jump(exit);
+    }
+    else if (CAN_MAKE(Assert*, assertStmt)_FROM(stmt)) {
+        uint32_t loc = add_location(assertStmt->keyword);
+        compile_expr(assertStmt->cond);
+        emit(OP_CHECK_BOOL, 0, CHECK_ASSERT, 0, loc);
+        emit(OP_ASSERT, 0, 0, 0, loc);
+    }
+    else {
+        throw std::runtime_error("Couldn't compile statement (compilation for statement type might not be implemented?)");
+    }
+}
+
+void Compiler::compile_expr(Expr* expr) {
+    if (is_elementwise(expr)) {
+        compile_elementwise(expr, true);
+    }
+    else if (CAN_MAKE(ArrAccess*, arrAccess)_FROM(expr)) {
+        uint64_t slices = 0;
+        for (size_t i = 0; i < arrAccess->idx.size(); i++) {
+            if (dynamic_cast<Slice*>(arrAccess->idx[i])) slices |= (uint64_t) 1 << i;
+        }
+        if (slices) {
+            compile_expr(arrAccess->id);
+            for (Expr* index : arrAccess->idx) compile_expr(index);
+            emit(OP_GET_SLICE, arrAccess->idx.size(), (uint32_t) slices, (uint32_t) (slices >> 32), add_location(arrAccess->brack));
+            return;
+        }
+        // Indexing a variable directly avoids pushing the whole array
+        if (CAN_MAKE(Var*, var)_FROM(arrAccess->id)) {
+            emit(OP_CHECK_LOCAL, var->slot, 0, 0, add_location(var->name));
+            for (Expr* index : arrAccess->idx) compile_expr(index);
+            emit(OP_GET_LOCAL_INDEX, var->slot, arrAccess->idx.size(), 0, add_location(arrAccess->brack));
+            return;
+        }
+        compile_expr(arrAccess->id);
+        for (Expr* index : arrAccess->idx) compile_expr(index);
+        emit(OP_GET_INDEX, arrAccess->idx.size(), 0, 0, add_location(arrAccess->brack));
+    }
+    else if (CAN_MAKE(Assign*, assign)_FROM(expr)) {
+        uint32_t loc = add_location(assign->name);
+        uint32_t target = assign->slot;
+        emit(OP_CHECK_LOCAL, target, 0, 0, loc);
+        compile_expr(assign->value);
+        if (assign->idx.size() > 0) {
+            for (Expr* index : assign->idx) compile_expr(index);
+            emit(OP_SET_INDEX, target, assign->idx.size(), 0, loc);
+        }
+        else {
+            emit(OP_SET_LOCAL, target);
+        }
+    }
+    else if (CAN_MAKE(Binary*, binary)_FROM(expr)) {
+        uint32_t loc = add_location(binary->op);
+        compile_expr(binary->left);
+        if (binary->op.type == OR || binary->op.type == AND) {
+            emit(OP_CHECK_BOOL, 0, CHECK_LEFT, 0, loc);
+            size_t short_circuit = emit(binary->op.type == OR ? OP_OR_JUMP : OP_AND_JUMP);
+            compile_expr(binary->right);
+            emit(OP_CHECK_BOOL, 0, CHECK_RIGHT, 0, loc);
+            patch_jump(short_circuit);
+            return;
+        }
+        compile_expr(binary->right);
+        switch (binary->op.type) {
+        case IDENTIFIER: emit(OP_CALL_OP, name_id(binary->op.lexeme), 0, 0, loc); break;
+        case EQUALS_EQUALS: emit(OP_EQUAL, 0, 0, 0, loc); break;
+        case EXCLA_EQUALS: emit(OP_NOT_EQUAL, 0, 0, 0, loc); break;
+        case GREATER_EQUALS: emit(OP_GREATER_EQUAL, 0, 0, 0, loc); break;
+        case GREATER: emit(OP_GREATER, 0, 0, 0, loc); break;
+        case LESSER_EQUALS: emit(OP_LESS_EQUAL, 0, 0, 0, loc); break;
+        case LESSER: emit(OP_LESS, 0, 0, 0, loc); break;
+        case AT: emit(OP_MATMUL, 0, 0, 0, loc); break;
+        case AS_SHAPE: emit(OP_AS_SHAPE, 0, 0, 0, loc); break;
+        default: throw std::runtime_error(create_runtime_error("Invalid binary operator", binary->op));
+        }
+    }
+    else if (CAN_MAKE(Func*, func)_FROM(expr)) {
+        emit(OP_PREPARE_CALL, name_id(func->func.lexeme), func->args.size(), add_location(func->paren), add_location(func->func));
+        for (Expr* arg : func->args) compile_expr(arg);
+        emit(OP_CALL, func->args.size(), 0, 0, add_location(func->func));
+    }
+    else if (CAN_MAKE(Literal*, literal)_FROM(expr)) {
+        switch (literal->literal_type) {
+        case LITERAL_STRING: emit(OP_CONSTANT, add_constant(Variable(literal->string_val))); break;
+        case LITERAL_DOUBLE: emit(OP_CONSTANT, add_constant(Variable(literal->double_val))); break;
+        case LITERAL_BOOL: emit(OP_CONSTANT, add_constant(Variable(literal->bool_val))); break;
+        case LITERAL_ARRAY: {
+            for (Expr* element : literal->array_vals) compile_expr(element);
+            emit(OP_ARRAY, literal->array_vals.size(), 0, 0, add_location(literal->token));
+            break;
+        }
+        }
+    }
+    else if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        compile_expr(unary->right);
+        uint32_t loc = add_location(unary->op);
+        switch (unary->op.type) {
+        case EXCLA: emit(OP_NOT, 0, 0, 0, loc); break;
+        case SHAPE: emit(OP_SHAPE, 0, 0, 0, loc); break;
+        default: throw std::runtime_error(create_runtime_error("Invalid unary operator", unary->op));
+        }
+    }
+    else if (CAN_MAKE(Slice*, slice)_FROM(expr)) {
+        // The parts of a slice are pushed for the OP_GET_SLICE that follows
+        for (Expr* part : {slice->start, slice->stop, slice->step}) {
+            if (part) compile_expr(part);
+            else emit(OP_NIL);
+        }
+    }
+    else if (CAN_MAKE(Var*, var)_FROM(expr)) {
+        emit(var->last_use ? OP_MOVE_LOCAL : OP_GET_LOCAL, var->slot, 0, 0, add_location(var->name));
+    }
+    else if (dynamic_cast<Nil*>(expr)) {
+        emit(OP_NIL);
+    }
+    else {
+        throw std::runtime_error("Couldn't compile expression (compilation for expression type might not be implemented?)");
+    }
+}
+
+/**
+ * Compiles a tree of +, -, *, / and ^ operators (and unary minus). Every
+ * operator below the root gets c = 1, telling the VM it may leave an ndarray
+ * result lazy, so the root can compute the whole expression at once.
+ */
+void Compiler::compile_elementwise(Expr* expr, bool root) {
+    if (!is_elementwise(expr)) {
+        compile_expr(expr);
+        return;
+    }
+    if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        compile_elementwise(unary->right, false);
+        emit(OP_NEGATE, 0, 0, !root, add_location(unary->op));
+        return;
+    }
+    Binary* binary = static_cast<Binary*>(expr);
+    uint32_t loc = add_location(binary->op);
+    compile_elementwise(binary->left, false);
+    compile_elementwise(binary->right, false);
+    switch (binary->op.type) {
+    case MINUS: emit(OP_SUBTRACT, 0, 0, !root, loc); break;
+    case PLUS: emit(OP_ADD, 0, 0, !root, loc); break;
+    case SLASH: emit(OP_DIVIDE, 0, 0, !root, loc); break;
+    case STAR: emit(OP_MULTIPLY, 0, 0, !root, loc); break;
+    case EXP: emit(OP_POWER, 0, 0, !root, loc); break;
+    default: throw std::runtime_error(create_runtime_error("Invalid binary operator", binary->op));
+    }
+}
+
+size_t Compiler::emit(OpCode op, uint32_t a, uint32_t b, uint32_t c, uint32_t loc) {
+    current->code.push_back(Instruction {nullptr, op, a, b, c, loc});
+    return current->code.size() - 1;
+}
+
+void Compiler::patch_jump(size_t jump) {
+    current->code.at(jump).a = current->code.size();
+}
+
+uint32_t Compiler::add_constant(Variable constant) {
+    program->constants.push_back(constant);
+    return program->constants.size() - 1;
+}
+
+uint32_t Compiler::add_location(const Token& token) {
+    program->locations.push_back(token);
+    return program->locations.size() - 1;
+}
+
+uint32_t Compiler::name_id(const std::string& name) {
+    auto found = name_ids.find(name);
+    if (found != name_ids.end()) return found->second;
+    name_ids.insert(std::pair<std::string, uint32_t>(name, program->names.size()));
+    program->names.push_back(name);
+    return program->names.size() - 1;
+}
@@ -0,0 +1,453 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "dtypes.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <type_traits>
+
+// Calls f with a value of the C++ type holding elements of dtype
+template <typename F>
+static auto visit_dtype(DType dtype, F f) {
+    switch (dtype) {
+    case DTYPE_F32: return f(float());
+    case DTYPE_I64: return f(int64_t());
+    case DTYPE_BOOL: return f(uint8_t());
+    default: return f(double());
+    }
+}
+
+size_t dtype_size(DType dtype) {
+    return visit_dtype(dtype, [](auto element) { return sizeof(element); });
+}
+
+const char* dtype_name(DType dtype) {
+    switch (dtype) {
+    case DTYPE_F32: return "f32";
+    case DTYPE_I64: return "i64";
+    case DTYPE_BOOL: return "bool";
+    default: return "f64";
+    }
+}
+
+DType promote(DType left, DType right) {
+    if (left == right) return left;
+    if (left == DTYPE_F64 || right == DTYPE_F64) return DTYPE_F64;
+    if (left == DTYPE_F32 || right == DTYPE_F32) {
+        return left == DTYPE_BOOL || right == DTYPE_BOOL ? DTYPE_F32 : DTYPE_F64;
+    }
+    return DTYPE_I64;
+}
+
+// Whether value is an integer an int64_t can hold
+static bool is_integer(double value) {
+    return value >= -9223372036854775808.0 && value < 9223372036854775808.0 && value == (double) (int64_t) value;
+}
+
+DType promote_scalar(DType array, double scalar) {
+    if (array == DTYPE_F64 || array == DTYPE_F32) return array;
+    return is_integer(scalar) ? DTYPE_I64 : DTYPE_F64;
+}
+
+DType arithmetic_dtype(KernelOp op, DType operands) {
+    if (operands == DTYPE_F64 || operands == DTYPE_F32) return operands;
+    if (op == KERNEL_DIVIDE || op == KERNEL_POWER) return DTYPE_F64;
+    return DTYPE_I64;
+}
+
+double load_element(DType dtype, const void* in) {
+    return visit_dtype(dtype, [&](auto element) { return (double) *(const decltype(element)*) in; });
+}
+
+// Converts one element, setting ok to false if it doesn't fit
+template <typename To, typename From>
+static To convert(From value, bool& ok) {
+    if constexpr (std::is_same_v<To, uint8_t>) {
+        return value != 0;
+    }
+    else if constexpr (std::is_same_v<To, int64_t> && std::is_floating_point_v<From>) {
+        if (!is_integer(value)) {
+            ok = false;
+            return 0;
+        }
+        return (int64_t) value;
+    }
+    else {
+        return (To) value;
+    }
+}
+
+bool store_element(DType dtype, double value, void* out) {
+    bool ok = true;
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        T converted = convert<T>(value, ok);
+        if (ok) *(T*) out = converted;
+    });
+    return ok;
+}
+
+bool convert_elements(DType from, const void* in, DType to, void* out, size_t n) {
+    std::atomic<bool> failed (false);
+    visit_dtype(from, [&](auto from_element) {
+        visit_dtype(to, [&](auto to_element) {
+            typedef decltype(from_element) From;
+            typedef decltype(to_element) To;
+            const From* source = (const From*) in;
+            To* dest = (To*) out;
+            parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+                bool ok = true;
+                for (size_t i = begin; i < end; i++) dest[i] = convert<To>(source[i], ok);
+                if (!ok) failed = true;
+            });
+        });
+    });
+    return !failed;
+}
+
+// Integers wrap around rather than overflowing, which would be undefined
+template <typename T, KernelOp OP>
+static inline T apply(T a, T b) {
+    if constexpr (std::is_integral_v<T>) {
+        if constexpr (OP == KERNEL_ADD) return (T) ((uint64_t) a + (uint64_t) b);
+        if constexpr (OP == KERNEL_SUBTRACT) return (T) ((uint64_t) a - (uint64_t) b);
+        if constexpr (OP == KERNEL_MULTIPLY) return (T) ((uint64_t) a * (uint64_t) b);
+    }
+    else {
+        if constexpr (OP == KERNEL_ADD) return a + b;
+        if constexpr (OP == KERNEL_SUBTRACT) return a - b;
+        if constexpr (OP == KERNEL_MULTIPLY) return a * b;
+        if constexpr (OP == KERNEL_DIVIDE) return a / b;
+        if constexpr (OP == KERNEL_POWER) return std::pow(a, b);
+    }
+    // Like the f64 kernels, min and max keep a when the comparison fails
+    if constexpr (OP == KERNEL_MIN) return a < b ? a : b;
+    if constexpr (OP == KERNEL_MAX) return a > b ? a : b;
+    return a;
+}
+
+template <typename T, KernelOp OP>
+static void binary_run(KernelLayout layout, const T* left, const T* right, T* out, size_t n) {
+    if (layout == SCALAR_ARRAY) {
+        T scalar = *left;
+        for (size_t i = 0; i < n; i++) out[i] = apply<T, OP>(scalar, right[i]);
+    }
+    else if (layout == ARRAY_SCALAR) {
+        T scalar = *right;
+        for (size_t i = 0; i < n; i++) out[i] = apply<T, OP>(left[i], scalar);
+    }
+    else {
+        for (size_t i = 0; i < n; i++) out[i] = apply<T, OP>(left[i], right[i]);
+    }
+}
+
+template <typename T>
+static void binary_run(KernelOp op, KernelLayout layout, const T* left, const T* right, T* out, size_t n) {
+    switch (op) {
+    case KERNEL_ADD: return binary_run<T, KERNEL_ADD>(layout, left, right, out, n);
+    case KERNEL_SUBTRACT: return binary_run<T, KERNEL_SUBTRACT>(layout, left, right, out, n);
+    case KERNEL_MULTIPLY: return binary_run<T, KERNEL_MULTIPLY>(layout, left, right, out, n);
+    case KERNEL_MIN: return binary_run<T, KERNEL_MIN>(layout, left, right, out, n);
+    case KERNEL_MAX: return binary_run<T, KERNEL_MAX>(layout, left, right, out, n);
+    default: break;
+    }
+    if constexpr (std::is_floating_point_v<T>) {
+        if (op == KERNEL_DIVIDE) return binary_run<T, KERNEL_DIVIDE>(layout, left, right, out, n);
+        if (op == KERNEL_POWER) return binary_run<T, KERNEL_POWER>(layout, left, right, out, n);
+    }
+}
+
+void typed_binary(DType dtype, KernelOp op, KernelLayout layout, const void* left, const void* right, void* out, size_t n) {
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        const T* l = (const T*) left;
+        const T* r = (const T*) right;
+        parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            binary_run<T>(op, layout, layout == SCALAR_ARRAY ? l : l + begin, layout == ARRAY_SCALAR ? r : r + begin, (T*) out + begin, end - begin);
+        });
+    });
+}
+
+/**
+ * Runs each row of the result (its last dimension) on binary_run when both
+ * operands step through the row by 0 or 1 elements, and element by element
+ * otherwise.
+ */
+void typed_broadcast(DType dtype, KernelOp op, const std::vector<size_t>& shape, const void* left, const std::vector<size_t>& left_strides, const void* right, const std::vector<size_t>& right_strides, void* out) {
+    size_t dims = shape.size();
+    size_t inner = dims ? shape[dims - 1] : 1;
+    size_t size = 1;
+    for (size_t d : shape) size *= d;
+    if (size == 0) return;
+    size_t outer = size / inner;
+    size_t left_step = dims ? left_strides[dims - 1] : 0;
+    size_t right_step = dims ? right_strides[dims - 1] : 0;
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        parallel_for(outer, std::max<size_t>(PARALLEL_GRAIN / inner, 1), [&](size_t begin, size_t end) {
+            for (size_t row = begin; row < end; row++) {
+                size_t left_offset = 0, right_offset = 0;
+                for (size_t d = dims - 1, rest = row; d-- > 0;) {
+                    size_t index = rest % shape[d];
+                    rest /= shape[d];
+                    left_offset += index * left_strides[d];
+                    right_offset += index * right_strides[d];
+                }
+                const T* l = (const T*) left + left_offset;
+                const T* r = (const T*) right + right_offset;
+                T* o = (T*) out + row * inner;
+                if (left_step <= 1 && right_step <= 1 && left_step + right_step > 0) {
+                    KernelLayout layout = !left_step ? SCALAR_ARRAY : !right_step ? ARRAY_SCALAR : ARRAY_ARRAY;
+                    binary_run<T>(op, layout, l, r, o, inner);
+                    continue;
+                }
+                for (size_t i = 0; i < inner; i++) binary_run<T>(op, ARRAY_ARRAY, l + i * left_step, r + i * right_step, o + i, 1);
+            }
+        });
+    });
+}
+
+void typed_negate(DType dtype, const void* in, void* out, size_t n) {
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        const T* source = (const T*) in;
+        T* dest = (T*) out;
+        parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if constexpr (std::is_integral_v<T>) dest[i] = (T) (0 - (uint64_t) source[i]);
+                else dest[i] = -source[i];
+            }
+        });
+    });
+}
+
+/**
+ * Splits the elements of an array of the given shape into runs along its
+ * last dimension, and the runs across the thread pool, calling run(offsets,
+ * start, len) for each with operand k's first element at offsets[k] through
+ * strides[k]. Long rows are split too, so a 1d array still uses every thread.
+ */
+template <size_t N, typename F>
+static void broadcast_runs(const std::vector<size_t>& shape, const std::vector<size_t>* const (&strides)[N], F run) {
+    size_t dims = shape.size();
+    size_t inner = dims ? shape[dims - 1] : 1;
+    size_t size = 1;
+    for (size_t d : shape) size *= d;
+    if (size == 0) return;
+    parallel_for(size, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t start = begin; start < end;) {
+            size_t row = start / inner, col = start % inner;
+            size_t len = std::min(inner - col, end - start);
+            size_t offsets[N];
+            for (size_t k = 0; k < N; k++) offsets[k] = dims ? col * (*strides[k])[dims - 1] : 0;
+            for (size_t d = dims ? dims - 1 : 0, rest = row; d-- > 0;) {
+                size_t index = rest % shape[d];
+                rest /= shape[d];
+                for (size_t k = 0; k < N; k++) offsets[k] += index * (*strides[k])[d];
+            }
+            run(offsets, start, len);
+            start += len;
+        }
+    });
+}
+
+// The step between consecutive elements of a run, by strides
+static size_t run_step(const std::vector<size_t>& strides) {
+    return strides.empty() ? 0 : strides.back();
+}
+
+template <typename T, CompareOp OP>
+static inline uint8_t test(T a, T b) {
+    if constexpr (OP == COMPARE_LESS) return a < b;
+    if constexpr (OP == COMPARE_LESS_EQUAL) return a <= b;
+    if constexpr (OP == COMPARE_GREATER) return a > b;
+    if constexpr (OP == COMPARE_GREATER_EQUAL) return a >= b;
+    if constexpr (OP == COMPARE_EQUAL) return a == b;
+    return a != b;
+}
+
+// Runs whose operands step by 0 or 1 get loops the compiler can vectorize
+template <typename T, CompareOp OP>
+static void compare_run(const T* left, size_t left_step, const T* right, size_t right_step, uint8_t* out, size_t n) {
+    if (left_step == 1 && right_step == 1) {
+        for (size_t i = 0; i < n; i++) out[i] = test<T, OP>(left[i], right[i]);
+    }
+    else if (left_step == 0 && right_step == 1) {
+        T scalar = *left;
+        for (size_t i = 0; i < n; i++) out[i] = test<T, OP>(scalar, right[i]);
+    }
+    else if (left_step == 1 && right_step == 0) {
+        T scalar = *right;
+        for (size_t i = 0; i < n; i++) out[i] = test<T, OP>(left[i], scalar);
+    }
+    else {
+        for (size_t i = 0; i < n; i++) out[i] = test<T, OP>(left[i * left_step], right[i * right_step]);
+    }
+}
+
+template <typename T>
+static void compare_run(CompareOp op, const T* left, size_t left_step, const T* right, size_t right_step, uint8_t* out, size_t n) {
+    switch (op) {
+    case COMPARE_LESS: return compare_run<T, COMPARE_LESS>(left, left_step, right, right_step, out, n);
+    case COMPARE_LESS_EQUAL: return compare_run<T, COMPARE_LESS_EQUAL>(left, left_step, right, right_step, out, n);
+    case COMPARE_GREATER: return compare_run<T, COMPARE_GREATER>(left, left_step, right, right_step, out, n);
+    case COMPARE_GREATER_EQUAL: return compare_run<T, COMPARE_GREATER_EQUAL>(left, left_step, right, right_step, out, n);
+    case COMPARE_EQUAL: return compare_run<T, COMPARE_EQUAL>(left, left_step, right, right_step, out, n);
+    default: return compare_run<T, COMPARE_NOT_EQUAL>(left, left_step, right, right_step, out, n);
+    }
+}
+
+void typed_compare(DType dtype, CompareOp op, const std::vector<size_t>& shape, const void* left, const std::vector<size_t>& left_strides, const void* right, const std::vector<size_t>& right_strides, uint8_t* out) {
+    size_t left_step = run_step(left_strides), right_step = run_step(right_strides);
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        broadcast_runs(shape, {&left_strides, &right_strides}, [&](const size_t* offsets, size_t start, size_t len) {
+            compare_run<T>(op, (const T*) left + offsets[0], left_step, (const T*) right + offsets[1], right_step, out + start, len);
+        });
+    });
+}
+
+void typed_select(DType dtype, const std::vector<size_t>& shape, const uint8_t* mask, const std::vector<size_t>& mask_strides, const void* a, const std::vector<size_t>& a_strides, const void* b, const std::vector<size_t>& b_strides, void* out) {
+    size_t mask_step = run_step(mask_strides), a_step = run_step(a_strides), b_step = run_step(b_strides);
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        broadcast_runs(shape, {&mask_strides, &a_strides, &b_strides}, [&](const size_t* offsets, size_t start, size_t len) {
+            const uint8_t* m = mask + offsets[0];
+            const T* x = (const T*) a + offsets[1];
+            const T* y = (const T*) b + offsets[2];
+            T* o = (T*) out + start;
+            if (mask_step == 1 && a_step == 1 && b_step == 1) {
+                for (size_t i = 0; i < len; i++) o[i] = m[i] ? x[i] : y[i];
+            }
+            else if (mask_step == 1 && a_step <= 1 && b_step == 0) {
+                for (size_t i = 0; i < len; i++) o[i] = m[i] ? x[i * a_step] : *y;
+            }
+            else {
+                for (size_t i = 0; i < len; i++) o[i] = m[i * mask_step] ? x[i * a_step] : y[i * b_step];
+            }
+        });
+    });
+}
+
+size_t count_set(const uint8_t* mask, size_t n) {
+    std::atomic<size_t> total (0);
+    parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        size_t count = 0;
+        for (size_t i = begin; i < end; i++) count += mask[i] != 0;
+        total += count;
+    });
+    return total;
+}
+
+/**
+ * Each chunk of PARALLEL_GRAIN elements is counted, so every chunk knows
+ * where its elements go, and the chunks are then copied in parallel. The
+ * copy writes every element and only moves on past the ones to keep, which
+ * has no branch for the CPU to mispredict.
+ */
+size_t typed_compress(DType dtype, const void* in, const uint8_t* mask, size_t n, void* out) {
+    size_t chunks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    std::vector<size_t> starts (chunks + 1, 0);
+    parallel_for(chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            size_t first = c * PARALLEL_GRAIN;
+            starts[c + 1] = count_set(mask + first, std::min(PARALLEL_GRAIN, n - first));
+        }
+    });
+    for (size_t c = 0; c < chunks; c++) starts[c + 1] += starts[c];
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        const T* source = (const T*) in;
+        T* dest = (T*) out;
+        parallel_for(chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++) {
+                size_t at = starts[c];
+                size_t last = std::min((c + 1) * PARALLEL_GRAIN, n);
+                for (size_t i = c * PARALLEL_GRAIN; i < last; i++) {
+                    // The final kept element may be followed by one that
+                    // isn't, which mustn't be written past the end
+                    if (at == starts[c + 1]) break;
+                    dest[at] = source[i];
+                    at += mask[i] != 0;
+                }
+            }
+        });
+    });
+    return starts[chunks];
+}
+
+void typed_fill_masked(DType dtype, const void* value, const uint8_t* mask, size_t n, void* out) {
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        T fill = *(const T*) value;
+        T* dest = (T*) out;
+        parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) dest[i] = mask[i] ? fill : dest[i];
+        });
+    });
+}
+
+void typed_gather(DType dtype, const void* in, const size_t* offsets, size_t count, size_t block, void* out) {
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        const T* source = (const T*) in;
+        T* dest = (T*) out;
+        parallel_for(count, std::max<size_t>(PARALLEL_GRAIN / std::max<size_t>(block, 1), 1), [&](size_t begin, size_t end) {
+            if (block == 1) {
+                for (size_t i = begin; i < end; i++) dest[i] = source[offsets[i]];
+                return;
+            }
+            for (size_t i = begin; i < end; i++) std::copy(source + offsets[i], source + offsets[i] + block, dest + i * block);
+        });
+    });
+}
+
+// Writes the blocks starting in elements low to high of out, in order
+template <typename T, bool ADD>
+static void scatter_range(T* out, size_t low, size_t high, const size_t* offsets, size_t count, size_t block, const T* values, size_t step) {
+    for (size_t i = 0; i < count; i++) {
+        size_t at = offsets[i];
+        if (at < low || at >= high) continue;
+        const T* from = values + i * block * step;
+        for (size_t j = 0; j < block; j++) {
+            if constexpr (ADD) out[at + j] += from[j * step];
+            else out[at + j] = from[j * step];
+        }
+    }
+}
+
+/**
+ * Threads can't write blocks in whatever order they reach them, since an
+ * offset can repeat. Instead each thread owns a range of the rows of out and
+ * goes through every offset in order, writing only the blocks in its range,
+ * so each element sees its writes in the same order on any number of threads.
+ */
+void typed_scatter(DType dtype, void* out, size_t n, const size_t* offsets, size_t count, size_t block, const void* values, bool scalar, bool add) {
+    if (n == 0 || block == 0) return;
+    size_t rows = n / block;
+    size_t parts = count * block < PARALLEL_GRAIN ? 1 : std::min(num_threads(), rows);
+    size_t step = scalar ? 0 : 1;
+    visit_dtype(dtype, [&](auto element) {
+        typedef decltype(element) T;
+        parallel_for(parts, 1, [&](size_t begin, size_t end) {
+            for (size_t part = begin; part < end; part++) {
+                size_t low = rows * part / parts * block, high = rows * (part + 1) / parts * block;
+                if (add) scatter_range<T, true>((T*) out, low, high, offsets, count, block, (const T*) values, step);
+                else scatter_range<T, false>((T*) out, low, high, offsets, count, block, (const T*) values, step);
+            }
+        });
+    });
+}
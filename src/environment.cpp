@@ -12,20 +12,81 @@
 
 #include "environment.hpp"
 
-Environment::Environment(): return_val(), hit_return(false), out(std::cout) {}
+Environment::Environment(): return_val(), hit_return(false), num_local_decls(0), resolver(var_symbol_table), out(std::cout) {
+    frames.push_back(CallFrame {0, nullptr, nullptr});
+}
 
-Environment::Environment(std::ostream& out_override): return_val(), hit_return(false), out(out_override) {}
+Environment::Environment(std::ostream& out_override): return_val(), hit_return(false), num_local_decls(0), resolver(var_symbol_table), out(out_override) {
+    frames.push_back(CallFrame {0, nullptr, nullptr});
+}
 
+/**
+ * Functions declared at the top level go into func_symbol_table, which is
+ * shared by every call. Functions declared inside a call go into that call's
+ * frame, unless a visible function already has the same name.
+ */
 void Environment::add_func(std::string name, FuncDecl* func) {
-    func_symbol_table.insert(std::pair<std::string, FuncDecl*>(name, func));
+    if (frames.size() == 1) {
+        func_symbol_table.insert(std::pair<std::string, FuncDecl*>(name, func));
+        return;
+    }
+    if (lookup_func(name)) return;
+    auto& table = frames.back().local_funcs;
+    if (!table) {
+        table.reset(new std::unordered_map<std::string, FuncDecl*>());
+        num_local_decls++;
+    }
+    table->insert(std::pair<std::string, FuncDecl*>(name, func));
 }
 
 void Environment::add_op(std::string name, OpDecl* op) {
-    op_symbol_table.insert(std::pair<std::string, OpDecl*>(name, op));
+    if (frames.size() == 1) {
+        op_symbol_table.insert(std::pair<std::string, OpDecl*>(name, op));
+        return;
+    }
+    if (lookup_op(name)) return;
+    auto& table = frames.back().local_ops;
+    if (!table) {
+        table.reset(new std::unordered_map<std::string, OpDecl*>());
+        num_local_decls++;
+    }
+    table->insert(std::pair<std::string, OpDecl*>(name, op));
+}
+
+FuncDecl* Environment::lookup_func(const std::string& name) {
+    if (num_local_decls > 0) {
+        for (size_t i = frames.size(); i-- > 1;) {
+            if (!frames[i].local_funcs) continue;
+            auto found = frames[i].local_funcs->find(name);
+            if (found != frames[i].local_funcs->end()) return found->second;
+        }
+    }
+    auto found = func_symbol_table.find(name);
+    return found != func_symbol_table.end() ? found->second : nullptr;
+}
+
+OpDecl* Environment::lookup_op(const std::string& name) {
+    if (num_local_decls > 0) {
+        for (size_t i = frames.size(); i-- > 1;) {
+            if (!frames[i].local_ops) continue;
+            auto found = frames[i].local_ops->find(name);
+            if (found != frames[i].local_ops->end()) return found->second;
+        }
+    }
+    auto found = op_symbol_table.find(name);
+    return found != op_symbol_table.end() ? found->second : nullptr;
 }
 
 void Environment::add_var(std::string name, Variable var) {
-    var_symbol_table.insert(std::pair<std::string, Variable>(name, var));
+    size_t slot = frames.back().base + resolver.slot(name);
+    if (slot >= slots.size()) {
+        slots.resize(slot + 1);
+        declared.resize(slot + 1, false);
+    }
+    if (!declared.at(slot)) {
+        slots.at(slot) = var;
+        declared.at(slot) = true;
+    }
 }
 
 bool Environment::has_hit_return() {
@@ -36,7 +97,19 @@ Variable Environment::get_return_val() {
     return return_val;
 }
 
+/**
+ * Executes a top level statement. Its variables are resolved to slots first,
+ * so nothing below this point looks variables up by name.
+ */
 void Environment::execute_stmt(Stmt* stmt) {
+    if (hit_return) return;
+    resolver.resolve(stmt);
+    slots.resize(resolver.num_slots());
+    declared.resize(resolver.num_slots(), false);
+    execute(stmt);
+}
+
+void Environment::execute(Stmt* stmt) {
     if (hit_return) return;
     if (CAN_MAKE(ExprStmt*, exprStmt)_FROM(stmt)) {
 		evaluate_expr(exprStmt->expr);
@@ -49,7 +122,7 @@ void Environment::execute_stmt(Stmt* stmt) {
 		runtime_assert(cond.is_bool(), ifStmt->keyword, "If statement expected a boolean condition");
 		if (std::get<bool>(cond.value)) {
 			for (Stmt* stmtInIf : ifStmt->stmts) {
-				execute_stmt(stmtInIf);
+				execute(stmtInIf);
 			}
 		}
     }
@@ -57,41 +130,30 @@ void Environment::execute_stmt(Stmt* stmt) {
 		add_op(opDecl->name.lexeme, opDecl);
     }
     else if (CAN_MAKE(Print*, print)_FROM(stmt)) {
-		Variable to_print = evaluate_expr(print->expr);
-		if (to_print.is_bool()) out << (std::get<bool>(to_print.value) ? "True" : "False") << std::endl;
-		else if (to_print.is_double()) out << std::get<double>(to_print.value) << std::endl;
-		else if (to_print.is_string()) out << std::get<std::string>(to_print.value) << std::endl;
-		else if (to_print.is_ndarray()) {
-			auto pair = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(to_print.value);
-			out << '[';
-			for (size_t i = 0; i < pair.first.size(); i++) {
-				out << pair.first.at(i);
-				if (i < pair.first.size() - 1) out << ", ";
-			}
-			out << "] sa [";
-			for (size_t i = 0; i < pair.second.size(); i++) {
-				out << pair.second.at(i);
-				if (i < pair.second.size() - 1) out << ", ";
-			}
-			out << ']' << std::endl;
-		}
-		else out << "Nil" << std::endl;
+		print_variable(out, evaluate_expr(print->expr));
     }
     else if (CAN_MAKE(Return*, returnStmt)_FROM(stmt)) {
-		hit_return = true;
 		return_val = evaluate_expr(returnStmt->expr);
+		hit_return = true;
     }
     else if (CAN_MAKE(VarDecl*, varDecl)_FROM(stmt)) {
-		add_var(varDecl->name.lexeme, evaluate_expr(varDecl->expr));
+		Variable val = evaluate_expr(varDecl->expr);
+		size_t slot = frames.back().base + varDecl->slot;
+		if (!declared[slot]) {
+			slots[slot] = val;
+			declared[slot] = true;
+		}
     }
     else if (CAN_MAKE(While*, whileStmt)_FROM(stmt)) {
 		Variable cond = evaluate_expr(whileStmt->cond);
 		runtime_assert(cond.is_bool(), whileStmt->keyword, "While statement expected a boolean condition");
 		while (std::get<bool>(cond.value)) {
 			for (Stmt* stmtInWhile : whileStmt->stmts) {
-				execute_stmt(stmtInWhile);
+				execute(stmtInWhile);
 			}
+			if (hit_return) break;
 			cond = evaluate_expr(whileStmt->cond);
+			runtime_assert(cond.is_bool(), whileStmt->keyword, "While statement expected a boolean condition");
 		}
     }
 	else if(CAN_MAKE(Assert*, assertStmt)_FROM(stmt)) {
@@ -103,52 +165,51 @@ void Environment::execute_stmt(Stmt* stmt) {
 
 Variable Environment::evaluate_expr(Expr* expr) {
     if (CAN_MAKE(ArrAccess*, arrAccess)_FROM(expr)) {
-		Variable var = evaluate_expr(arrAccess->id);
-		runtime_assert(var.is_ndarray(), arrAccess->brack, "Identifier in array access isn't an ndarray");
-		auto arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(var.value);
-		runtime_assert(arr.second.size() == arrAccess->idx.size(), arrAccess->brack, "Number of dimensions in array element access differs from number of dimensions in array");
-		std::vector<size_t> indices;
-		for (size_t i = 0; i < arrAccess->idx.size(); i++) {
-			Expr* index = arrAccess->idx.at(i);
-			Variable index_val = evaluate_expr(index);
-			runtime_assert(index_val.is_double(), arrAccess->brack, "An expression used in array indexing is not a number");
-			size_t casted = (size_t) std::get<double>(index_val.value);
-			runtime_assert((double) casted == std::get<double>(index_val.value), arrAccess->brack, "An expression used in array indexing is not close to an integer");
-			runtime_assert(casted < arr.second.at(i), arrAccess->brack, "An expression used in array indexing is larger than a dimension of the ndarray");
-			indices.push_back(casted);
+		// Indexing a variable reads straight out of its slot, rather than
+		// copying the whole array out first
+		Var* id_var = dynamic_cast<Var*>(arrAccess->id);
+		Variable var;
+		size_t slot = 0;
+		if (id_var) {
+			slot = frames.back().base + id_var->slot;
+			runtime_assert(declared[slot], id_var->name, "Identifier doesn't correspond to a declared variable name");
+			runtime_assert(slots[slot].is_ndarray(), arrAccess->brack, "Identifier in array access isn't an ndarray");
 		}
-		size_t flat_index = indices[0];
-		for (size_t i = 1; i < indices.size(); i++) {
-			flat_index = indices[i] + flat_index * arr.second[i - 1];
+		else {
+			var = evaluate_expr(arrAccess->id);
+			runtime_assert(var.is_ndarray(), arrAccess->brack, "Identifier in array access isn't an ndarray");
 		}
-		return Variable(arr.first.at(flat_index));
+		std::vector<Variable> indices;
+		indices.reserve(arrAccess->idx.size());
+		uint64_t slices = 0;
+		for (size_t i = 0; i < arrAccess->idx.size(); i++) {
+			if (CAN_MAKE(Slice*, slice)_FROM(arrAccess->idx[i])) {
+				slices |= (uint64_t) 1 << i;
+				for (Expr* part : {slice->start, slice->stop, slice->step}) {
+					indices.push_back(part ? evaluate_expr(part) : Variable());
+				}
+			}
+			else {
+				indices.push_back(evaluate_expr(arrAccess->idx[i]));
+			}
+		}
+		if (slices) return slice_read(id_var ? slots[slot] : var, indices.data(), arrAccess->idx.size(), slices, arrAccess->brack);
+		return index_read(id_var ? slots[slot] : var, indices.data(), indices.size(), arrAccess->brack);
     }
     else if (CAN_MAKE(Assign*, assign)_FROM(expr)) {
-		runtime_assert(VAR_EXISTS(assign->name.lexeme), assign->name, "Identifier doesn't correspond to a declared variable name");
+		size_t slot = frames.back().base + assign->slot;
+		runtime_assert(declared[slot], assign->name, "Identifier doesn't correspond to a declared variable name");
 		Variable var = evaluate_expr(assign->value);
 		if (assign->idx.size() > 0) {
-			runtime_assert(var.is_double(), assign->name, "Can't assign a non-number to an entry in an array");
-			std::vector<size_t> indices;
-			Variable &to_modify = var_symbol_table.at(assign->name.lexeme);
-			auto &arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(to_modify.value);
-			runtime_assert(to_modify.is_ndarray(), assign->name, "Identifier isn't an array, so can't assign to an index of it");
-			for (size_t i = 0; i < assign->idx.size(); i++) {
-				Expr* index = assign->idx.at(i);
-				Variable index_val = evaluate_expr(index);
-				runtime_assert(index_val.is_double(), assign->name, "An expression used in array indexing is not a number");
-				size_t casted = (size_t) std::get<double>(index_val.value);
-				runtime_assert((double) casted == std::get<double>(index_val.value), assign->name, "An expression used in array indexing is not close to an integer");
-				runtime_assert(casted < arr.second.at(i), assign->name, "An expression used in array indexing is larger than a dimension of the ndarray");
-				indices.push_back(casted);
+			std::vector<Variable> indices;
+			indices.reserve(assign->idx.size());
+			for (Expr* index : assign->idx) {
+				indices.push_back(evaluate_expr(index));
 			}
-			size_t flat_index = indices[0];
-			for (size_t i = 1; i < indices.size(); i++) {
-				flat_index = indices[i] + flat_index * arr.second[i - 1];
-			}
-			arr.first.at(flat_index) = std::get<double>(var.value);
+			index_write(slots[slot], indices.data(), indices.size(), var, assign->name);
 		}
 		else {
-			var_symbol_table.at(assign->name.lexeme) = var;
+			slots[slot] = var;
 		}
 		return var;
     }
@@ -157,17 +218,10 @@ Variable Environment::evaluate_expr(Expr* expr) {
 		case IDENTIFIER: {
 			Variable left_var = evaluate_expr(binary->left);
 			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(OP_EXISTS(binary->op.lexeme), binary->op, "Identifier doesn't correspond to a defined operator name");
-			OpDecl* opDecl = op_symbol_table.at(binary->op.lexeme);
-			Environment env (out);
-			env.func_symbol_table = func_symbol_table;
-			env.op_symbol_table = op_symbol_table;
-			env.add_var(opDecl->left.lexeme, left_var);
-			env.add_var(opDecl->right.lexeme, right_var);
-			for (Stmt* stmt : opDecl->stmts) {
-				env.execute_stmt(stmt);
-			}
-			return env.get_return_val();
+			OpDecl* opDecl = lookup_op(binary->op.lexeme);
+			runtime_assert(opDecl, binary->op, "Identifier doesn't correspond to a defined operator name");
+			std::vector<Variable> args {left_var, right_var};
+			return call(opDecl->stmts, opDecl->num_slots, args);
 		}
 		case OR: {
 			Variable left_var = evaluate_expr(binary->left);
@@ -185,185 +239,51 @@ Variable Environment::evaluate_expr(Expr* expr) {
 			runtime_assert(right_var.is_bool(), binary->op, "Right expression evaluates to non-boolean value");
 			return Variable(std::get<bool>(right_var.value));
 		}
-		case EQUALS_EQUALS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			return left_var.value.index() == right_var.value.index() && left_var.value == right_var.value;
-		}
-		case EXCLA_EQUALS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			return left_var.value.index() != right_var.value.index() || left_var.value != right_var.value;
-		}
-		case GREATER_EQUALS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.value.index() == right_var.value.index(), binary->op, "Left and right expressions differ in type");
-			return left_var.value >= right_var.value;
-		}
-		case GREATER: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.value.index() == right_var.value.index(), binary->op, "Left and right expressions differ in type");
-			return left_var.value > right_var.value;
-		}
-		case LESSER_EQUALS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.value.index() == right_var.value.index(), binary->op, "Left and right expressions differ in type");
-			return left_var.value <= right_var.value;
-		}
+		case EQUALS_EQUALS:
+		case EXCLA_EQUALS:
+		case GREATER_EQUALS:
+		case GREATER:
+		case LESSER_EQUALS:
 		case LESSER: {
 			Variable left_var = evaluate_expr(binary->left);
 			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.value.index() == right_var.value.index(), binary->op, "Left and right expressions differ in type");
-			return left_var.value < right_var.value;
-		}
-		case MINUS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			ELEMENTWISE_OP(-)
-		}
-		case PLUS: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			ELEMENTWISE_OP(+)
-		}
-		case SLASH: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			ELEMENTWISE_OP(/)
-		}
-		case STAR: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			ELEMENTWISE_OP(*)
+			return compare(binary->op.type, left_var, right_var, binary->op);
 		}
+		case MINUS:
+		case PLUS:
+		case SLASH:
+		case STAR:
+		case EXP: return evaluate_elementwise(binary, true);
 		case AT: {
 			Variable left_var = evaluate_expr(binary->left);
 			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.is_ndarray(), binary->op, "Left expression isn't an ndarray");
-			runtime_assert(right_var.is_ndarray(), binary->op, "Right expression isn't an ndarray");
-			auto extract_left = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value);
-			auto extract_right = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value);
-			runtime_assert(extract_left.second.size() == 2, binary->op, "Left expression isn't a 2d ndarray");
-			runtime_assert(extract_right.second.size() == 2, binary->op, "Left expression isn't a 2d ndarray");
-			runtime_assert(extract_left.second.at(1) == extract_right.second.at(0), binary->op, "Left array's num of cols differs from right array's num of rows");
-			size_t r = extract_left.second.at(0);
-			size_t m = extract_left.second.at(1);
-			size_t c = extract_right.second.at(1);
-			#ifndef WEB_TARGET
-				double *out = (double*) malloc(sizeof(double) * r * c);
-				cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, r, c, m, 1., extract_left.first.data(), m, extract_right.first.data(), c, 0., out, c);
-				std::vector<double> result;
-				result.reserve(r * c);
-				for (size_t i = 0; i < r * c; i++) result.push_back(out[i]);
-				free(out);
-				return Variable(std::pair<std::vector<double>, std::vector<size_t>>(result, {r, c}));
-			#else
-				double *out = (double*) calloc(r * c, sizeof(double));
-				double *a = extract_left.first.data();
-				double *b = extract_right.first.data();
-				size_t ic = 0, im = 0, kc = 0;
-				for (size_t i = 0; i < r; i++) {
-				    for (size_t k = 0; k < m; k++) {
-					for (size_t j = 0; j < c; j++) {
-					    out[ic + j] += a[im + k] * b[kc + j];
-					}
-					kc += c;
-				    }
-				    kc = 0;
-				    ic += c;
-				    im += m;
-				}
-				std::vector<double> result;
-				result.reserve(r * c);
-				for (size_t i = 0; i < r * c; i++) result.push_back(out[i]);
-				free(out);
-				return Variable(std::pair<std::vector<double>, std::vector<size_t>>(result, {r, c}));
-			#endif
+			return matmul(left_var, right_var, binary->op);
 		}
 		case AS_SHAPE: {
 			Variable left_var = evaluate_expr(binary->left);
 			Variable right_var = evaluate_expr(binary->right);
-			runtime_assert(left_var.is_ndarray(), binary->op, "Left expression isn't an ndarray");
-			runtime_assert(right_var.is_ndarray(), binary->op, "Right expression isn't an ndarray");
-			auto new_size_double = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value).first;
-			std::vector<size_t> new_size;
-			for (size_t i = 0; i < new_size_double.size(); i++) {
-				size_t casted = (size_t) new_size_double.at(i);
-				runtime_assert((double) casted == new_size_double.at(i), binary->op, "An expression used in array size is not close to an integer");
-				new_size.push_back(casted);
-			}
-			auto values_to_fill_with = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value).first;
-			size_t full_length = new_size_double[0];
-			auto it = new_size_double.begin();
-			it++;
-			while(it != new_size_double.end()) {
-				full_length *= *it;
-				it++;
-			}
-			size_t original_idx = 0;
-			// Preallocate to avoid size doubling
-			std::vector<double> new_values (full_length);
-			for(size_t i = 0; i < full_length; ++i) {
-				new_values[i] = values_to_fill_with[original_idx];
-				original_idx++;
-				if(original_idx == values_to_fill_with.size()) {
-					original_idx = 0;
-				}
-			}
-			return Variable(std::pair<std::vector<double>, std::vector<size_t>>(new_values, new_size));
-		}
-		case EXP: {
-			Variable left_var = evaluate_expr(binary->left);
-			Variable right_var = evaluate_expr(binary->right);
-			if (left_var.is_double() && right_var.is_double()) {
-				return Variable(pow(std::get<double>(left_var.value), std::get<double>(right_var.value)));
-			}
-			if (left_var.is_double() && right_var.is_ndarray()) {
-				auto right_arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value).first;
-				for (size_t i = 0; i < right_arr.size(); i++) {
-					right_arr.at(i) = pow(std::get<double>(left_var.value), right_arr.at(i));
-				}
-				return Variable(std::pair<std::vector<double>, std::vector<size_t>>(right_arr, std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value).second));
-			}
-			if (left_var.is_ndarray() && right_var.is_double()) {
-				auto left_arr = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value).first;
-				for (size_t i = 0; i < left_arr.size(); i++) {
-					left_arr.at(i) = pow(left_arr.at(i), std::get<double>(right_var.value));
-				}
-				return Variable(std::pair<std::vector<double>, std::vector<size_t>>(left_arr, std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value).second));
-			}
-			if (left_var.is_ndarray() && right_var.is_ndarray()) {
-				auto left_var_pair = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(left_var.value);
-				auto right_var_pair = std::get<std::pair<std::vector<double>, std::vector<size_t>>>(right_var.value);
-				runtime_assert(left_var_pair.second == right_var_pair.second, binary->op, "Expressions evaluate to arrays of differing sizes");
-				std::vector<double> zipped;
-				for (size_t i = 0; i < left_var_pair.first.size(); i++) {
-					zipped.push_back(pow(left_var_pair.first.at(i), right_var_pair.first.at(i)));
-				}
-				return Variable(std::pair<std::vector<double>, std::vector<size_t>>(zipped, left_var_pair.second));
-			}
-			runtime_assert(false, binary->op, "At least one of left and right expressions are neither numbers nor ndarrays");
+			return as_shape(left_var, right_var, binary->op);
 		}
 		default: runtime_assert(false, binary->op, "Invalid binary operator");
 		}
     }
     else if (CAN_MAKE(Func*, func)_FROM(expr)) {
-		runtime_assert(FUNC_EXISTS(func->func.lexeme), func->func, "Identifier doesn't correspond to a defined function name");
-		FuncDecl* funcDecl = func_symbol_table.at(func->func.lexeme);
-		Environment env (out);
-		env.func_symbol_table = func_symbol_table;
-		env.op_symbol_table = op_symbol_table;
-		runtime_assert(func->args.size() == funcDecl->params.size(), func->paren, "Function called with different number of args than defined with");
-		for (size_t i = 0; i < func->args.size(); i++) {
-			env.add_var(funcDecl->params.at(i).lexeme, evaluate_expr(func->args.at(i)));
+		FuncDecl* funcDecl = lookup_func(func->func.lexeme);
+		const Builtin* builtin = funcDecl ? nullptr : find_builtin(func->func.lexeme);
+		runtime_assert(funcDecl || builtin, func->func, "Identifier doesn't correspond to a defined function name");
+		if (funcDecl) {
+			runtime_assert(func->args.size() == funcDecl->params.size(), func->paren, "Function called with different number of args than defined with");
 		}
-		for (Stmt* stmt: funcDecl->stmts) {
-			env.execute_stmt(stmt);
+		else {
+			runtime_assert(func->args.size() >= builtin->min_args && func->args.size() <= builtin->max_args, func->paren, "Function called with different number of args than defined with");
+		}
+		std::vector<Variable> args;
+		args.reserve(func->args.size());
+		for (Expr* arg : func->args) {
+			args.push_back(evaluate_expr(arg));
 		}
-		return env.get_return_val();
+		if (builtin) return builtin->call(args.data(), args.size(), func->func);
+		return call(funcDecl->stmts, funcDecl->num_slots, args);
     }
     else if (CAN_MAKE(Literal*, literal)_FROM(expr)) {
 		switch (literal->literal_type) {
@@ -371,52 +291,87 @@ Variable Environment::evaluate_expr(Expr* expr) {
 		case LITERAL_DOUBLE: return Variable(literal->double_val);
 		case LITERAL_BOOL: return Variable(literal->bool_val);
 		case LITERAL_ARRAY: {
-			std::vector<double> nums;
-			for (Expr* expr : literal->array_vals) {
-				Variable val = evaluate_expr(expr);
+			NDArray array = NDArray::uninitialized({literal->array_vals.size()});
+			double* nums = array.mutable_data();
+			for (size_t i = 0; i < literal->array_vals.size(); i++) {
+				Variable val = evaluate_expr(literal->array_vals[i]);
 				runtime_assert(val.is_double(), literal->token, "Expression in array literal evaluates to a non-number");
-				nums.push_back(std::get<double>(val.value));
+				nums[i] = std::get<double>(val.value);
 			}
-			return Variable(std::pair<std::vector<double>, std::vector<size_t>>(nums, {nums.size()}));
+			return Variable(std::move(array));
 		}
 		}
     }
     else if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+		if (unary->op.type == MINUS) return evaluate_elementwise(unary, true);
 		Variable val = evaluate_expr(unary->right);
 		switch(unary->op.type) {
-		case EXCLA: {
-			runtime_assert(val.is_bool(), unary->op, "Expression evaluates to a non-bool");
-			return Variable(!std::get<bool>(val.value));
-		}
-		case MINUS: {
-			runtime_assert(val.is_double(), unary->op, "Expression evaluates to a non-number");
-			return Variable(-std::get<double>(val.value));
-		}
-		case SHAPE: {
-			runtime_assert(val.is_ndarray(), unary->op, "Expression evaluates to a non-ndarray");
-			std::vector<double> casted_shape;
-			for (size_t d : std::get<std::pair<std::vector<double>, std::vector<size_t>>>(val.value).second) {
-				casted_shape.push_back((double) d);
-			}
-			return Variable(std::pair<std::vector<double>, std::vector<size_t>>(casted_shape, {casted_shape.size()}));
-		}
+		case EXCLA: return logical_not(val, unary->op);
+		case SHAPE: return shape_of(val, unary->op);
 		default: runtime_assert(false, unary->op, "Invalid unary operator");
 		}
     }
     else if (CAN_MAKE(Var*, var)_FROM(expr)) {
-		runtime_assert(VAR_EXISTS(var->name.lexeme), var->name, "Identifier doesn't correspond to a declared variable name");
-		return var_symbol_table.at(var->name.lexeme);
+		size_t slot = frames.back().base + var->slot;
+		runtime_assert(declared[slot], var->name, "Identifier doesn't correspond to a declared variable name");
+		if (var->last_use) {
+			// The variable is overwritten right after, so its value can be given away
+			Variable val = std::move(slots[slot]);
+			slots[slot] = Variable();
+			return val;
+		}
+		return slots[slot];
     }
-    else if (CAN_MAKE(Nil*, nil)_FROM(expr)) {
+    else if (dynamic_cast<Nil*>(expr)) {
 		return Variable();
     }
     throw std::runtime_error("Couldn't evaluate expression (evaluation for expression type might not be implemented?)");
 }
 
-void Environment::runtime_assert(bool cond, Token loc, std::string error_msg) {
-    if (!cond) throw std::runtime_error(create_error(error_msg, loc));
+/**
+ * Evaluates a tree of +, -, *, / and ^ operators (and unary minus) as a single
+ * fused expression. Operators below the root leave ndarray results lazy, and
+ * the root computes the whole expression at once.
+ */
+Variable Environment::evaluate_elementwise(Expr* expr, bool root) {
+    if (!is_elementwise(expr)) return evaluate_expr(expr);
+    if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        return fused_negate(evaluate_elementwise(unary->right, false), unary->op, root);
+    }
+    Binary* binary = static_cast<Binary*>(expr);
+    Variable left_var = evaluate_elementwise(binary->left, false);
+    Variable right_var = evaluate_elementwise(binary->right, false);
+    return fused_arithmetic(binary->op.type, std::move(left_var), std::move(right_var), binary->op, root);
 }
 
-std::string Environment::create_error(std::string error_msg, Token loc) {
-    return "Runtime error: " + error_msg + ", occurred at line " + std::to_string(loc.line) + " at column " + std::to_string(loc.col);
+/**
+ * Runs a function or operator body in a new call frame on top of the current
+ * one. The body was resolved along with its declaration, so argument i goes
+ * straight into slot i (the first of any repeated parameter names wins, as it
+ * always has).
+ */
+Variable Environment::call(const std::vector<Stmt*>& stmts, size_t num_slots, std::vector<Variable>& args) {
+    size_t base = slots.size();
+    slots.resize(base + num_slots);
+    declared.resize(base + num_slots, false);
+    for (size_t i = 0; i < args.size(); i++) {
+        slots[base + i] = std::move(args[i]);
+        declared[base + i] = true;
+    }
+    frames.push_back(CallFrame {base, nullptr, nullptr});
+    for (Stmt* stmt : stmts) {
+        execute(stmt);
+    }
+    Variable result;
+    if (hit_return) {
+        std::swap(result, return_val);
+        hit_return = false;
+    }
+    CallFrame& frame = frames.back();
+    if (frame.local_funcs) num_local_decls--;
+    if (frame.local_ops) num_local_decls--;
+    slots.resize(base);
+    declared.resize(base);
+    frames.pop_back();
+    return result;
 }
@@ -69,9 +69,9 @@ std::pair<std::string, std::string> ArrAccess::to_string() {
     return make_string("Array access", idx);
 }
 
-Assign::Assign(Token name, Expr* value): name(name), value(value) {}
+Assign::Assign(Token name, Expr* value): name(name), value(value), slot(0) {}
 
-Assign::Assign(Token name, std::vector<Expr*> idx, Expr* value): name(name), idx(idx), value(value) {}
+Assign::Assign(Token name, std::vector<Expr*> idx, Expr* value): name(name), idx(idx), value(value), slot(0) {}
 
 std::pair<std::string, std::string> Assign::to_string() {
     return make_string("Assignment of " + name.lexeme, value);
@@ -117,13 +117,23 @@ std::pair<std::string, std::string> Nil::to_string() {
     return make_string("NIL", {});
 }
 
+Slice::Slice(Expr* start, Token colon, Expr* stop, Expr* step): start(start), colon(colon), stop(stop), step(step) {}
+
+std::pair<std::string, std::string> Slice::to_string() {
+    std::vector<Expr*> parts;
+    for (Expr* part : {start, stop, step}) {
+        if (part) parts.push_back(part);
+    }
+    return make_string("Slice", parts);
+}
+
 Unary::Unary(Token op, Expr* right): op(op), right(right) {}
 
 std::pair<std::string, std::string> Unary::to_string() {
     return make_string("Unary " + op.lexeme, right);
 }
 
-Var::Var(Token name): name(name) {}
+Var::Var(Token name): name(name), slot(0), last_use(false) {}
 
 std::pair<std::string, std::string> Var::to_string() {
     return make_string("Variable " + name.lexeme, {});
@@ -160,6 +170,12 @@ Literal::~Literal() {
 
 Nil::~Nil() {}
 
+Slice::~Slice() {
+    delete start;
+    delete stop;
+    delete step;
+}
+
 Unary::~Unary() {
     delete right;
 }
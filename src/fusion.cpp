@@ -0,0 +1,262 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "fusion.hpp"
+#include "parallel.hpp"
+
+#include <optional>
+
+// Elements computed per pass over the code of a LazyArray. Small enough that
+// the intermediate blocks stay in L1 cache.
+static const size_t BLOCK_SIZE = 256;
+
+bool is_elementwise(Expr* expr) {
+    if (CAN_MAKE(Binary*, binary)_FROM(expr)) {
+        switch (binary->op.type) {
+        case PLUS:
+        case MINUS:
+        case STAR:
+        case SLASH:
+        case EXP: return true;
+        default: return false;
+        }
+    }
+    if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        return unary->op.type == MINUS;
+    }
+    return false;
+}
+
+static bool is_array(const Variable& val) {
+    return val.is_ndarray() || val.is_lazy();
+}
+
+// Fused code only runs on f64 elements, so arrays of other dtypes are
+// computed eagerly
+static bool is_typed(const Variable& val) {
+    return val.is_ndarray() && std::get<NDArray>(val.value).dtype() != DTYPE_F64;
+}
+
+static const std::vector<size_t>& array_shape(const Variable& val) {
+    if (val.is_lazy()) return std::get<std::shared_ptr<LazyArray>>(val.value)->shape;
+    return std::get<NDArray>(val.value).shape();
+}
+
+/**
+ * Turns an ndarray or lazy Variable into a LazyArray that can be extended.
+ * Lazy values are only ever held by the expression being evaluated, so the
+ * LazyArray is normally reused rather than copied.
+ */
+static std::shared_ptr<LazyArray> take_lazy(Variable&& val) {
+    if (val.is_lazy()) {
+        std::shared_ptr<LazyArray> lazy = std::move(std::get<std::shared_ptr<LazyArray>>(val.value));
+        if (lazy.use_count() > 1) lazy = std::make_shared<LazyArray>(*lazy);
+        return lazy;
+    }
+    std::shared_ptr<LazyArray> lazy = std::make_shared<LazyArray>();
+    NDArray& array = std::get<NDArray>(val.value);
+    lazy->shape = array.shape();
+    lazy->code.push_back(FusedOp {FusedOp::ARRAY, 0, 0});
+    lazy->arrays.push_back(std::move(array));
+    return lazy;
+}
+
+// Computes val if it's lazy
+static Variable settle(Variable val) {
+    if (!val.is_lazy()) return val;
+    return Variable(materialize(*take_lazy(std::move(val))));
+}
+
+static void append(LazyArray& lazy, Variable&& val) {
+    if (val.is_double()) {
+        lazy.code.push_back(FusedOp {FusedOp::SCALAR, 0, std::get<double>(val.value)});
+    }
+    else if (val.is_ndarray()) {
+        lazy.code.push_back(FusedOp {FusedOp::ARRAY, (uint32_t) lazy.arrays.size(), 0});
+        lazy.arrays.push_back(std::move(std::get<NDArray>(val.value)));
+    }
+    else {
+        std::shared_ptr<LazyArray> other = take_lazy(std::move(val));
+        uint32_t offset = lazy.arrays.size();
+        for (FusedOp op : other->code) {
+            if (op.kind == FusedOp::ARRAY) op.array += offset;
+            lazy.code.push_back(op);
+        }
+        for (NDArray& array : other->arrays) lazy.arrays.push_back(std::move(array));
+    }
+}
+
+Variable fused_arithmetic(TokenType op, Variable left, Variable right, const Token& loc, bool root) {
+    bool left_array = is_array(left);
+    bool right_array = is_array(right);
+    // Scalar arithmetic, a lone operator and type errors are all handled eagerly
+    if (!left_array && !right_array) return arithmetic(op, std::move(left), std::move(right), loc);
+    if (root && !left.is_lazy() && !right.is_lazy()) return arithmetic(op, std::move(left), std::move(right), loc);
+    if (is_typed(left) || is_typed(right)) return arithmetic(op, settle(std::move(left)), settle(std::move(right)), loc);
+    runtime_assert((left_array || left.is_double()) && (right_array || right.is_double()), loc, "At least one of left and right expressions are neither numbers nor ndarrays");
+    std::vector<size_t> shape = left_array ? array_shape(left) : array_shape(right);
+    if (left_array && right_array) shape = broadcast_shape(shape, array_shape(right), loc);
+
+    std::shared_ptr<LazyArray> lazy;
+    if (left_array) {
+        lazy = take_lazy(std::move(left));
+        lazy->shape = shape;
+    }
+    else {
+        lazy = std::make_shared<LazyArray>();
+        lazy->shape = shape;
+        append(*lazy, std::move(left));
+    }
+    append(*lazy, std::move(right));
+    switch (op) {
+    case PLUS: lazy->code.push_back(FusedOp {FusedOp::ADD, 0, 0}); break;
+    case MINUS: lazy->code.push_back(FusedOp {FusedOp::SUBTRACT, 0, 0}); break;
+    case STAR: lazy->code.push_back(FusedOp {FusedOp::MULTIPLY, 0, 0}); break;
+    case SLASH: lazy->code.push_back(FusedOp {FusedOp::DIVIDE, 0, 0}); break;
+    case EXP: lazy->code.push_back(FusedOp {FusedOp::POWER, 0, 0}); break;
+    default: runtime_assert(false, loc, "Invalid binary operator");
+    }
+    if (root) return Variable(materialize(*lazy));
+    return Variable(lazy);
+}
+
+Variable fused_negate(Variable val, const Token& loc, bool root) {
+    if (!val.is_lazy() && (root || !val.is_ndarray() || is_typed(val))) return negate(std::move(val), loc);
+    std::shared_ptr<LazyArray> lazy = take_lazy(std::move(val));
+    lazy->code.push_back(FusedOp {FusedOp::NEGATE, 0, 0});
+    if (root) return Variable(materialize(*lazy));
+    return Variable(lazy);
+}
+
+// An operand of a FusedOp for the block being computed, either a run of
+// values or (if values is null) a scalar
+struct Operand {
+    const double* values;
+    double scalar;
+};
+
+/**
+ * Copies the elements start to start + len of array, broadcast to shape
+ * with the given strides, into out. Walks the broadcast index like an
+ * odometer so the full broadcast array is never built.
+ */
+static void gather_block(const NDArray& array, const std::vector<size_t>& shape, const std::vector<size_t>& strides, size_t start, size_t len, double* out) {
+    std::vector<size_t> index (shape.size());
+    size_t offset = 0;
+    for (size_t d = shape.size(), rest = start; d-- > 0;) {
+        index[d] = rest % shape[d];
+        rest /= shape[d];
+        offset += index[d] * strides[d];
+    }
+    const double* data = array.data();
+    for (size_t i = 0; i < len; i++) {
+        out[i] = data[offset];
+        for (size_t d = shape.size(); d-- > 0;) {
+            offset += strides[d];
+            if (++index[d] < shape[d]) break;
+            offset -= strides[d] * shape[d];
+            index[d] = 0;
+        }
+    }
+}
+
+static void apply_block(KernelOp kernel, const Operand& left, const Operand& right, double* out, size_t len) {
+    if (!left.values) kernel_binary(kernel, SCALAR_ARRAY, &left.scalar, right.values, out, len);
+    else if (!right.values) kernel_binary(kernel, ARRAY_SCALAR, left.values, &right.scalar, out, len);
+    else kernel_binary(kernel, ARRAY_ARRAY, left.values, right.values, out, len);
+}
+
+/**
+ * Computes every element of a lazy expression. The code is run over one
+ * block of elements at a time, with each intermediate result written to a
+ * block-sized buffer, and the last operator writing straight into the result.
+ * The result goes into an input array nothing else refers to if there is
+ * one with the result's shape, which is safe since each block only reads
+ * the inputs at that block. For the same reason, threads can each take
+ * their own range of blocks.
+ */
+NDArray materialize(LazyArray& lazy) {
+    size_t size = 1;
+    for (size_t d : lazy.shape) size *= d;
+    NDArray* reused = nullptr;
+    for (NDArray& array : lazy.arrays) {
+        if (!array.is_shared() && array.is_contiguous() && array.shape() == lazy.shape) {
+            reused = &array;
+            break;
+        }
+    }
+    // Arrays smaller than the result are broadcast, and views are read
+    // through their strides, a block at a time
+    std::vector<std::vector<size_t>> strides (lazy.arrays.size());
+    for (size_t i = 0; i < lazy.arrays.size(); i++) {
+        if (lazy.arrays[i].shape() == lazy.shape && lazy.arrays[i].is_contiguous()) continue;
+        strides[i] = broadcast_strides(lazy.arrays[i], lazy.shape);
+    }
+    std::optional<NDArray> fresh;
+    if (!reused) fresh = NDArray::uninitialized(lazy.shape);
+    double* result = reused ? reused->mutable_data() : fresh->mutable_data();
+
+    size_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    parallel_for(num_blocks, PARALLEL_GRAIN / BLOCK_SIZE, [&](size_t first_block, size_t end_block) {
+        std::vector<Operand> operands (lazy.code.size());
+        std::vector<std::vector<double>> buffers (lazy.code.size(), std::vector<double>(BLOCK_SIZE));
+        std::vector<std::vector<double>> gathered (lazy.arrays.size());
+        for (size_t i = 0; i < lazy.arrays.size(); i++) {
+            if (strides[i].size()) gathered[i].resize(BLOCK_SIZE);
+        }
+        for (size_t block = first_block; block < end_block; block++) {
+            size_t start = block * BLOCK_SIZE;
+            size_t len = std::min(BLOCK_SIZE, size - start);
+            size_t depth = 0;
+            for (size_t i = 0; i < lazy.code.size(); i++) {
+                const FusedOp& op = lazy.code[i];
+                if (op.kind == FusedOp::ARRAY) {
+                    const NDArray& array = lazy.arrays[op.array];
+                    if (gathered[op.array].size()) {
+                        gather_block(array, lazy.shape, strides[op.array], start, len, gathered[op.array].data());
+                        operands[depth++] = Operand {gathered[op.array].data(), 0};
+                    }
+                    else {
+                        operands[depth++] = Operand {array.data() + start, 0};
+                    }
+                    continue;
+                }
+                if (op.kind == FusedOp::SCALAR) {
+                    operands[depth++] = Operand {nullptr, op.scalar};
+                    continue;
+                }
+                // Each position on the operand stack has its own buffer
+                size_t position = op.kind == FusedOp::NEGATE ? depth - 1 : depth - 2;
+                double* out = i + 1 == lazy.code.size() ? result + start : buffers[position].data();
+                if (op.kind == FusedOp::NEGATE) {
+                    Operand& val = operands[position];
+                    kernel_negate(val.values, out, len);
+                    val.values = out;
+                    continue;
+                }
+                Operand right = operands[--depth];
+                Operand& left = operands[depth - 1];
+                switch (op.kind) {
+                case FusedOp::ADD: apply_block(KERNEL_ADD, left, right, out, len); break;
+                case FusedOp::SUBTRACT: apply_block(KERNEL_SUBTRACT, left, right, out, len); break;
+                case FusedOp::MULTIPLY: apply_block(KERNEL_MULTIPLY, left, right, out, len); break;
+                case FusedOp::DIVIDE: apply_block(KERNEL_DIVIDE, left, right, out, len); break;
+                case FusedOp::POWER: apply_block(KERNEL_POWER, left, right, out, len); break;
+                default: break;
+                }
+                left.values = out;
+            }
+        }
+    });
+    if (reused) return std::move(*reused);
+    return std::move(*fresh);
+}
@@ -0,0 +1,287 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "gemm.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#ifndef WEB_TARGET
+    #include <cblas.h>
+#endif
+
+// A GEMM_KC x GEMM_NC block of b is packed and shared by every thread, and
+// each thread packs GEMM_MC x GEMM_KC blocks of a, which stay in its L2
+// cache while it runs over the block of b. GEMM_MC and GEMM_NC are
+// multiples of every kernel set's tile.
+static const size_t GEMM_KC = 256;
+static const size_t GEMM_MC = 96;
+static const size_t GEMM_NC = 2048;
+
+// OpenBLAS beat native_gemm at every size calibrate_gemm tries, so by default
+// only products small enough for tiny_gemm stay native. Slower libraries
+// (like the reference Netlib CBLAS) lose to native_gemm on all but small
+// products, which is what calibrating is for.
+static const size_t DEFAULT_CBLAS_MIN = 6 * 6 * 6;
+
+#ifdef WEB_TARGET
+static BlasBackend backend = BLAS_NATIVE;
+#else
+static BlasBackend backend = BLAS_AUTO;
+#endif
+static size_t requested_cblas_min = 0;
+
+BlasBackend blas_backend() {
+    return backend;
+}
+
+void set_blas_backend(BlasBackend chosen) {
+#ifdef WEB_TARGET
+    (void) chosen;
+#else
+    backend = chosen;
+#endif
+}
+
+static size_t default_cblas_min() {
+    if (const char* env = getenv("WEAK_GEMM_CBLAS_MIN")) {
+        char* end;
+        unsigned long long parsed = strtoull(env, &end, 10);
+        if (*env && !*end && parsed > 0) return parsed;
+    }
+    return DEFAULT_CBLAS_MIN;
+}
+
+size_t gemm_cblas_min() {
+    static const size_t default_min = default_cblas_min();
+    return requested_cblas_min ? requested_cblas_min : default_min;
+}
+
+void set_gemm_cblas_min(size_t multiplications) {
+    requested_cblas_min = multiplications;
+}
+
+GemmMethod gemm_method(size_t rows, size_t cols, size_t depth) {
+    if (backend == BLAS_CBLAS) return GEMM_CBLAS;
+    if (rows <= GEMM_TINY_MAX && cols <= GEMM_TINY_MAX && depth <= GEMM_TINY_MAX) return GEMM_TINY;
+    if (backend == BLAS_NATIVE || rows * cols * depth < gemm_cblas_min()) return GEMM_NATIVE;
+    return GEMM_CBLAS;
+}
+
+typedef void (*TinyKernel)(const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out);
+
+// Both operands are first copied into local arrays, so their strides are
+// only used once per element. The loops have constant bounds, so the
+// compiler unrolls them completely and keeps everything in registers.
+template <size_t ROWS, size_t COLS, size_t DEPTH>
+static void tiny_kernel(const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out) {
+    double left[ROWS][DEPTH], right[DEPTH][COLS];
+    _Pragma("GCC unroll 16") for (size_t i = 0; i < ROWS; i++) {
+        _Pragma("GCC unroll 16") for (size_t k = 0; k < DEPTH; k++) left[i][k] = a[i * a_row + k * a_col];
+    }
+    _Pragma("GCC unroll 16") for (size_t k = 0; k < DEPTH; k++) {
+        _Pragma("GCC unroll 16") for (size_t j = 0; j < COLS; j++) right[k][j] = b[k * b_row + j * b_col];
+    }
+    _Pragma("GCC unroll 16") for (size_t i = 0; i < ROWS; i++) {
+        _Pragma("GCC unroll 16") for (size_t j = 0; j < COLS; j++) {
+            double sum = 0.;
+            _Pragma("GCC unroll 16") for (size_t k = 0; k < DEPTH; k++) sum += left[i][k] * right[k][j];
+            out[i * COLS + j] = sum;
+        }
+    }
+}
+
+// Kernel I is for the shape with rows, cols and depth being the digits of
+// I in base GEMM_TINY_MAX, plus 1
+template <size_t... I>
+static constexpr std::array<TinyKernel, sizeof...(I)> make_tiny_kernels(std::index_sequence<I...>) {
+    const size_t n = GEMM_TINY_MAX;
+    return {{tiny_kernel<I / (n * n) + 1, I / n % n + 1, I % n + 1>...}};
+}
+
+static constexpr std::array<TinyKernel, GEMM_TINY_MAX * GEMM_TINY_MAX * GEMM_TINY_MAX> tiny_kernels = make_tiny_kernels(std::make_index_sequence<GEMM_TINY_MAX * GEMM_TINY_MAX * GEMM_TINY_MAX>());
+
+void tiny_gemm(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out) {
+    if (depth == 0) {
+        std::fill(out, out + rows * cols, 0.);
+        return;
+    }
+    if (rows == 0 || cols == 0) return;
+    const size_t n = GEMM_TINY_MAX;
+    tiny_kernels[(rows - 1) * n * n + (cols - 1) * n + depth - 1](a, a_row, a_col, b, b_row, b_col, out);
+}
+
+// Packs rows x depth of a into panels of mr rows, each stored column by
+// column, padding the last panel with zeroes
+static void pack_a(size_t mr, size_t rows, size_t depth, const double* a, size_t a_row, size_t a_col, double* packed) {
+    for (size_t i0 = 0; i0 < rows; i0 += mr) {
+        size_t panel_rows = std::min(mr, rows - i0);
+        for (size_t p = 0; p < depth; p++) {
+            for (size_t i = 0; i < mr; i++) {
+                *packed++ = i < panel_rows ? a[(i0 + i) * a_row + p * a_col] : 0.;
+            }
+        }
+    }
+}
+
+// Packs columns begin to end of depth x cols of b into panels of nr columns,
+// each stored row by row, padding the last panel with zeroes
+static void pack_b(size_t nr, size_t begin, size_t end, size_t cols, size_t depth, const double* b, size_t b_row, size_t b_col, double* packed) {
+    for (size_t j0 = begin; j0 < end; j0 += nr) {
+        size_t panel_cols = std::min(nr, cols - j0);
+        double* panel = packed + j0 * depth;
+        for (size_t p = 0; p < depth; p++) {
+            for (size_t j = 0; j < nr; j++) {
+                *panel++ = j < panel_cols ? b[p * b_row + (j0 + j) * b_col] : 0.;
+            }
+        }
+    }
+}
+
+/**
+ * Adds the product of packed blocks of a (rows x depth) and b (depth x
+ * cols) to out, a tile at a time. Tiles that stick out of the result are
+ * computed into a scratch tile, and only the part inside is added.
+ */
+static void multiply_blocks(const KernelSet& set, size_t rows, size_t cols, size_t depth, const double* a, const double* b, double* out, size_t ldc) {
+    size_t mr = set.gemm_rows, nr = set.gemm_cols;
+    for (size_t j = 0; j < cols; j += nr) {
+        for (size_t i = 0; i < rows; i += mr) {
+            const double* a_panel = a + i * depth;
+            const double* b_panel = b + j * depth;
+            double* tile = out + i * ldc + j;
+            if (i + mr <= rows && j + nr <= cols) {
+                set.gemm(depth, a_panel, b_panel, tile, ldc);
+                continue;
+            }
+            double edge[GEMM_MAX_TILE * GEMM_MAX_TILE] = {};
+            set.gemm(depth, a_panel, b_panel, edge, nr);
+            for (size_t ii = 0; ii < std::min(mr, rows - i); ii++) {
+                for (size_t jj = 0; jj < std::min(nr, cols - j); jj++) tile[ii * ldc + jj] += edge[ii * nr + jj];
+            }
+        }
+    }
+}
+
+void native_gemm(const KernelSet& set, size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out) {
+    std::fill(out, out + rows * cols, 0.);
+    if (rows == 0 || cols == 0 || depth == 0) return;
+    size_t mr = set.gemm_rows, nr = set.gemm_cols;
+    // Blocks of a are made smaller when there are too few to keep every
+    // thread busy, and columns of the block of b are split between threads
+    // when even that isn't enough
+    size_t threads = num_threads();
+    size_t row_block = std::min(GEMM_MC, std::max(mr, ((rows + threads - 1) / threads + mr - 1) / mr * mr));
+    size_t row_blocks = (rows + row_block - 1) / row_block;
+    // The packing buffers are kept between calls, as allocating them would
+    // take about as long as a small product
+    static thread_local std::vector<double> packed_b;
+    packed_b.resize(std::max(packed_b.size(), std::min(GEMM_KC, depth) * ((std::min(GEMM_NC, cols) + nr - 1) / nr * nr)));
+    // The buffer is the calling thread's, so the loops below share it through
+    // this pointer rather than naming the thread_local on each worker
+    double* packed = packed_b.data();
+
+    for (size_t jc = 0; jc < cols; jc += GEMM_NC) {
+        size_t nc = std::min(GEMM_NC, cols - jc);
+        size_t panels = (nc + nr - 1) / nr;
+        size_t col_splits = std::min(panels, std::max<size_t>(1, threads / row_blocks));
+        for (size_t pc = 0; pc < depth; pc += GEMM_KC) {
+            size_t kc = std::min(GEMM_KC, depth - pc);
+            const double* b_block = b + pc * b_row + jc * b_col;
+            parallel_for(panels, std::max<size_t>(1, PARALLEL_GRAIN / (kc * nr)), [&](size_t begin, size_t end) {
+                pack_b(nr, begin * nr, std::min(end * nr, nc), nc, kc, b_block, b_row, b_col, packed);
+            });
+            // Each unit of work is one block of rows and one share of the columns
+            parallel_for(row_blocks * col_splits, 1, [&](size_t begin, size_t end) {
+                static thread_local std::vector<double> packed_a;
+                packed_a.resize(std::max(packed_a.size(), row_block * kc));
+                size_t packed_row = SIZE_MAX;
+                for (size_t unit = begin; unit < end; unit++) {
+                    size_t ic = unit / col_splits * row_block;
+                    size_t mc = std::min(row_block, rows - ic);
+                    if (packed_row != ic) {
+                        pack_a(mr, mc, kc, a + ic * a_row + pc * a_col, a_row, a_col, packed_a.data());
+                        packed_row = ic;
+                    }
+                    size_t split = unit % col_splits;
+                    size_t first = split * panels / col_splits * nr;
+                    size_t last = std::min((split + 1) * panels / col_splits * nr, nc);
+                    multiply_blocks(set, mc, last - first, kc, packed_a.data(), packed + first * kc, out + ic * cols + jc + first, cols);
+                }
+            });
+        }
+    }
+}
+
+void native_gemm(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out) {
+    native_gemm(kernels(), rows, cols, depth, a, a_row, a_col, b, b_row, b_col, out);
+}
+
+#ifndef WEB_TARGET
+// Seconds per call of run, timed over at least 20ms
+static double seconds_per_run(const std::function<void()>& run) {
+    using clock = std::chrono::steady_clock;
+    run();
+    size_t runs = 0;
+    auto start = clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        run();
+        runs++;
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < 0.02);
+    return elapsed.count() / runs;
+}
+#endif
+
+void calibrate_gemm(std::ostream& out) {
+#ifdef WEB_TARGET
+    out << "The web build only has native matrix multiplication." << std::endl;
+#else
+    const size_t sizes[] = {6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256};
+    // The smallest size CBLAS wins at, if it also wins at every larger one
+    size_t crossover = 0;
+    out << "size\tnative (us)\tcblas (us)" << std::endl;
+    for (size_t n : sizes) {
+        std::vector<double> a (n * n), b (n * n), product (n * n);
+        for (size_t i = 0; i < n * n; i++) {
+            a[i] = (double) (i % 7) - 3.;
+            b[i] = (double) (i % 5) * 0.5;
+        }
+        double native = seconds_per_run([&]() {
+            native_gemm(n, n, n, a.data(), n, 1, b.data(), n, 1, product.data());
+        });
+        double cblas = seconds_per_run([&]() {
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, n, n, 1., a.data(), n, b.data(), n, 0., product.data(), n);
+        });
+        out << n << "\t" << native * 1e6 << "\t" << cblas * 1e6 << std::endl;
+        if (cblas >= native) crossover = 0;
+        else if (!crossover) crossover = n;
+    }
+    if (crossover) {
+        out << "CBLAS is faster from " << crossover << " x " << crossover << " matrices on. To use this, set" << std::endl;
+        out << "export WEAK_GEMM_CBLAS_MIN=" << crossover * crossover * crossover << std::endl;
+    }
+    else {
+        out << "CBLAS was never faster. To keep to native matrix multiplication, run Weak with --blas=native." << std::endl;
+    }
+#endif
+}
@@ -0,0 +1,176 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "indexing.hpp"
+#include "operations.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+
+bool is_fancy_index(const Variable* indices, size_t num_indices) {
+    for (size_t i = 0; i < num_indices; i++) {
+        if (indices[i].is_ndarray() && !(num_indices == 1 && std::get<NDArray>(indices[i].value).dtype() == DTYPE_BOOL)) return true;
+    }
+    return false;
+}
+
+// The blocks a fancy index picks out of the contiguous layout of an array
+struct IndexPlan {
+    // The shape of the index arrays broadcast together, followed by the
+    // dimensions that weren't indexed
+    std::vector<size_t> shape;
+    size_t block;
+    // The element each block starts at. These live in an ndarray's buffer,
+    // so long index lists come from the pool and aren't zeroed first.
+    NDArray offsets;
+
+    size_t count() const { return offsets.size(); }
+    const size_t* starts() const { return (const size_t*) offsets.raw_data(); }
+};
+
+/**
+ * Finds where each block picked out by indices starts, adding up each
+ * index array's part of the offsets in turn. Index arrays are read as i64s,
+ * straight through if they have the broadcast shape, and otherwise through
+ * their broadcast strides, walking the position like an odometer. A
+ * negative index wraps around to a huge one, so one comparison against the
+ * dimension checks both bounds.
+ */
+static IndexPlan plan_indices(const NDArray& array, const Variable* indices, size_t num_indices, const Token& loc) {
+    const std::vector<size_t>& shape = array.shape();
+    runtime_assert(num_indices <= shape.size(), loc, "Number of dimensions in array element access differs from number of dimensions in array");
+    size_t block = 1;
+    for (size_t d = num_indices; d < shape.size(); d++) block *= shape[d];
+    // The step in elements between consecutive indices of each dimension
+    std::vector<size_t> dim_steps (num_indices);
+    for (size_t d = num_indices, step = block; d-- > 0;) {
+        dim_steps[d] = step;
+        step *= shape[d];
+    }
+    // Numbers move every block by the same amount
+    size_t base = 0;
+    std::vector<NDArray> index_arrays;
+    std::vector<size_t> index_dims;
+    std::vector<size_t> index_shape;
+    for (size_t d = 0; d < num_indices; d++) {
+        if (const NDArray* index = std::get_if<NDArray>(&indices[d].value)) {
+            runtime_assert(index->dtype() != DTYPE_BOOL, loc, "A bool mask used in array indexing must be the only index");
+            bool exact = true;
+            index_arrays.push_back(index->as_dtype(DTYPE_I64, &exact).contiguous());
+            runtime_assert(exact, loc, "An ndarray used in array indexing has an element that isn't an integer");
+            index_dims.push_back(d);
+            index_shape = broadcast_shape(index_shape, index_arrays.back().shape(), loc);
+            continue;
+        }
+        const double* index = std::get_if<double>(&indices[d].value);
+        runtime_assert(index, loc, "An expression used in array indexing is not a number");
+        size_t casted = (size_t) *index;
+        runtime_assert((double) casted == *index, loc, "An expression used in array indexing is not close to an integer");
+        runtime_assert(casted < shape[d], loc, "An expression used in array indexing is larger than a dimension of the ndarray");
+        base += casted * dim_steps[d];
+    }
+    std::vector<std::vector<size_t>> strides;
+    for (const NDArray& index : index_arrays) strides.push_back(broadcast_strides(index, index_shape));
+
+    size_t count = 1;
+    for (size_t d : index_shape) count *= d;
+    NDArray offsets = NDArray::uninitialized({count}, DTYPE_I64);
+    size_t* out = (size_t*) offsets.mutable_raw_data();
+    size_t dims = index_shape.size();
+    std::atomic<bool> out_of_range (false);
+    parallel_for(count, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        std::fill(out + begin, out + end, base);
+        bool in_range = true;
+        for (size_t k = 0; k < index_arrays.size(); k++) {
+            const int64_t* index = (const int64_t*) index_arrays[k].raw_data();
+            size_t dim = shape[index_dims[k]], step = dim_steps[index_dims[k]];
+            if (index_arrays[k].shape() == index_shape) {
+                for (size_t i = begin; i < end; i++) {
+                    in_range &= (size_t) index[i] < dim;
+                    out[i] += (size_t) index[i] * step;
+                }
+                continue;
+            }
+            std::vector<size_t> position (dims);
+            size_t at = 0;
+            for (size_t e = dims, rest = begin; e-- > 0;) {
+                position[e] = rest % index_shape[e];
+                rest /= index_shape[e];
+                at += position[e] * strides[k][e];
+            }
+            for (size_t i = begin; i < end; i++) {
+                in_range &= (size_t) index[at] < dim;
+                out[i] += (size_t) index[at] * step;
+                for (size_t e = dims; e-- > 0;) {
+                    at += strides[k][e];
+                    if (++position[e] < index_shape[e]) break;
+                    at -= strides[k][e] * index_shape[e];
+                    position[e] = 0;
+                }
+            }
+        }
+        if (!in_range) out_of_range = true;
+    });
+    runtime_assert(!out_of_range, loc, "An expression used in array indexing is larger than a dimension of the ndarray");
+    for (size_t d = num_indices; d < shape.size(); d++) index_shape.push_back(shape[d]);
+    return IndexPlan {std::move(index_shape), block, std::move(offsets)};
+}
+
+Variable gather(const NDArray& array, const Variable* indices, size_t num_indices, const Token& loc) {
+    IndexPlan plan = plan_indices(array, indices, num_indices, loc);
+    NDArray result = NDArray::uninitialized(plan.shape, array.dtype());
+    typed_gather(array.dtype(), array.contiguous().raw_data(), plan.starts(), plan.count(), plan.block, result.mutable_raw_data());
+    return Variable(std::move(result));
+}
+
+// Writes or adds val into the blocks of array that plan picks out
+static void scatter_plan(NDArray& array, const IndexPlan& plan, const Variable& val, bool add, const Token& loc) {
+    runtime_assert(val.is_double() || val.is_ndarray(), loc, "Can't assign a non-number to an entry in an array");
+    DType dtype = array.dtype();
+    alignas(8) unsigned char scalar[8];
+    std::optional<NDArray> values;
+    if (val.is_double()) {
+        runtime_assert(store_element(dtype, std::get<double>(val.value), scalar), loc, "Can't assign a non-integer to an entry in an i64 array");
+    }
+    else {
+        // The values are broadcast to one per element picked out
+        bool exact = true;
+        NDArray converted = std::get<NDArray>(val.value).as_dtype(dtype, &exact);
+        runtime_assert(exact, loc, "Can't assign a non-integer to an entry in an i64 array");
+        runtime_assert(broadcast_shape(converted.shape(), plan.shape, loc) == plan.shape, loc, "Assigned ndarray can't be broadcast to the shape of the indexed elements");
+        values = converted.view(0, plan.shape, broadcast_strides(converted, plan.shape)).contiguous();
+    }
+    if (!array.is_contiguous()) array = array.contiguous();
+    // Taking a private copy happens before values are read, so they can
+    // still share a buffer with array
+    void* out = array.mutable_raw_data();
+    const void* in = values ? values->raw_data() : scalar;
+    typed_scatter(dtype, out, array.size(), plan.starts(), plan.count(), plan.block, in, !values, add);
+}
+
+void scatter(NDArray& array, const Variable* indices, size_t num_indices, const Variable& val, const Token& loc) {
+    scatter_plan(array, plan_indices(array, indices, num_indices, loc), val, false, loc);
+}
+
+Variable scatter_add(const Variable& arr, const Variable& index, const Variable& val, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    runtime_assert(index.is_ndarray() || index.is_double(), loc, "An expression used in array indexing is not a number");
+    runtime_assert(val.is_ndarray() || val.is_double(), loc, "Can't assign a non-number to an entry in an array");
+    const NDArray& array = std::get<NDArray>(arr.value);
+    // The sums have the dtype adding the values to the array would give
+    DType dtype = val.is_ndarray() ? promote(array.dtype(), std::get<NDArray>(val.value).dtype()) : promote_scalar(array.dtype(), std::get<double>(val.value));
+    NDArray result = array.as_dtype(arithmetic_dtype(KERNEL_ADD, dtype));
+    scatter_plan(result, plan_indices(result, &index, 1, loc), val, true, loc);
+    return Variable(std::move(result));
+}
@@ -0,0 +1,369 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "kernels.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+
+#ifdef WEAK_X86_KERNELS
+    #include <immintrin.h>
+#endif
+
+// GCC fuses a multiply followed by an add into one FMA instruction (which
+// rounds once instead of twice) wherever the target has FMA, so AVX-512
+// kernels would round differently from the rest. Clang only fuses within a
+// single expression, which intrinsics never are.
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC optimize ("fp-contract=off")
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Each kernel is written once as a macro and stamped out for every         //
+// instruction set. ISA is passed to the target attribute so the intrinsics //
+// can be used without compiling the whole file for that instruction set,   //
+// and the vector loop is followed by a scalar loop for the leftovers.      //
+//////////////////////////////////////////////////////////////////////////////
+
+#define BINARY_KERNELS(ATTR, PREFIX, V, W, LOAD, STORE, SET1, VOP, SOP) \
+    ATTR static void PREFIX##_array_array(const double* left, const double* right, double* out, size_t n) { \
+        size_t i = 0; \
+        for (; i + 2 * W <= n; i += 2 * W) { \
+            V a = VOP(LOAD(left + i), LOAD(right + i)); \
+            V b = VOP(LOAD(left + i + W), LOAD(right + i + W)); \
+            STORE(out + i, a); \
+            STORE(out + i + W, b); \
+        } \
+        for (; i < n; i++) out[i] = SOP(left[i], right[i]); \
+    } \
+    ATTR static void PREFIX##_scalar_array(const double* left, const double* right, double* out, size_t n) { \
+        V scalar = SET1(*left); \
+        size_t i = 0; \
+        for (; i + 2 * W <= n; i += 2 * W) { \
+            V a = VOP(scalar, LOAD(right + i)); \
+            V b = VOP(scalar, LOAD(right + i + W)); \
+            STORE(out + i, a); \
+            STORE(out + i + W, b); \
+        } \
+        for (; i < n; i++) out[i] = SOP(*left, right[i]); \
+    } \
+    ATTR static void PREFIX##_array_scalar(const double* left, const double* right, double* out, size_t n) { \
+        V scalar = SET1(*right); \
+        size_t i = 0; \
+        for (; i + 2 * W <= n; i += 2 * W) { \
+            V a = VOP(LOAD(left + i), scalar); \
+            V b = VOP(LOAD(left + i + W), scalar); \
+            STORE(out + i, a); \
+            STORE(out + i + W, b); \
+        } \
+        for (; i < n; i++) out[i] = SOP(left[i], *right); \
+    }
+
+#define UNARY_KERNEL(ATTR, NAME, V, W, LOAD, STORE, VEXPR, EXPR) \
+    ATTR static void NAME(const double* in, double* out, size_t n) { \
+        size_t i = 0; \
+        for (; i + W <= n; i += W) { \
+            V x = LOAD(in + i); \
+            STORE(out + i, VEXPR); \
+        } \
+        for (; i < n; i++) { \
+            double x = in[i]; \
+            out[i] = EXPR; \
+        } \
+    }
+
+// Both reductions keep REDUCE_LANES partial results in REDUCE_LANES / W
+// vectors, folding them together in the same order for every vector width.
+// Each element is the first operand of VOP, so min and max skip NaNs.
+#define COMBINE_LANES(SOP) \
+    for (size_t width = REDUCE_LANES / 2; width > 0; width /= 2) { \
+        for (size_t k = 0; k < width; k++) lanes[k] = SOP(lanes[k], lanes[k + width]); \
+    }
+
+#define REDUCE_KERNEL(ATTR, NAME, V, W, LOAD, STORE, SET1, VOP, SOP, INIT) \
+    ATTR static double NAME(const double* in, size_t n) { \
+        V acc[REDUCE_LANES / W]; \
+        for (size_t k = 0; k < REDUCE_LANES / W; k++) acc[k] = SET1(INIT); \
+        size_t i = 0; \
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) { \
+            for (size_t k = 0; k < REDUCE_LANES / W; k++) acc[k] = VOP(LOAD(in + i + k * W), acc[k]); \
+        } \
+        double lanes[REDUCE_LANES]; \
+        for (size_t k = 0; k < REDUCE_LANES / W; k++) STORE(lanes + k * W, acc[k]); \
+        COMBINE_LANES(SOP) \
+        double result = lanes[0]; \
+        for (; i < n; i++) result = SOP(in[i], result); \
+        return result; \
+    }
+
+#define DOT_KERNEL(ATTR, NAME, V, W, LOAD, STORE, SET1, ADD, MUL) \
+    ATTR static double NAME(const double* left, const double* right, size_t n) { \
+        V acc[REDUCE_LANES / W]; \
+        for (size_t k = 0; k < REDUCE_LANES / W; k++) acc[k] = SET1(0.); \
+        size_t i = 0; \
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) { \
+            for (size_t k = 0; k < REDUCE_LANES / W; k++) acc[k] = ADD(acc[k], MUL(LOAD(left + i + k * W), LOAD(right + i + k * W))); \
+        } \
+        double lanes[REDUCE_LANES]; \
+        for (size_t k = 0; k < REDUCE_LANES / W; k++) STORE(lanes + k * W, acc[k]); \
+        COMBINE_LANES(SCALAR_ADD) \
+        double result = lanes[0]; \
+        for (; i < n; i++) result = SCALAR_ADD(result, SCALAR_MUL(left[i], right[i])); \
+        return result; \
+    }
+
+// Adds the product of a packed MR x k panel of a (column by column) and a
+// packed k x NR panel of b (row by row) to the MR x NR tile at out, whose
+// rows are ldc apart. The tile is kept in MR * NR / W registers, so each set
+// has a tile as large as its registers allow, and the loops over it are
+// unrolled so the compiler can keep it there.
+#define GEMM_KERNEL(ATTR, NAME, V, W, LOAD, STORE, SET1, ADD, MUL, MR, NR) \
+    ATTR static void NAME(size_t k, const double* a, const double* b, double* out, size_t ldc) { \
+        V acc[MR][NR / W]; \
+        _Pragma("GCC unroll 16") for (size_t i = 0; i < MR; i++) { \
+            _Pragma("GCC unroll 16") for (size_t j = 0; j < NR / W; j++) acc[i][j] = SET1(0.); \
+        } \
+        for (size_t p = 0; p < k; p++, a += MR, b += NR) { \
+            V row[NR / W]; \
+            _Pragma("GCC unroll 16") for (size_t j = 0; j < NR / W; j++) row[j] = LOAD(b + j * W); \
+            _Pragma("GCC unroll 16") for (size_t i = 0; i < MR; i++) { \
+                V a_i = SET1(a[i]); \
+                _Pragma("GCC unroll 16") for (size_t j = 0; j < NR / W; j++) acc[i][j] = ADD(acc[i][j], MUL(a_i, row[j])); \
+            } \
+        } \
+        _Pragma("GCC unroll 16") for (size_t i = 0; i < MR; i++) { \
+            _Pragma("GCC unroll 16") for (size_t j = 0; j < NR / W; j++) STORE(out + i * ldc + j * W, ADD(LOAD(out + i * ldc + j * W), acc[i][j])); \
+        } \
+    }
+
+#define KERNEL_SET(ATTR, PREFIX, V, W, LOAD, STORE, SET1, ADD, SUB, MUL, DIV, MIN, MAX, NEG, MR, NR) \
+    BINARY_KERNELS(ATTR, PREFIX##_add, V, W, LOAD, STORE, SET1, ADD, SCALAR_ADD) \
+    BINARY_KERNELS(ATTR, PREFIX##_subtract, V, W, LOAD, STORE, SET1, SUB, SCALAR_SUB) \
+    BINARY_KERNELS(ATTR, PREFIX##_multiply, V, W, LOAD, STORE, SET1, MUL, SCALAR_MUL) \
+    BINARY_KERNELS(ATTR, PREFIX##_divide, V, W, LOAD, STORE, SET1, DIV, SCALAR_DIV) \
+    BINARY_KERNELS(ATTR, PREFIX##_min, V, W, LOAD, STORE, SET1, MIN, SCALAR_MIN) \
+    BINARY_KERNELS(ATTR, PREFIX##_max, V, W, LOAD, STORE, SET1, MAX, SCALAR_MAX) \
+    UNARY_KERNEL(ATTR, PREFIX##_negate, V, W, LOAD, STORE, NEG(x), -x) \
+    UNARY_KERNEL(ATTR, PREFIX##_square, V, W, LOAD, STORE, MUL(x, x), x * x) \
+    UNARY_KERNEL(ATTR, PREFIX##_reciprocal, V, W, LOAD, STORE, DIV(SET1(1.), x), 1. / x) \
+    REDUCE_KERNEL(ATTR, PREFIX##_sum, V, W, LOAD, STORE, SET1, ADD, SCALAR_ADD, 0.) \
+    REDUCE_KERNEL(ATTR, PREFIX##_product, V, W, LOAD, STORE, SET1, MUL, SCALAR_MUL, 1.) \
+    REDUCE_KERNEL(ATTR, PREFIX##_min_reduce, V, W, LOAD, STORE, SET1, MIN, SCALAR_MIN, INFINITY) \
+    REDUCE_KERNEL(ATTR, PREFIX##_max_reduce, V, W, LOAD, STORE, SET1, MAX, SCALAR_MAX, -INFINITY) \
+    DOT_KERNEL(ATTR, PREFIX##_dot, V, W, LOAD, STORE, SET1, ADD, MUL) \
+    GEMM_KERNEL(ATTR, PREFIX##_gemm, V, W, LOAD, STORE, SET1, ADD, MUL, MR, NR) \
+    static const KernelSet PREFIX##_kernels = { \
+        #PREFIX, \
+        { \
+            {PREFIX##_add_array_array, PREFIX##_add_scalar_array, PREFIX##_add_array_scalar}, \
+            {PREFIX##_subtract_array_array, PREFIX##_subtract_scalar_array, PREFIX##_subtract_array_scalar}, \
+            {PREFIX##_multiply_array_array, PREFIX##_multiply_scalar_array, PREFIX##_multiply_array_scalar}, \
+            {PREFIX##_divide_array_array, PREFIX##_divide_scalar_array, PREFIX##_divide_array_scalar}, \
+            {PREFIX##_min_array_array, PREFIX##_min_scalar_array, PREFIX##_min_array_scalar}, \
+            {PREFIX##_max_array_array, PREFIX##_max_scalar_array, PREFIX##_max_array_scalar}, \
+        }, \
+        PREFIX##_negate, \
+        PREFIX##_square, \
+        PREFIX##_reciprocal, \
+        PREFIX##_sum, \
+        PREFIX##_product, \
+        PREFIX##_min_reduce, \
+        PREFIX##_max_reduce, \
+        PREFIX##_dot, \
+        PREFIX##_gemm, \
+        MR, \
+        NR \
+    };
+
+// The scalar kernels treat a "vector" as a single double
+#define SCALAR_LOAD(p) (*(p))
+#define SCALAR_STORE(p, v) (*(p) = (v))
+#define SCALAR_SET1(x) (x)
+#define SCALAR_ADD(a, b) ((a) + (b))
+#define SCALAR_SUB(a, b) ((a) - (b))
+#define SCALAR_MUL(a, b) ((a) * (b))
+#define SCALAR_DIV(a, b) ((a) / (b))
+#define SCALAR_NEG(a) (-(a))
+// These match minpd and maxpd, which return the second operand if either is NaN
+#define SCALAR_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define SCALAR_MAX(a, b) ((a) > (b) ? (a) : (b))
+KERNEL_SET(, scalar, double, 1, SCALAR_LOAD, SCALAR_STORE, SCALAR_SET1, SCALAR_ADD, SCALAR_SUB, SCALAR_MUL, SCALAR_DIV, SCALAR_MIN, SCALAR_MAX, SCALAR_NEG, 4, 4)
+
+#ifdef WEAK_X86_KERNELS
+    // Negation flips the sign bit, matching -x for zeroes and NaNs
+    #define SSE2_NEG(a) _mm_xor_pd(a, _mm_set1_pd(-0.))
+    KERNEL_SET(__attribute__((target("sse2"))), sse2, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd, _mm_min_pd, _mm_max_pd, SSE2_NEG, 4, 4)
+
+    #define AVX2_NEG(a) _mm256_xor_pd(a, _mm256_set1_pd(-0.))
+    KERNEL_SET(__attribute__((target("avx2"))), avx2, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd, _mm256_min_pd, _mm256_max_pd, AVX2_NEG, 6, 8)
+
+    // _mm512_xor_pd needs AVX-512DQ, so the sign bit is flipped as an integer
+    #define AVX512_NEG(a) _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_set1_epi64((long long) 0x8000000000000000ULL)))
+    KERNEL_SET(__attribute__((target("avx512f"))), avx512, __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd, _mm512_min_pd, _mm512_max_pd, AVX512_NEG, 8, 16)
+#endif
+
+std::vector<const KernelSet*> supported_kernels() {
+    std::vector<const KernelSet*> sets {&scalar_kernels};
+#ifdef WEAK_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) sets.push_back(&sse2_kernels);
+    if (__builtin_cpu_supports("avx2")) sets.push_back(&avx2_kernels);
+    if (__builtin_cpu_supports("avx512f")) sets.push_back(&avx512_kernels);
+#endif
+    return sets;
+}
+
+const KernelSet& kernels() {
+    static const KernelSet* chosen = supported_kernels().back();
+    return *chosen;
+}
+
+/**
+ * Runs a binary kernel. There's no vector pow, so ^ runs pow per element,
+ * except for the exponents 1, 2 and -1 which have exact equivalents.
+ */
+void kernel_binary(const KernelSet& set, KernelOp op, KernelLayout layout, const double* left, const double* right, double* out, size_t n) {
+    if (op != KERNEL_POWER) {
+        set.binary[op][layout](left, right, out, n);
+        return;
+    }
+    if (layout == ARRAY_SCALAR) {
+        double exponent = *right;
+        if (exponent == 2.) return set.square(left, out, n);
+        if (exponent == -1.) return set.reciprocal(left, out, n);
+        if (exponent == 1.) {
+            for (size_t i = 0; i < n; i++) out[i] = left[i];
+            return;
+        }
+        for (size_t i = 0; i < n; i++) out[i] = pow(left[i], exponent);
+    }
+    else if (layout == SCALAR_ARRAY) {
+        for (size_t i = 0; i < n; i++) out[i] = pow(*left, right[i]);
+    }
+    else {
+        for (size_t i = 0; i < n; i++) out[i] = pow(left[i], right[i]);
+    }
+}
+
+void kernel_binary(KernelOp op, KernelLayout layout, const double* left, const double* right, double* out, size_t n) {
+    const KernelSet& set = kernels();
+    if (n <= PARALLEL_GRAIN) return kernel_binary(set, op, layout, left, right, out, n);
+    parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        const double* l = layout == SCALAR_ARRAY ? left : left + begin;
+        const double* r = layout == ARRAY_SCALAR ? right : right + begin;
+        kernel_binary(set, op, layout, l, r, out + begin, end - begin);
+    });
+}
+
+void kernel_negate(const double* in, double* out, size_t n) {
+    const KernelSet& set = kernels();
+    if (n <= PARALLEL_GRAIN) return set.negate(in, out, n);
+    parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        set.negate(in + begin, out + begin, end - begin);
+    });
+}
+
+/**
+ * Runs a binary kernel over broadcast operands. Dimensions both operands
+ * step through evenly are merged first, so the innermost loop is as long
+ * as possible and each run of it maps onto one of the contiguous layouts.
+ * Threads take separate ranges of rows of the innermost loop.
+ */
+void kernel_broadcast(KernelOp op, const std::vector<size_t>& shape, const double* left, const std::vector<size_t>& left_strides, const double* right, const std::vector<size_t>& right_strides, double* out) {
+    std::vector<size_t> dims, lstrides, rstrides;
+    for (size_t d = 0; d < shape.size(); d++) {
+        if (shape[d] == 0) return;
+        if (shape[d] == 1) continue;
+        if (dims.size() && lstrides.back() == left_strides[d] * shape[d] && rstrides.back() == right_strides[d] * shape[d]) {
+            dims.back() *= shape[d];
+            lstrides.back() = left_strides[d];
+            rstrides.back() = right_strides[d];
+            continue;
+        }
+        dims.push_back(shape[d]);
+        lstrides.push_back(left_strides[d]);
+        rstrides.push_back(right_strides[d]);
+    }
+    const KernelSet& set = kernels();
+    if (dims.size() == 0) return kernel_binary(set, op, ARRAY_ARRAY, left, right, out, 1);
+
+    size_t inner = dims.back();
+    size_t lstride = lstrides.back();
+    size_t rstride = rstrides.back();
+    size_t outer = 1;
+    for (size_t d = 0; d + 1 < dims.size(); d++) outer *= dims[d];
+    parallel_for(outer, std::max<size_t>(PARALLEL_GRAIN / inner, 1), [&](size_t begin, size_t end) {
+        // The index of row begin in the outer dimensions
+        std::vector<size_t> index (dims.size() - 1);
+        size_t loffset = 0, roffset = 0;
+        for (size_t d = index.size(), rest = begin; d-- > 0;) {
+            index[d] = rest % dims[d];
+            rest /= dims[d];
+            loffset += index[d] * lstrides[d];
+            roffset += index[d] * rstrides[d];
+        }
+        for (size_t row = begin; row < end; row++) {
+            const double* l = left + loffset;
+            const double* r = right + roffset;
+            double* o = out + row * inner;
+            if (lstride == 1 && rstride == 1) kernel_binary(set, op, ARRAY_ARRAY, l, r, o, inner);
+            else if (lstride == 0 && rstride == 1) kernel_binary(set, op, SCALAR_ARRAY, l, r, o, inner);
+            else if (lstride == 1 && rstride == 0) kernel_binary(set, op, ARRAY_SCALAR, l, r, o, inner);
+            else for (size_t i = 0; i < inner; i++) kernel_binary(set, op, ARRAY_ARRAY, l + i * lstride, r + i * rstride, o + i, 1);
+            // Step to the next row, carrying into the outer dimensions
+            for (size_t d = index.size(); d-- > 0;) {
+                loffset += lstrides[d];
+                roffset += rstrides[d];
+                if (++index[d] < dims[d]) break;
+                loffset -= lstrides[d] * dims[d];
+                roffset -= rstrides[d] * dims[d];
+                index[d] = 0;
+            }
+        }
+    });
+}
+
+double kernel_reduce(const KernelSet& set, KernelOp op, const double* in, size_t n) {
+    switch (op) {
+    case KERNEL_ADD: return set.sum(in, n);
+    case KERNEL_MULTIPLY: return set.product(in, n);
+    case KERNEL_MIN: return set.min(in, n);
+    case KERNEL_MAX: return set.max(in, n);
+    default: return NAN;
+    }
+}
+
+double kernel_reduce(KernelOp op, const double* in, size_t n) {
+    const KernelSet& set = kernels();
+    if (n <= PARALLEL_GRAIN) return kernel_reduce(set, op, in, n);
+    std::vector<double> partials ((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+    parallel_for(partials.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            size_t start = c * PARALLEL_GRAIN;
+            partials[c] = kernel_reduce(set, op, in + start, std::min(PARALLEL_GRAIN, n - start));
+        }
+    });
+    return kernel_reduce(set, op, partials.data(), partials.size());
+}
+
+double kernel_dot(const double* left, const double* right, size_t n) {
+    const KernelSet& set = kernels();
+    if (n <= PARALLEL_GRAIN) return set.dot(left, right, n);
+    std::vector<double> partials ((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+    parallel_for(partials.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            size_t start = c * PARALLEL_GRAIN;
+            partials[c] = set.dot(left + start, right + start, std::min(PARALLEL_GRAIN, n - start));
+        }
+    });
+    return set.sum(partials.data(), partials.size());
+}
@@ -76,6 +76,7 @@ const std::unordered_map<std::string, TokenType> Lexer::operators_flow = {
     {"@", AT},
     {",", COMMA},
     {";", SEMI},
+    {":", COLON},
     {"(", LEFT_PAREN},
     {")", RIGHT_PAREN},
     {"{", LEFT_BRACE},
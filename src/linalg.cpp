@@ -0,0 +1,451 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "linalg.hpp"
+#include "operations.hpp"
+#include "parallel.hpp"
+#include "gemm.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// The number of columns factored at a time. The blocks of the matrix being
+// updated stay in cache, and the products updating the rest of the matrix
+// are big enough for CBLAS and native_gemm to run at full speed.
+static const size_t BLOCK = 64;
+
+#ifndef WEB_TARGET
+// How CBLAS reads a matrix stored with these strides, one of which is 1
+static CBLAS_TRANSPOSE blas_trans(size_t row_stride, size_t col_stride, size_t& lead) {
+    lead = col_stride == 1 ? row_stride : col_stride;
+    return col_stride == 1 ? CblasNoTrans : CblasTrans;
+}
+
+static bool use_blas(size_t rows, size_t cols, size_t depth) {
+    return gemm_method(rows, cols, depth) == GEMM_CBLAS;
+}
+#endif
+
+// out = a b, where a is rows x depth and b is depth x cols, each read through
+// its own row and column strides (one of which is 1), and out is contiguous
+static void product(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* out) {
+    if (rows == 0 || cols == 0) return;
+    if (depth == 0) {
+        std::fill(out, out + rows * cols, 0.);
+        return;
+    }
+#ifndef WEB_TARGET
+    if (use_blas(rows, cols, depth)) {
+        size_t lda, ldb;
+        CBLAS_TRANSPOSE trans_a = blas_trans(a_row, a_col, lda);
+        CBLAS_TRANSPOSE trans_b = blas_trans(b_row, b_col, ldb);
+        cblas_dgemm(CblasRowMajor, trans_a, trans_b, rows, cols, depth, 1., a, lda, b, ldb, 0., out, cols);
+        return;
+    }
+#endif
+    native_gemm(rows, cols, depth, a, a_row, a_col, b, b_row, b_col, out);
+}
+
+// c -= a b, like product, but where the rows of c are ldc apart
+static void subtract_product(size_t rows, size_t cols, size_t depth, const double* a, size_t a_row, size_t a_col, const double* b, size_t b_row, size_t b_col, double* c, size_t ldc) {
+    if (rows == 0 || cols == 0 || depth == 0) return;
+#ifndef WEB_TARGET
+    if (use_blas(rows, cols, depth)) {
+        size_t lda, ldb;
+        CBLAS_TRANSPOSE trans_a = blas_trans(a_row, a_col, lda);
+        CBLAS_TRANSPOSE trans_b = blas_trans(b_row, b_col, ldb);
+        cblas_dgemm(CblasRowMajor, trans_a, trans_b, rows, cols, depth, -1., a, lda, b, ldb, 1., c, ldc);
+        return;
+    }
+#endif
+    std::vector<double> ab (rows * cols);
+    native_gemm(rows, cols, depth, a, a_row, a_col, b, b_row, b_col, ab.data());
+    for (size_t i = 0; i < rows; i++) {
+        kernel_binary(KERNEL_SUBTRACT, ARRAY_ARRAY, c + i * ldc, ab.data() + i * cols, c + i * ldc, cols);
+    }
+}
+
+/**
+ * Solves t x = b in place for the n x n triangular matrix t, where b has
+ * cols columns and rows ldb apart. A unit triangular t has 1s on its
+ * diagonal, which aren't read. Natively, each row of x is found from the
+ * rows before it a whole row at a time, and threads take separate columns.
+ */
+static void triangular_solve(bool lower, bool unit, size_t n, size_t cols, const double* t, size_t ldt, double* b, size_t ldb) {
+    if (n == 0 || cols == 0) return;
+#ifndef WEB_TARGET
+    if (use_blas(n, cols, n)) {
+        cblas_dtrsm(CblasRowMajor, CblasLeft, lower ? CblasLower : CblasUpper, CblasNoTrans, unit ? CblasUnit : CblasNonUnit, n, cols, 1., t, ldt, b, ldb);
+        return;
+    }
+#endif
+    size_t grain = std::max<size_t>(1, PARALLEL_GRAIN / (n * n));
+    parallel_for(cols, grain, [&](size_t begin, size_t end) {
+        for (size_t step = 0; step < n; step++) {
+            size_t i = lower ? step : n - 1 - step;
+            double* row = b + i * ldb;
+            size_t first = lower ? 0 : i + 1, last = lower ? i : n;
+            for (size_t p = first; p < last; p++) {
+                double factor = t[i * ldt + p];
+                const double* solved = b + p * ldb;
+                for (size_t c = begin; c < end; c++) row[c] -= factor * solved[c];
+            }
+            if (unit) continue;
+            double diagonal = t[i * ldt + i];
+            for (size_t c = begin; c < end; c++) row[c] /= diagonal;
+        }
+    });
+}
+
+/**
+ * Factors the n x n matrix a in place into a unit lower triangular L, below
+ * the diagonal, and an upper triangular U, on and above it, such that L U
+ * is a with its rows reordered: row i of L U is row perm[i] of a. Each
+ * column's pivot is the largest element on or below the diagonal, and
+ * its row is swapped into place across the whole matrix. A column without
+ * a nonzero pivot is left as is, giving U a zero on its diagonal. Returns
+ * the number of row swaps.
+ */
+static size_t lu_factor(size_t n, double* a, std::vector<size_t>& perm) {
+    perm.resize(n);
+    for (size_t i = 0; i < n; i++) perm[i] = i;
+    size_t swaps = 0;
+    for (size_t k0 = 0; k0 < n; k0 += BLOCK) {
+        size_t k1 = std::min(k0 + BLOCK, n);
+        // The block's columns are factored down to the last row
+        for (size_t j = k0; j < k1; j++) {
+            size_t pivot = j;
+            for (size_t i = j + 1; i < n; i++) {
+                if (fabs(a[i * n + j]) > fabs(a[pivot * n + j])) pivot = i;
+            }
+            if (pivot != j) {
+                std::swap_ranges(a + j * n, a + (j + 1) * n, a + pivot * n);
+                std::swap(perm[j], perm[pivot]);
+                swaps++;
+            }
+            double diagonal = a[j * n + j];
+            if (diagonal == 0) continue;
+            const double* pivot_row = a + j * n;
+            for (size_t i = j + 1; i < n; i++) {
+                double* row = a + i * n;
+                double factor = row[j] /= diagonal;
+                for (size_t c = j + 1; c < k1; c++) row[c] -= factor * pivot_row[c];
+            }
+        }
+        // The block's rows of U to the right of it, then the rest of the
+        // matrix less the block's part of L U
+        triangular_solve(true, true, k1 - k0, n - k1, a + k0 * n + k0, n, a + k0 * n + k1, n);
+        subtract_product(n - k1, n - k1, k1 - k0, a + k1 * n + k0, n, 1, a + k0 * n + k1, n, 1, a + k1 * n + k1, n);
+    }
+    return swaps;
+}
+
+static bool is_singular(size_t n, const double* lu) {
+    for (size_t i = 0; i < n; i++) {
+        if (lu[i * n + i] == 0) return true;
+    }
+    return false;
+}
+
+// Overwrites b, which has n rows of cols elements, with the x such that
+// a x = b, given a's factors from lu_factor
+static void lu_solve(size_t n, const double* lu, const std::vector<size_t>& perm, size_t cols, double* b) {
+    std::vector<double> permuted (n * cols);
+    for (size_t i = 0; i < n; i++) std::copy(b + perm[i] * cols, b + (perm[i] + 1) * cols, permuted.begin() + i * cols);
+    std::copy(permuted.begin(), permuted.end(), b);
+    triangular_solve(true, true, n, cols, lu, n, b, cols);
+    triangular_solve(false, false, n, cols, lu, n, b, cols);
+}
+
+/**
+ * Factors the symmetric n x n matrix a in place into a lower triangular L
+ * such that L L^T is a, reading only a's lower triangle. The upper triangle
+ * is cleared. Returns false if a isn't positive definite.
+ */
+static bool cholesky_factor(size_t n, double* a) {
+    for (size_t k0 = 0; k0 < n; k0 += BLOCK) {
+        size_t k1 = std::min(k0 + BLOCK, n);
+        // The block on the diagonal already has every earlier block's part
+        // of L L^T taken away, so only its own columns are left to factor
+        for (size_t j = k0; j < k1; j++) {
+            double* row_j = a + j * n;
+            double diagonal = row_j[j];
+            for (size_t p = k0; p < j; p++) diagonal -= row_j[p] * row_j[p];
+            if (!(diagonal > 0)) return false;
+            row_j[j] = sqrt(diagonal);
+            for (size_t i = j + 1; i < k1; i++) {
+                double* row_i = a + i * n;
+                double sum = row_i[j];
+                for (size_t p = k0; p < j; p++) sum -= row_i[p] * row_j[p];
+                row_i[j] = sum / row_j[j];
+            }
+        }
+        if (k1 == n) break;
+        size_t rest = n - k1, width = k1 - k0;
+        const double* block = a + k0 * n + k0;
+        double* below = a + k1 * n + k0;
+        // The block's part of L below it solves X L_block^T = A_below, then
+        // the lower triangle of the rest of a loses X X^T
+#ifndef WEB_TARGET
+        if (use_blas(rest, rest, width)) {
+            cblas_dtrsm(CblasRowMajor, CblasRight, CblasLower, CblasTrans, CblasNonUnit, rest, width, 1., block, n, below, n);
+            cblas_dsyrk(CblasRowMajor, CblasLower, CblasNoTrans, rest, width, -1., below, n, 1., a + k1 * n + k1, n);
+            continue;
+        }
+#endif
+        parallel_for(rest, std::max<size_t>(1, PARALLEL_GRAIN / (width * width)), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                double* row = below + i * n;
+                for (size_t j = 0; j < width; j++) {
+                    double sum = row[j];
+                    for (size_t p = 0; p < j; p++) sum -= row[p] * block[j * n + p];
+                    row[j] = sum / block[j * n + j];
+                }
+            }
+        });
+        // A block of rows at a time, up to the diagonal
+        for (size_t r0 = 0; r0 < rest; r0 += BLOCK) {
+            size_t r1 = std::min(r0 + BLOCK, rest);
+            subtract_product(r1 - r0, r1, width, below + r0 * n, n, 1, below, 1, n, a + (k1 + r0) * n + k1, n);
+        }
+    }
+    for (size_t i = 0; i < n; i++) std::fill(a + i * n + i + 1, a + (i + 1) * n, 0.);
+    return true;
+}
+
+/**
+ * The compact WY form of reflectors k0 to k1 of a matrix factored by
+ * qr_factor (below): their product is I - V T V^T, where V holds their
+ * vectors as the columns of an (m - k0) x (k1 - k0) matrix, and T is upper
+ * triangular.
+ */
+static void block_reflector(size_t m, size_t n, const double* a, const std::vector<double>& tau, size_t k0, size_t k1, std::vector<double>& v, std::vector<double>& t) {
+    size_t rows = m - k0, width = k1 - k0;
+    v.assign(rows * width, 0.);
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t p = 0; p < width && p <= r; p++) v[r * width + p] = p == r ? 1. : a[(k0 + r) * n + k0 + p];
+    }
+    t.assign(width * width, 0.);
+    std::vector<double> overlap (width);
+    for (size_t j = 0; j < width; j++) {
+        // Column j of T is -tau_j T V^T v_j over the reflectors before j
+        std::fill(overlap.begin(), overlap.end(), 0.);
+        for (size_t r = j; r < rows; r++) {
+            for (size_t p = 0; p < j; p++) overlap[p] += v[r * width + p] * v[r * width + j];
+        }
+        for (size_t p = 0; p < j; p++) {
+            double sum = 0;
+            for (size_t q = p; q < j; q++) sum += t[p * width + q] * overlap[q];
+            t[p * width + j] = -tau[k0 + j] * sum;
+        }
+        t[j * width + j] = tau[k0 + j];
+    }
+}
+
+// c = (I - V T V^T) c, or (I - V T^T V^T) c if transpose is set, where c
+// has V's rows, each cols elements long and ldc apart
+static void apply_reflector(bool transpose, size_t rows, size_t width, const std::vector<double>& v, const std::vector<double>& t, size_t cols, double* c, size_t ldc) {
+    if (cols == 0) return;
+    std::vector<double> vc (width * cols), tvc (width * cols);
+    product(width, cols, rows, v.data(), 1, width, c, ldc, 1, vc.data());
+    if (transpose) product(width, cols, width, t.data(), 1, width, vc.data(), cols, 1, tvc.data());
+    else product(width, cols, width, t.data(), width, 1, vc.data(), cols, 1, tvc.data());
+    subtract_product(rows, cols, width, v.data(), width, 1, tvc.data(), cols, 1, c, ldc);
+}
+
+/**
+ * Factors the m x n matrix a in place with Householder reflections, leaving
+ * R on and above the diagonal and reflector j's vector v_j below it in
+ * column j, with an implicit 1 on the diagonal. Reflector j is
+ * I - tau[j] v_j v_j^T, and Q is the product of the reflectors in order.
+ * Each block of columns is factored one reflector at a time, and the rest
+ * of the matrix is then updated with the whole block's reflectors at once.
+ */
+static void qr_factor(size_t m, size_t n, double* a, std::vector<double>& tau) {
+    size_t k = std::min(m, n);
+    tau.assign(k, 0.);
+    std::vector<double> v, t, sums;
+    for (size_t k0 = 0; k0 < k; k0 += BLOCK) {
+        size_t k1 = std::min(k0 + BLOCK, k);
+        for (size_t j = k0; j < k1; j++) {
+            // The reflector taking column j below the diagonal to zero
+            double below = 0;
+            for (size_t i = j + 1; i < m; i++) below += a[i * n + j] * a[i * n + j];
+            if (below == 0) continue;
+            double alpha = a[j * n + j];
+            double beta = -copysign(sqrt(alpha * alpha + below), alpha);
+            tau[j] = (beta - alpha) / beta;
+            for (size_t i = j + 1; i < m; i++) a[i * n + j] /= alpha - beta;
+            a[j * n + j] = beta;
+            // Applied to the rest of the block's columns a row at a time
+            sums.assign(a + j * n + j + 1, a + j * n + k1);
+            for (size_t i = j + 1; i < m; i++) {
+                double scale = a[i * n + j];
+                for (size_t c = j + 1; c < k1; c++) sums[c - j - 1] += scale * a[i * n + c];
+            }
+            for (size_t c = j + 1; c < k1; c++) a[j * n + c] -= tau[j] * sums[c - j - 1];
+            for (size_t i = j + 1; i < m; i++) {
+                double scale = tau[j] * a[i * n + j];
+                for (size_t c = j + 1; c < k1; c++) a[i * n + c] -= scale * sums[c - j - 1];
+            }
+        }
+        if (k1 == n) continue;
+        block_reflector(m, n, a, tau, k0, k1, v, t);
+        apply_reflector(true, m - k0, k1 - k0, v, t, n - k1, a + k0 * n + k1, n);
+    }
+}
+
+// A private, contiguous f64 copy of a 2d ndarray, to be factored in place
+static NDArray matrix_copy(const Variable& val, const Token& loc) {
+    runtime_assert(val.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    NDArray matrix = std::get<NDArray>(val.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(matrix.shape().size() == 2, loc, "Expression isn't a 2d ndarray");
+    matrix.mutable_data();
+    return matrix;
+}
+
+static NDArray square_copy(const Variable& val, const Token& loc) {
+    NDArray matrix = matrix_copy(val, loc);
+    runtime_assert(matrix.shape()[0] == matrix.shape()[1], loc, "Matrix isn't square");
+    return matrix;
+}
+
+// The letter of a factor named by a string such as "q", which keeps its quotes
+static char part_name(const Variable& part, const char* names, const Token& loc) {
+    const std::string* name = std::get_if<std::string>(&part.value);
+    runtime_assert(name && name->size() == 3 && strchr(names, (*name)[1]), loc, "Unknown factor of a factorization");
+    return (*name)[1];
+}
+
+/**
+ * Square systems are solved with an LU factorization. Taller ones are
+ * solved in the least squares sense with a QR factorization: Q^T is
+ * applied to b a block of reflectors at a time, and R then solved for.
+ */
+Variable solve(const Variable& a_var, const Variable& b_var, const Token& loc) {
+    NDArray a = matrix_copy(a_var, loc);
+    runtime_assert(b_var.is_ndarray(), loc, "Right side of the system isn't an ndarray");
+    NDArray b = std::get<NDArray>(b_var.value).as_dtype(DTYPE_F64).contiguous();
+    b.mutable_data();
+    size_t m = a.shape()[0], n = a.shape()[1];
+    runtime_assert(b.shape().size() == 1 || b.shape().size() == 2, loc, "Right side of the system isn't a 1d or 2d ndarray");
+    runtime_assert(b.shape()[0] == m, loc, "Right side of the system differs in num of rows from the matrix");
+    runtime_assert(m >= n, loc, "Matrix has more columns than rows");
+    size_t cols = b.shape().size() == 2 ? b.shape()[1] : 1;
+    double* elements = a.mutable_data();
+    if (m == n) {
+        std::vector<size_t> perm;
+        lu_factor(n, elements, perm);
+        runtime_assert(!is_singular(n, elements), loc, "Matrix is singular");
+        lu_solve(n, elements, perm, cols, b.mutable_data());
+        return Variable(std::move(b));
+    }
+    std::vector<double> tau, v, t;
+    qr_factor(m, n, elements, tau);
+    for (size_t i = 0; i < n; i++) runtime_assert(elements[i * n + i] != 0, loc, "Matrix is singular");
+    double* rhs = b.mutable_data();
+    for (size_t k0 = 0; k0 < n; k0 += BLOCK) {
+        size_t k1 = std::min(k0 + BLOCK, n);
+        block_reflector(m, n, elements, tau, k0, k1, v, t);
+        apply_reflector(true, m - k0, k1 - k0, v, t, cols, rhs + k0 * cols, cols);
+    }
+    triangular_solve(false, false, n, cols, elements, n, rhs, cols);
+    std::vector<size_t> shape = b.shape();
+    shape[0] = n;
+    NDArray x = NDArray::uninitialized(shape);
+    std::copy(rhs, rhs + n * cols, x.mutable_data());
+    return Variable(std::move(x));
+}
+
+Variable inverse(const Variable& a_var, const Token& loc) {
+    NDArray a = square_copy(a_var, loc);
+    size_t n = a.shape()[0];
+    std::vector<size_t> perm;
+    lu_factor(n, a.mutable_data(), perm);
+    runtime_assert(!is_singular(n, a.data()), loc, "Matrix is singular");
+    NDArray result = NDArray::uninitialized({n, n});
+    double* out = result.mutable_data();
+    std::fill(out, out + n * n, 0.);
+    for (size_t i = 0; i < n; i++) out[i * n + i] = 1.;
+    lu_solve(n, a.data(), perm, n, out);
+    return Variable(std::move(result));
+}
+
+Variable determinant(const Variable& a_var, const Token& loc) {
+    NDArray a = square_copy(a_var, loc);
+    size_t n = a.shape()[0];
+    std::vector<size_t> perm;
+    size_t swaps = lu_factor(n, a.mutable_data(), perm);
+    if (is_singular(n, a.data())) return Variable(0.);
+    double det = swaps % 2 ? -1. : 1.;
+    for (size_t i = 0; i < n; i++) det *= a.data()[i * n + i];
+    return Variable(det);
+}
+
+Variable lu(const Variable& a_var, const Variable& part, const Token& loc) {
+    NDArray a = square_copy(a_var, loc);
+    char name = part_name(part, "plu", loc);
+    size_t n = a.shape()[0];
+    std::vector<size_t> perm;
+    lu_factor(n, a.mutable_data(), perm);
+    NDArray result = NDArray::uninitialized({n, n});
+    double* out = result.mutable_data();
+    const double* factors = a.data();
+    std::fill(out, out + n * n, 0.);
+    for (size_t i = 0; i < n; i++) {
+        if (name == 'p') out[perm[i] * n + i] = 1.;
+        else if (name == 'l') {
+            std::copy(factors + i * n, factors + i * n + i, out + i * n);
+            out[i * n + i] = 1.;
+        }
+        else std::copy(factors + i * n + i, factors + (i + 1) * n, out + i * n + i);
+    }
+    return Variable(std::move(result));
+}
+
+Variable cholesky(const Variable& a_var, const Token& loc) {
+    NDArray a = square_copy(a_var, loc);
+    runtime_assert(cholesky_factor(a.shape()[0], a.mutable_data()), loc, "Matrix isn't positive definite");
+    return Variable(std::move(a));
+}
+
+// Q is built by applying the blocks of reflectors, last first, to the first
+// columns of the identity, each block only touching the rows and columns
+// the later ones have already changed
+Variable qr(const Variable& a_var, const Variable& part, const Token& loc) {
+    NDArray a = matrix_copy(a_var, loc);
+    char name = part_name(part, "qr", loc);
+    size_t m = a.shape()[0], n = a.shape()[1], k = std::min(m, n);
+    std::vector<double> tau;
+    double* factors = a.mutable_data();
+    qr_factor(m, n, factors, tau);
+    if (name == 'r') {
+        NDArray r = NDArray::uninitialized({k, n});
+        double* out = r.mutable_data();
+        std::fill(out, out + k * n, 0.);
+        for (size_t i = 0; i < k; i++) std::copy(factors + i * n + i, factors + (i + 1) * n, out + i * n + i);
+        return Variable(std::move(r));
+    }
+    NDArray q = NDArray::uninitialized({m, k});
+    double* out = q.mutable_data();
+    std::fill(out, out + m * k, 0.);
+    for (size_t i = 0; i < k; i++) out[i * k + i] = 1.;
+    std::vector<double> v, t;
+    size_t num_blocks = (k + BLOCK - 1) / BLOCK;
+    for (size_t block = num_blocks; block-- > 0;) {
+        size_t k0 = block * BLOCK, k1 = std::min(k0 + BLOCK, k);
+        block_reflector(m, n, factors, tau, k0, k1, v, t);
+        apply_reflector(false, m - k0, k1 - k0, v, t, k - k0, out + k0 * k + k0, k);
+    }
+    return Variable(std::move(q));
+}
@@ -14,10 +14,17 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <cerrno>
+#include <cstdlib>
 
 #include "lexer.hpp"
 #include "parser.hpp"
 #include "environment.hpp"
+#include "compiler.hpp"
+#include "vm.hpp"
+#include "parallel.hpp"
+#include "gemm.hpp"
+#include "allocator.hpp"
 
 // We wrap this in an "extern" so that we can access it from
 // JavaScript
@@ -63,12 +70,46 @@ extern "C" {
 }
 
 int main(int argc, char* argv[]) {
-  if (argc == 1) {
-    std::cout << "Usage: " << argv[0] << " INPUT_FILE" << std::endl;
+  bool use_vm = false;
+  bool calibrate = false;
+  bool alloc_stats = false;
+  std::vector<std::string> files;
+  for (size_t i = 1; i < (size_t)argc; i++) {
+    std::string arg (argv[i]);
+    if (arg == "--engine=vm") use_vm = true;
+    else if (arg == "--engine=tree") use_vm = false;
+    else if (arg == "--calibrate-gemm") calibrate = true;
+    else if (arg == "--alloc-stats") alloc_stats = true;
+    else if (arg == "--blas=auto") set_blas_backend(BLAS_AUTO);
+    else if (arg == "--blas=cblas") set_blas_backend(BLAS_CBLAS);
+    else if (arg == "--blas=native") set_blas_backend(BLAS_NATIVE);
+    else if (arg.rfind("--threads=", 0) == 0) {
+      std::string count = arg.substr(strlen("--threads="));
+      errno = 0;
+      unsigned long long parsed = strtoull(count.c_str(), nullptr, 10);
+      if (count.empty() || count.find_first_not_of("0123456789") != std::string::npos || errno == ERANGE || parsed == 0) {
+        std::cout << "Invalid thread count " << count << ". Quitting." << std::endl;
+        return 1;
+      }
+      set_num_threads(parsed);
+    }
+    else if (arg.rfind("--", 0) == 0) {
+      std::cout << "Unknown option " << arg << ". Quitting." << std::endl;
+      return 1;
+    }
+    else files.push_back(arg);
+  }
+  if (calibrate) {
+    calibrate_gemm(std::cout);
+    return 0;
+  }
+  if (files.empty()) {
+    std::cout << "Usage: " << argv[0] << " [--engine=tree|vm] [--blas=auto|cblas|native] [--threads=N] [--alloc-stats] INPUT_FILE" << std::endl;
+    std::cout << "       " << argv[0] << " [--threads=N] --calibrate-gemm" << std::endl;
     return 1;
   }
-  for (size_t i = 1; i < (size_t)argc; i++) {
-    std::ifstream input_file(argv[i]);
+  for (const std::string& file : files) {
+    std::ifstream input_file(file);
     if (input_file.is_open()) {
       std::string read((std::istreambuf_iterator<char>(input_file)),
                        (std::istreambuf_iterator<char>()));
@@ -81,14 +122,27 @@ int main(int argc, char* argv[]) {
       Parser p(tokens);
       std::vector<Stmt*> program = p.parse();
       //std::cout << p.as_dot() << std::endl;
-      Environment env;
-      for (Stmt* stmt : program) env.execute_stmt(stmt);
+      if (use_vm) {
+        Compiler compiler;
+        std::unique_ptr<Program> compiled = compiler.compile(program);
+        VM vm;
+        vm.run(*compiled);
+      } else {
+        Environment env;
+        for (Stmt* stmt : program) env.execute_stmt(stmt);
+      }
       for (auto stmt : program) delete stmt;
     } else {
-      std::cout << "Couldn't open file " << argv[i] << ". Quitting."
+      std::cout << "Couldn't open file " << file << ". Quitting."
                 << std::endl;
       return 1;
     }
   }
+  if (alloc_stats) {
+    AllocationCounts counts = allocation_counts();
+    std::cerr << "ndarray buffers from the system: " << counts.system_allocations
+              << ", reused: " << counts.reused
+              << ", returned to the system: " << counts.system_frees << std::endl;
+  }
   return 0;
 }
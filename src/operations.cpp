@@ -0,0 +1,699 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "operations.hpp"
+#include "sparse.hpp"
+#include "indexing.hpp"
+
+#include <optional>
+
+std::string create_runtime_error(const std::string& error_msg, const Token& loc) {
+    return "Runtime error: " + error_msg + ", occurred at line " + std::to_string(loc.line) + " at column " + std::to_string(loc.col);
+}
+
+std::vector<size_t> broadcast_shape(const std::vector<size_t>& left, const std::vector<size_t>& right, const Token& loc) {
+    std::vector<size_t> shape (std::max(left.size(), right.size()));
+    for (size_t i = 1; i <= shape.size(); i++) {
+        size_t left_dim = i <= left.size() ? left[left.size() - i] : 1;
+        size_t right_dim = i <= right.size() ? right[right.size() - i] : 1;
+        runtime_assert(left_dim == right_dim || left_dim == 1 || right_dim == 1, loc, "Expressions evaluate to arrays of differing sizes");
+        shape[shape.size() - i] = left_dim == 1 ? right_dim : left_dim;
+    }
+    return shape;
+}
+
+std::vector<size_t> broadcast_strides(const NDArray& array, const std::vector<size_t>& shape) {
+    std::vector<size_t> strides (shape.size(), 0);
+    size_t offset = shape.size() - array.shape().size();
+    for (size_t d = 0; d < array.shape().size(); d++) {
+        if (array.shape()[d] != 1) strides[offset + d] = array.strides()[d];
+    }
+    return strides;
+}
+
+// Whether an operation can write its result over array's own elements
+static bool can_overwrite(const NDArray& array) {
+    return !array.is_shared() && array.is_contiguous();
+}
+
+static void binary_elements(DType dtype, KernelOp kernel, KernelLayout layout, const void* left, const void* right, void* out, size_t n) {
+    if (dtype == DTYPE_F64) kernel_binary(kernel, layout, (const double*) left, (const double*) right, (double*) out, n);
+    else typed_binary(dtype, kernel, layout, left, right, out, n);
+}
+
+// The dtype two operands that are each a number or an ndarray are promoted
+// to before an operator is applied to them. Two numbers are f64.
+static DType operand_dtype(const Variable& left, const Variable& right) {
+    const NDArray* left_arr = std::get_if<NDArray>(&left.value);
+    const NDArray* right_arr = std::get_if<NDArray>(&right.value);
+    if (left_arr && right_arr) return promote(left_arr->dtype(), right_arr->dtype());
+    if (left_arr) return promote_scalar(left_arr->dtype(), std::get<double>(right.value));
+    if (right_arr) return promote_scalar(right_arr->dtype(), std::get<double>(left.value));
+    return DTYPE_F64;
+}
+
+/**
+ * Applies a binary kernel to doubles and ndarrays, broadcasting ndarrays of
+ * different shapes. An operand ndarray with the result's shape and dtype
+ * that isn't shared with anything else (e.g. a temporary, or a variable
+ * being overwritten by the result) is reused to hold the result. Operands
+ * are first converted to the dtype of the result.
+ */
+template <typename F>
+static Variable elementwise(Variable left_var, Variable right_var, const Token& loc, KernelOp kernel, F op) {
+    if (left_var.is_double() && right_var.is_double()) {
+        return Variable(op(std::get<double>(left_var.value), std::get<double>(right_var.value)));
+    }
+    NDArray* left_arr = std::get_if<NDArray>(&left_var.value);
+    NDArray* right_arr = std::get_if<NDArray>(&right_var.value);
+    runtime_assert((left_arr || left_var.is_double()) && (right_arr || right_var.is_double()), loc, "At least one of left and right expressions are neither numbers nor ndarrays");
+    DType dtype = arithmetic_dtype(kernel, operand_dtype(left_var, right_var));
+    if (left_arr && left_arr->dtype() != dtype) *left_arr = left_arr->as_dtype(dtype);
+    if (right_arr && right_arr->dtype() != dtype) *right_arr = right_arr->as_dtype(dtype);
+    // A number operand as an element of the result's dtype
+    alignas(8) unsigned char left_scalar[8], right_scalar[8];
+    if (!left_arr) store_element(dtype, std::get<double>(left_var.value), left_scalar);
+    if (!right_arr) store_element(dtype, std::get<double>(right_var.value), right_scalar);
+    const void* left = left_arr ? left_arr->raw_data() : left_scalar;
+    const void* right = right_arr ? right_arr->raw_data() : right_scalar;
+    std::vector<size_t> shape = left_arr ? left_arr->shape() : right_arr->shape();
+    if (left_arr && right_arr && left_arr->shape() != right_arr->shape()) {
+        shape = broadcast_shape(left_arr->shape(), right_arr->shape(), loc);
+    }
+
+    bool left_flat = !left_arr || (left_arr->shape() == shape && left_arr->is_contiguous());
+    bool right_flat = !right_arr || (right_arr->shape() == shape && right_arr->is_contiguous());
+    // Broadcast operands and views are read through their strides, and a
+    // scalar is an operand whose strides are all 0
+    std::vector<size_t> left_strides, right_strides;
+    if (!left_flat || !right_flat) {
+        left_strides = left_arr ? broadcast_strides(*left_arr, shape) : std::vector<size_t>(shape.size());
+        right_strides = right_arr ? broadcast_strides(*right_arr, shape) : std::vector<size_t>(shape.size());
+    }
+
+    NDArray* out_arr = nullptr;
+    if (left_arr && left_arr->shape() == shape && can_overwrite(*left_arr)) out_arr = left_arr;
+    else if (right_arr && right_arr->shape() == shape && can_overwrite(*right_arr)) out_arr = right_arr;
+    // Taking the operand's buffer leaves left and right pointing into it
+    NDArray result = out_arr ? std::move(*out_arr) : NDArray::uninitialized(shape, dtype);
+    void* out = result.mutable_raw_data();
+    if (left_flat && right_flat) {
+        KernelLayout layout = !left_arr ? SCALAR_ARRAY : !right_arr ? ARRAY_SCALAR : ARRAY_ARRAY;
+        binary_elements(dtype, kernel, layout, left, right, out, result.size());
+    }
+    else if (dtype == DTYPE_F64) {
+        kernel_broadcast(kernel, shape, (const double*) left, left_strides, (const double*) right, right_strides, (double*) out);
+    }
+    else {
+        typed_broadcast(dtype, kernel, shape, left, left_strides, right, right_strides, out);
+    }
+    return Variable(std::move(result));
+}
+
+Variable arithmetic(TokenType op, Variable left, Variable right, const Token& loc) {
+    switch (op) {
+    case PLUS: return elementwise(std::move(left), std::move(right), loc, KERNEL_ADD, [](double a, double b) { return a + b; });
+    case MINUS: return elementwise(std::move(left), std::move(right), loc, KERNEL_SUBTRACT, [](double a, double b) { return a - b; });
+    case STAR: return elementwise(std::move(left), std::move(right), loc, KERNEL_MULTIPLY, [](double a, double b) { return a * b; });
+    case SLASH: return elementwise(std::move(left), std::move(right), loc, KERNEL_DIVIDE, [](double a, double b) { return a / b; });
+    case EXP: return elementwise(std::move(left), std::move(right), loc, KERNEL_POWER, [](double a, double b) { return pow(a, b); });
+    default: runtime_assert(false, loc, "Invalid binary operator");
+    }
+    return Variable();
+}
+
+static CompareOp compare_op(TokenType op, const Token& loc) {
+    switch (op) {
+    case LESSER: return COMPARE_LESS;
+    case LESSER_EQUALS: return COMPARE_LESS_EQUAL;
+    case GREATER: return COMPARE_GREATER;
+    case GREATER_EQUALS: return COMPARE_GREATER_EQUAL;
+    case EQUALS_EQUALS: return COMPARE_EQUAL;
+    case EXCLA_EQUALS: return COMPARE_NOT_EQUAL;
+    default: runtime_assert(false, loc, "Invalid binary operator");
+    }
+    return COMPARE_EQUAL;
+}
+
+/**
+ * An operand of an elementwise operation of the given shape, as a pointer
+ * to its first element of dtype and the strides reading it broadcast to
+ * shape. A number is written to scalar, and read with strides of 0.
+ */
+static const void* broadcast_operand(const Variable& val, DType dtype, const std::vector<size_t>& shape, std::optional<NDArray>& converted, unsigned char* scalar, std::vector<size_t>& strides) {
+    if (!val.is_ndarray()) {
+        store_element(dtype, std::get<double>(val.value), scalar);
+        strides.assign(shape.size(), 0);
+        return scalar;
+    }
+    converted = std::get<NDArray>(val.value).as_dtype(dtype);
+    strides = broadcast_strides(*converted, shape);
+    return converted->raw_data();
+}
+
+/**
+ * Compares numbers and ndarrays element by element, broadcasting them like
+ * arithmetic does, and gives a bool ndarray with a 1 wherever the
+ * comparison holds. Operands are compared in the dtype arithmetic between
+ * them would have, so i64 elements are compared with integers exactly.
+ */
+Variable elementwise_compare(TokenType op, const Variable& left, const Variable& right, const Token& loc) {
+    runtime_assert((left.is_ndarray() || left.is_double()) && (right.is_ndarray() || right.is_double()), loc, "At least one of left and right expressions are neither numbers nor ndarrays");
+    CompareOp comparison = compare_op(op, loc);
+    if (left.is_double() && right.is_double()) {
+        uint8_t result;
+        double l = std::get<double>(left.value), r = std::get<double>(right.value);
+        typed_compare(DTYPE_F64, comparison, {}, &l, {}, &r, {}, &result);
+        return Variable((bool) result);
+    }
+    DType dtype = operand_dtype(left, right);
+    std::vector<size_t> shape = left.is_ndarray() ? std::get<NDArray>(left.value).shape() : std::get<NDArray>(right.value).shape();
+    if (left.is_ndarray() && right.is_ndarray()) shape = broadcast_shape(shape, std::get<NDArray>(right.value).shape(), loc);
+    std::optional<NDArray> left_arr, right_arr;
+    alignas(8) unsigned char left_scalar[8], right_scalar[8];
+    std::vector<size_t> left_strides, right_strides;
+    const void* l = broadcast_operand(left, dtype, shape, left_arr, left_scalar, left_strides);
+    const void* r = broadcast_operand(right, dtype, shape, right_arr, right_scalar, right_strides);
+    NDArray mask = NDArray::uninitialized(shape, DTYPE_BOOL);
+    typed_compare(dtype, comparison, shape, l, left_strides, r, right_strides, (uint8_t*) mask.mutable_raw_data());
+    return Variable(std::move(mask));
+}
+
+Variable compare(TokenType op, const Variable& left, const Variable& right, const Token& loc) {
+    switch (op) {
+    case EQUALS_EQUALS: return Variable(left.value.index() == right.value.index() && left.value == right.value);
+    case EXCLA_EQUALS: return Variable(left.value.index() != right.value.index() || left.value != right.value);
+    default: break;
+    }
+    if (left.is_ndarray() || right.is_ndarray()) return elementwise_compare(op, left, right, loc);
+    runtime_assert(left.value.index() == right.value.index(), loc, "Left and right expressions differ in type");
+    switch (op) {
+    case GREATER_EQUALS: return Variable(left.value >= right.value);
+    case GREATER: return Variable(left.value > right.value);
+    case LESSER_EQUALS: return Variable(left.value <= right.value);
+    case LESSER: return Variable(left.value < right.value);
+    default: runtime_assert(false, loc, "Invalid binary operator");
+    }
+    return Variable();
+}
+
+// A stack of batch matrices of the same shape, each read through strides.
+// A stack of one matrix has a batch_stride of 0, so it can be reused for
+// every matrix of another stack.
+template <typename T>
+struct Matrices {
+    const T* data;
+    size_t batch, rows, cols;
+    size_t batch_stride, row_stride, col_stride;
+};
+
+// A 1d array is a single row if row_vector is set, and otherwise a column
+template <typename T>
+static Matrices<T> as_matrices(const NDArray& array, bool row_vector) {
+    const std::vector<size_t>& shape = array.shape();
+    const std::vector<size_t>& strides = array.strides();
+    const T* data = (const T*) array.raw_data();
+    if (shape.size() == 1) {
+        if (row_vector) return Matrices<T> {data, 1, 1, shape[0], 0, shape[0], strides[0]};
+        return Matrices<T> {data, 1, shape[0], 1, 0, strides[0], 1};
+    }
+    size_t d = shape.size();
+    bool stack = d == 3;
+    size_t batch = stack ? shape[0] : 1;
+    return Matrices<T> {data, batch, shape[d - 2], shape[d - 1], batch > 1 ? strides[0] : 0, strides[d - 2], strides[d - 1]};
+}
+
+#ifndef WEB_TARGET
+/**
+ * Describes one matrix to BLAS without copying it: rows that are runs of
+ * elements are passed as is, and columns that are runs of elements (as in a
+ * transposed view) are passed as the transpose of a row-major matrix. lead
+ * is the distance between those runs. Returns false for any other layout.
+ */
+template <typename T>
+static bool blas_layout(const Matrices<T>& matrices, CBLAS_TRANSPOSE& trans, size_t& lead) {
+    size_t rows = matrices.rows, cols = matrices.cols;
+    size_t row_stride = matrices.row_stride, col_stride = matrices.col_stride;
+    if ((cols == 1 || col_stride == 1) && (rows == 1 || row_stride >= cols)) {
+        trans = CblasNoTrans;
+        lead = rows == 1 ? std::max(cols, (size_t) 1) : row_stride;
+        return true;
+    }
+    if ((rows == 1 || row_stride == 1) && (cols == 1 || col_stride >= rows)) {
+        trans = CblasTrans;
+        lead = cols == 1 ? std::max(rows, (size_t) 1) : col_stride;
+        return true;
+    }
+    return false;
+}
+
+// Copies array to a contiguous one if its matrices can't be handed to BLAS
+template <typename T>
+static Matrices<T> blas_matrices(NDArray& array, bool row_vector, CBLAS_TRANSPOSE& trans, size_t& lead) {
+    Matrices<T> matrices = as_matrices<T>(array, row_vector);
+    if (blas_layout(matrices, trans, lead)) return matrices;
+    array = array.contiguous();
+    matrices = as_matrices<T>(array, row_vector);
+    blas_layout(matrices, trans, lead);
+    return matrices;
+}
+
+// The double and single precision BLAS routines, overloaded by element type
+static double blas_dot(size_t n, const double* x, size_t incx, const double* y, size_t incy) {
+    return cblas_ddot(n, x, incx, y, incy);
+}
+
+static float blas_dot(size_t n, const float* x, size_t incx, const float* y, size_t incy) {
+    return cblas_sdot(n, x, incx, y, incy);
+}
+
+static void blas_gemv(CBLAS_TRANSPOSE trans, size_t m, size_t n, const double* a, size_t lda, const double* x, size_t incx, double* y) {
+    cblas_dgemv(CblasRowMajor, trans, m, n, 1., a, lda, x, incx, 0., y, 1);
+}
+
+static void blas_gemv(CBLAS_TRANSPOSE trans, size_t m, size_t n, const float* a, size_t lda, const float* x, size_t incx, float* y) {
+    cblas_sgemv(CblasRowMajor, trans, m, n, 1.f, a, lda, x, incx, 0.f, y, 1);
+}
+
+static void blas_gemm(CBLAS_TRANSPOSE trans_a, CBLAS_TRANSPOSE trans_b, size_t m, size_t n, size_t k, const double* a, size_t lda, const double* b, size_t ldb, double* c) {
+    cblas_dgemm(CblasRowMajor, trans_a, trans_b, m, n, k, 1., a, lda, b, ldb, 0., c, n);
+}
+
+static void blas_gemm(CBLAS_TRANSPOSE trans_a, CBLAS_TRANSPOSE trans_b, size_t m, size_t n, size_t k, const float* a, size_t lda, const float* b, size_t ldb, float* c) {
+    cblas_sgemm(CblasRowMajor, trans_a, trans_b, m, n, k, 1.f, a, lda, b, ldb, 0.f, c, n);
+}
+
+/**
+ * The products of matmul on CBLAS, with products with a vector running as
+ * matrix-vector products. Transposed views are handed to BLAS as they are,
+ * with CblasTrans.
+ */
+template <typename T>
+static void blas_products(NDArray left_arr, NDArray right_arr, size_t batch, T* out) {
+    size_t left_dims = left_arr.shape().size(), right_dims = right_arr.shape().size();
+    CBLAS_TRANSPOSE left_trans, right_trans;
+    size_t left_lead, right_lead;
+    Matrices<T> a = blas_matrices<T>(left_arr, true, left_trans, left_lead);
+    Matrices<T> b = blas_matrices<T>(right_arr, false, right_trans, right_lead);
+    size_t r = a.rows, m = a.cols, c = b.cols;
+    if (m == 0) {
+        // Matrices with no columns multiply to zeroes
+        std::fill(out, out + batch * r * c, (T) 0);
+        return;
+    }
+    if (r == 0 || c == 0) return;
+    for (size_t n = 0; n < batch; n++, out += r * c) {
+        const T* a_n = a.data + n * a.batch_stride;
+        const T* b_n = b.data + n * b.batch_stride;
+        if (left_dims == 1 && right_dims == 1) {
+            *out = blas_dot(m, a_n, a.col_stride, b_n, b.row_stride);
+        }
+        else if (right_dims == 1) {
+            // out = a_n x, where a_n is stored as is or as its transpose
+            if (left_trans == CblasNoTrans) blas_gemv(CblasNoTrans, r, m, a_n, left_lead, b_n, b.row_stride, out);
+            else blas_gemv(CblasTrans, m, r, a_n, left_lead, b_n, b.row_stride, out);
+        }
+        else if (left_dims == 1) {
+            // out = x b_n, which is the transpose of b_n times x
+            if (right_trans == CblasNoTrans) blas_gemv(CblasTrans, m, c, b_n, right_lead, a_n, a.col_stride, out);
+            else blas_gemv(CblasNoTrans, c, m, b_n, right_lead, a_n, a.col_stride, out);
+        }
+        else {
+            blas_gemm(left_trans, right_trans, r, c, m, a_n, left_lead, b_n, right_lead, out);
+        }
+    }
+}
+#endif
+
+/**
+ * Multiplies matrices like NumPy's matmul. A 1d left operand is a row
+ * vector and a 1d right operand is a column vector, and that dimension is
+ * left out of the result, so two vectors give their dot product. 3d operands
+ * are stacks of matrices multiplied pairwise, and a 2d operand (or a stack
+ * of one matrix) is multiplied with every matrix of the other stack. Each
+ * matrix is read in place through its strides. gemm_method picks between
+ * CBLAS and the native kernels by the size of the matrices. Two f32
+ * operands give an f32 product, computed with CBLAS in single precision,
+ * and anything else is multiplied in f64.
+ */
+Variable matmul(const Variable& left_var, const Variable& right_var, const Token& loc) {
+    if (left_var.is_sparse() || right_var.is_sparse()) return sparse_matmul(left_var, right_var, loc);
+    runtime_assert(left_var.is_ndarray(), loc, "Left expression isn't an ndarray");
+    runtime_assert(right_var.is_ndarray(), loc, "Right expression isn't an ndarray");
+    const NDArray& left_in = std::get<NDArray>(left_var.value);
+    const NDArray& right_in = std::get<NDArray>(right_var.value);
+    size_t left_dims = left_in.shape().size();
+    size_t right_dims = right_in.shape().size();
+    runtime_assert(left_dims >= 1 && left_dims <= 3, loc, "Left expression isn't a 1d, 2d or 3d ndarray");
+    runtime_assert(right_dims >= 1 && right_dims <= 3, loc, "Right expression isn't a 1d, 2d or 3d ndarray");
+    Matrices<double> a = as_matrices<double>(left_in, true);
+    Matrices<double> b = as_matrices<double>(right_in, false);
+    runtime_assert(a.cols == b.rows, loc, "Left array's num of cols differs from right array's num of rows");
+    runtime_assert(a.batch == b.batch || a.batch == 1 || b.batch == 1, loc, "Stacks of matrices differ in size");
+    size_t batch = std::max(a.batch, b.batch);
+    size_t r = a.rows, m = a.cols, c = b.cols;
+    std::vector<size_t> shape;
+    if (left_dims == 3 || right_dims == 3) shape.push_back(batch);
+    if (left_dims > 1) shape.push_back(r);
+    if (right_dims > 1) shape.push_back(c);
+
+    DType dtype = left_in.dtype() == DTYPE_F32 && right_in.dtype() == DTYPE_F32 ? DTYPE_F32 : DTYPE_F64;
+#ifndef WEB_TARGET
+    if (dtype == DTYPE_F32) {
+        NDArray result = NDArray::uninitialized(shape, DTYPE_F32);
+        blas_products(left_in, right_in, batch, (float*) result.mutable_raw_data());
+        if (shape.empty()) return Variable(load_element(DTYPE_F32, result.raw_data()));
+        return Variable(std::move(result));
+    }
+#endif
+    // Without CBLAS, f32 products are computed in f64 too
+    NDArray left_arr = left_in.as_dtype(DTYPE_F64);
+    NDArray right_arr = right_in.as_dtype(DTYPE_F64);
+    a = as_matrices<double>(left_arr, true);
+    b = as_matrices<double>(right_arr, false);
+    NDArray result = NDArray::uninitialized(shape);
+    double* out = result.mutable_data();
+
+    GemmMethod method = gemm_method(r, c, m);
+    if (method == GEMM_TINY) {
+        for (size_t n = 0; n < batch; n++, out += r * c) {
+            tiny_gemm(r, c, m, a.data + n * a.batch_stride, a.row_stride, a.col_stride, b.data + n * b.batch_stride, b.row_stride, b.col_stride, out);
+        }
+    }
+    else if (method == GEMM_NATIVE) {
+        for (size_t n = 0; n < batch; n++, out += r * c) {
+            native_gemm(r, c, m, a.data + n * a.batch_stride, a.row_stride, a.col_stride, b.data + n * b.batch_stride, b.row_stride, b.col_stride, out);
+        }
+    }
+#ifndef WEB_TARGET
+    else {
+        blas_products(left_arr, right_arr, batch, out);
+    }
+#endif
+    if (shape.empty()) return Variable(result.data()[0]);
+    return Variable(result.as_dtype(dtype));
+}
+
+/**
+ * Reverses the dimensions of an ndarray, so a 2d array becomes its
+ * transpose. Only the shape and strides change: the result is a view.
+ * Sparse matrices are transposed into a new sparse matrix.
+ */
+Variable transpose(const Variable& val, const Token& loc) {
+    if (val.is_sparse()) return Variable(sparse_transpose(std::get<SparseMatrix>(val.value)));
+    runtime_assert(val.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    const NDArray& array = std::get<NDArray>(val.value);
+    std::vector<size_t> shape (array.shape().rbegin(), array.shape().rend());
+    std::vector<size_t> strides (array.strides().rbegin(), array.strides().rend());
+    return Variable(array.view(0, std::move(shape), std::move(strides)));
+}
+
+/**
+ * Fills out[0..n) by repeating values[0..count). Each thread is the first to
+ * write its range, so the pages of a big new array are faulted in across all
+ * the threads. T is any type the size of an element, as they're only copied.
+ */
+template <typename T>
+static void fill_repeating(const T* values, size_t count, T* out, size_t n) {
+    parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        if (count == 1) {
+            std::fill(out + begin, out + end, values[0]);
+            return;
+        }
+        size_t original_idx = begin % count;
+        for(size_t i = begin; i < end; ++i) {
+            out[i] = values[original_idx];
+            original_idx++;
+            if(original_idx == count) {
+                original_idx = 0;
+            }
+        }
+    });
+}
+
+Variable as_shape(const Variable& left_var, const Variable& right_var, const Token& loc) {
+    runtime_assert(left_var.is_ndarray(), loc, "Left expression isn't an ndarray");
+    runtime_assert(right_var.is_ndarray(), loc, "Right expression isn't an ndarray");
+    NDArray new_size_arr = std::get<NDArray>(right_var.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(new_size_arr.size() > 0, loc, "The shape of an ndarray must have at least one dimension");
+    const double* new_size_double = new_size_arr.data();
+    std::vector<size_t> new_size;
+    for (size_t i = 0; i < new_size_arr.size(); i++) {
+        size_t casted = (size_t) new_size_double[i];
+        runtime_assert((double) casted == new_size_double[i], loc, "An expression used in array size is not close to an integer");
+        new_size.push_back(casted);
+    }
+    // The filled array keeps the dtype of the values it's filled with
+    NDArray fill_arr = std::get<NDArray>(left_var.value).contiguous();
+    size_t full_length = new_size_double[0];
+    for (size_t i = 1; i < new_size_arr.size(); i++) {
+        full_length *= new_size_double[i];
+    }
+    runtime_assert(fill_arr.size() > 0 || full_length == 0, loc, "Can't fill an ndarray from an empty ndarray");
+    NDArray filled = NDArray::uninitialized(new_size, fill_arr.dtype());
+    switch (dtype_size(fill_arr.dtype())) {
+    case 1: fill_repeating((const uint8_t*) fill_arr.raw_data(), fill_arr.size(), (uint8_t*) filled.mutable_raw_data(), full_length); break;
+    case 4: fill_repeating((const uint32_t*) fill_arr.raw_data(), fill_arr.size(), (uint32_t*) filled.mutable_raw_data(), full_length); break;
+    default: fill_repeating((const uint64_t*) fill_arr.raw_data(), fill_arr.size(), (uint64_t*) filled.mutable_raw_data(), full_length); break;
+    }
+    return Variable(std::move(filled));
+}
+
+/**
+ * Picks elements from a where mask is nonzero and from b elsewhere, with
+ * all three broadcast together. The result has the dtype of arithmetic
+ * between a and b.
+ */
+Variable select(const Variable& mask_var, const Variable& a, const Variable& b, const Token& loc) {
+    runtime_assert(mask_var.is_ndarray(), loc, "Condition of where isn't an ndarray");
+    runtime_assert((a.is_ndarray() || a.is_double()) && (b.is_ndarray() || b.is_double()), loc, "Values of where are neither numbers nor ndarrays");
+    NDArray mask = std::get<NDArray>(mask_var.value).as_dtype(DTYPE_BOOL);
+    DType dtype = operand_dtype(a, b);
+    std::vector<size_t> shape = mask.shape();
+    if (a.is_ndarray()) shape = broadcast_shape(shape, std::get<NDArray>(a.value).shape(), loc);
+    if (b.is_ndarray()) shape = broadcast_shape(shape, std::get<NDArray>(b.value).shape(), loc);
+    std::optional<NDArray> a_arr, b_arr;
+    alignas(8) unsigned char a_scalar[8], b_scalar[8];
+    std::vector<size_t> a_strides, b_strides;
+    const void* x = broadcast_operand(a, dtype, shape, a_arr, a_scalar, a_strides);
+    const void* y = broadcast_operand(b, dtype, shape, b_arr, b_scalar, b_strides);
+    NDArray result = NDArray::uninitialized(shape, dtype);
+    typed_select(dtype, shape, (const uint8_t*) mask.raw_data(), broadcast_strides(mask, shape), x, a_strides, y, b_strides, result.mutable_raw_data());
+    return Variable(std::move(result));
+}
+
+static void negate_elements(DType dtype, const void* in, void* out, size_t n) {
+    if (dtype == DTYPE_F64) kernel_negate((const double*) in, (double*) out, n);
+    else typed_negate(dtype, in, out, n);
+}
+
+Variable negate(Variable val, const Token& loc) {
+    if (val.is_ndarray()) {
+        NDArray array = std::get<NDArray>(std::move(val.value));
+        // Bools are negated as integers
+        array = array.as_dtype(arithmetic_dtype(KERNEL_SUBTRACT, array.dtype()));
+        if (!array.is_contiguous()) array = array.contiguous();
+        if (can_overwrite(array)) {
+            negate_elements(array.dtype(), array.raw_data(), array.mutable_raw_data(), array.size());
+            return Variable(std::move(array));
+        }
+        NDArray result = NDArray::uninitialized(array.shape(), array.dtype());
+        negate_elements(array.dtype(), array.raw_data(), result.mutable_raw_data(), result.size());
+        return Variable(std::move(result));
+    }
+    runtime_assert(val.is_double(), loc, "Expression evaluates to a non-number");
+    return Variable(-std::get<double>(val.value));
+}
+
+Variable logical_not(const Variable& val, const Token& loc) {
+    runtime_assert(val.is_bool(), loc, "Expression evaluates to a non-bool");
+    return Variable(!std::get<bool>(val.value));
+}
+
+Variable shape_of(const Variable& val, const Token& loc) {
+    if (val.is_sparse()) {
+        const SparseMatrix& matrix = std::get<SparseMatrix>(val.value);
+        return Variable(NDArray({(double) matrix.rows(), (double) matrix.cols()}, {2}));
+    }
+    runtime_assert(val.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    const std::vector<size_t>& shape = std::get<NDArray>(val.value).shape();
+    NDArray casted_shape = NDArray::uninitialized({shape.size()});
+    std::copy(shape.begin(), shape.end(), casted_shape.mutable_data());
+    return Variable(std::move(casted_shape));
+}
+
+/**
+ * Checks each index against the shape of the array being indexed, and returns
+ * the position of the indexed element relative to the array's data().
+ */
+static size_t flat_index(const NDArray& array, const Variable* indices, size_t num_indices, const Token& loc) {
+    const std::vector<size_t>& shape = array.shape();
+    const std::vector<size_t>& strides = array.strides();
+    runtime_assert(shape.size() == num_indices, loc, "Number of dimensions in array element access differs from number of dimensions in array");
+    size_t flat_index = 0;
+    for (size_t i = 0; i < num_indices; i++) {
+        const double* index = std::get_if<double>(&indices[i].value);
+        runtime_assert(index, loc, "An expression used in array indexing is not a number");
+        size_t casted = (size_t) *index;
+        runtime_assert((double) casted == *index, loc, "An expression used in array indexing is not close to an integer");
+        runtime_assert(casted < shape[i], loc, "An expression used in array indexing is larger than a dimension of the ndarray");
+        flat_index += casted * strides[i];
+    }
+    return flat_index;
+}
+
+// A bool ndarray of the same shape as array, indexing the elements it's set at
+static NDArray index_mask(const NDArray& array, const Variable& index, const Token& loc) {
+    const NDArray& mask = std::get<NDArray>(index.value);
+    runtime_assert(mask.shape() == array.shape(), loc, "A mask used in array indexing differs in shape from the ndarray");
+    return mask.contiguous();
+}
+
+Variable index_read(const Variable& arr, const Variable* indices, size_t num_indices, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Identifier in array access isn't an ndarray");
+    const NDArray& array = std::get<NDArray>(arr.value);
+    if (is_fancy_index(indices, num_indices)) return gather(array, indices, num_indices, loc);
+    // A mask picks out the elements it's set at, as a 1d array
+    if (num_indices == 1 && indices[0].is_ndarray()) {
+        NDArray mask = index_mask(array, indices[0], loc);
+        const uint8_t* set = (const uint8_t*) mask.raw_data();
+        NDArray result = NDArray::uninitialized({count_set(set, mask.size())}, array.dtype());
+        typed_compress(array.dtype(), array.contiguous().raw_data(), set, mask.size(), result.mutable_raw_data());
+        return Variable(std::move(result));
+    }
+    const unsigned char* elements = (const unsigned char*) array.raw_data();
+    return Variable(load_element(array.dtype(), elements + flat_index(array, indices, num_indices, loc) * dtype_size(array.dtype())));
+}
+
+// A part of a slice as a count of elements, or fallback if it was left out
+static size_t slice_part(const Variable& part, size_t fallback, const Token& loc) {
+    if (part.is_nil()) return fallback;
+    const double* value = std::get_if<double>(&part.value);
+    runtime_assert(value, loc, "An expression used in array slicing is not a number");
+    size_t casted = (size_t) *value;
+    runtime_assert((double) casted == *value, loc, "An expression used in array slicing is not close to a non-negative integer");
+    return casted;
+}
+
+/**
+ * Builds the view for a slice without touching any elements: each slice
+ * moves the start of the view and multiplies a stride by its step, and each
+ * plain index moves the start and drops its dimension.
+ */
+Variable slice_read(const Variable& arr, const Variable* parts, size_t num_indices, uint64_t slices, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Identifier in array access isn't an ndarray");
+    const NDArray& array = std::get<NDArray>(arr.value);
+    const std::vector<size_t>& shape = array.shape();
+    const std::vector<size_t>& strides = array.strides();
+    runtime_assert(shape.size() == num_indices, loc, "Number of dimensions in array element access differs from number of dimensions in array");
+    size_t offset = 0;
+    std::vector<size_t> view_shape, view_strides;
+    for (size_t i = 0; i < num_indices; i++) {
+        if (!(slices >> i & 1)) {
+            const double* index = std::get_if<double>(&(parts++)->value);
+            runtime_assert(index, loc, "An expression used in array indexing is not a number");
+            size_t casted = (size_t) *index;
+            runtime_assert((double) casted == *index, loc, "An expression used in array indexing is not close to an integer");
+            runtime_assert(casted < shape[i], loc, "An expression used in array indexing is larger than a dimension of the ndarray");
+            offset += casted * strides[i];
+            continue;
+        }
+        size_t start = std::min(slice_part(parts[0], 0, loc), shape[i]);
+        size_t stop = std::min(slice_part(parts[1], shape[i], loc), shape[i]);
+        // Views only step forwards through memory, so slices can't be reversed
+        const double* step_value = std::get_if<double>(&parts[2].value);
+        runtime_assert(!step_value || *step_value > 0, loc, "The step of an array slice must be positive, since slices can't be reversed");
+        size_t step = slice_part(parts[2], 1, loc);
+        parts += 3;
+        view_shape.push_back(start < stop ? (stop - start + step - 1) / step : 0);
+        view_strides.push_back(strides[i] * step);
+        if (start < stop) offset += start * strides[i];
+    }
+    return Variable(array.view(offset, std::move(view_shape), std::move(view_strides)));
+}
+
+void index_write(Variable& arr, const Variable* indices, size_t num_indices, const Variable& val, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Identifier isn't an array, so can't assign to an index of it");
+    NDArray& array = std::get<NDArray>(arr.value);
+    if (is_fancy_index(indices, num_indices)) return scatter(array, indices, num_indices, val, loc);
+    runtime_assert(val.is_double(), loc, "Can't assign a non-number to an entry in an array");
+    // Assigning to a mask sets every element it's set at
+    if (num_indices == 1 && indices[0].is_ndarray()) {
+        NDArray mask = index_mask(array, indices[0], loc);
+        alignas(8) unsigned char value[8];
+        runtime_assert(store_element(array.dtype(), std::get<double>(val.value), value), loc, "Can't assign a non-integer to an entry in an i64 array");
+        if (!array.is_contiguous()) array = array.contiguous();
+        typed_fill_masked(array.dtype(), value, (const uint8_t*) mask.raw_data(), mask.size(), array.mutable_raw_data());
+        return;
+    }
+    // Taking a private copy can change the strides, so it happens first
+    unsigned char* elements = (unsigned char*) array.mutable_raw_data();
+    size_t index = flat_index(array, indices, num_indices, loc);
+    bool stored = store_element(array.dtype(), std::get<double>(val.value), elements + index * dtype_size(array.dtype()));
+    runtime_assert(stored, loc, "Can't assign a non-integer to an entry in an i64 array");
+}
+
+// Prints an ndarray as the expression that builds it, without a newline
+static void print_array(std::ostream& out, const NDArray& view) {
+    NDArray array = view.contiguous();
+    const unsigned char* values = (const unsigned char*) array.raw_data();
+    const std::vector<size_t>& shape = array.shape();
+    // Arrays of other dtypes are printed as a call converting to them
+    bool converted = array.dtype() != DTYPE_F64;
+    if (converted) out << dtype_name(array.dtype()) << '(';
+    out << '[';
+    for (size_t i = 0; i < array.size(); i++) {
+        // Integers too big for a double are printed exactly
+        if (array.dtype() == DTYPE_I64) out << ((const int64_t*) values)[i];
+        else out << load_element(array.dtype(), values + i * dtype_size(array.dtype()));
+        if (i < array.size() - 1) out << ", ";
+    }
+    out << "] sa [";
+    for (size_t i = 0; i < shape.size(); i++) {
+        out << shape.at(i);
+        if (i < shape.size() - 1) out << ", ";
+    }
+    out << ']';
+    if (converted) out << ')';
+}
+
+void print_variable(std::ostream& out, const Variable& to_print) {
+    if (to_print.is_bool()) out << (std::get<bool>(to_print.value) ? "True" : "False") << std::endl;
+    else if (to_print.is_double()) out << std::get<double>(to_print.value) << std::endl;
+    else if (to_print.is_string()) out << std::get<std::string>(to_print.value) << std::endl;
+    else if (to_print.is_ndarray()) {
+        print_array(out, std::get<NDArray>(to_print.value));
+        out << std::endl;
+    }
+    else if (to_print.is_sparse()) {
+        // Sparse matrices are printed as the csr call building them from
+        // the coordinates of their entries
+        const SparseMatrix& matrix = std::get<SparseMatrix>(to_print.value);
+        std::vector<double> rows, cols;
+        for (size_t r = 0; r < matrix.rows(); r++) {
+            for (size_t k = matrix.row_starts()[r]; k < matrix.row_starts()[r + 1]; k++) {
+                rows.push_back(r);
+                cols.push_back(matrix.columns()[k]);
+            }
+        }
+        out << "csr(";
+        print_array(out, NDArray(rows, {matrix.nnz()}));
+        out << ", ";
+        print_array(out, NDArray(cols, {matrix.nnz()}));
+        out << ", ";
+        print_array(out, NDArray(matrix.values(), {matrix.nnz()}));
+        out << ", ";
+        print_array(out, NDArray({(double) matrix.rows(), (double) matrix.cols()}, {2}));
+        out << ')' << std::endl;
+    }
+    else out << "Nil" << std::endl;
+}
@@ -0,0 +1,179 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+
+#ifndef WEB_TARGET
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+static size_t requested_threads = 0;
+
+static size_t default_threads() {
+    if (const char* env = getenv("WEAK_NUM_THREADS")) {
+        char* end;
+        errno = 0;
+        unsigned long long parsed = strtoull(env, &end, 10);
+        if (*env && !*end && errno != ERANGE && parsed > 0) return parsed;
+    }
+#ifdef WEB_TARGET
+    return 1;
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+size_t num_threads() {
+    static const size_t default_count = default_threads();
+    return requested_threads ? requested_threads : default_count;
+}
+
+void set_num_threads(size_t threads) {
+    requested_threads = threads;
+}
+
+#ifdef WEB_TARGET
+// The web build has no threads
+void pool_for(size_t n, size_t, const std::function<void(size_t, size_t)>& body) {
+    if (n) body(0, n);
+}
+#else
+// Whether this thread is running part of a loop, so loops it starts can't
+// wait on the pool it's part of
+static thread_local bool inside_loop = false;
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads) : shares(new Share[threads]) {
+        for (size_t i = 1; i < threads; i++) workers.emplace_back(&ThreadPool::worker, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : workers) thread.join();
+    }
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    void run(size_t n, size_t grain, const std::function<void(size_t, size_t)>& body) {
+        size_t chunks = (n + grain - 1) / grain;
+        size_t participants = std::min(size(), chunks);
+        for (size_t p = 0; p < participants; p++) {
+            shares[p].next = p * chunks / participants;
+            shares[p].end = (p + 1) * chunks / participants;
+        }
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            loop_body = &body;
+            loop_size = n;
+            loop_grain = grain;
+            loop_participants = participants;
+            unfinished = participants - 1;
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> guard (lock);
+        finished.wait(guard, [this]() { return unfinished == 0; });
+    }
+
+private:
+    // The chunks of the current loop a thread has yet to start, [next, end)
+    struct Share {
+        std::mutex lock;
+        size_t next = 0;
+        size_t end = 0;
+    };
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Share[]> shares;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool stopping = false;
+    // Bumped for each loop, so workers can tell a new loop has started
+    size_t generation = 0;
+    const std::function<void(size_t, size_t)>* loop_body = nullptr;
+    size_t loop_size = 0;
+    size_t loop_grain = 0;
+    size_t loop_participants = 0;
+    // Workers taking part in the current loop that haven't finished
+    size_t unfinished = 0;
+
+    // Takes a chunk from the front of a share, or from the back if stealing
+    static bool take(Share& share, bool steal, size_t& chunk) {
+        std::lock_guard<std::mutex> guard (share.lock);
+        if (share.next == share.end) return false;
+        chunk = steal ? --share.end : share.next++;
+        return true;
+    }
+
+    void work(size_t participant) {
+        inside_loop = true;
+        size_t chunk;
+        for (size_t i = 0; i < loop_participants; i++) {
+            size_t victim = (participant + i) % loop_participants;
+            while (take(shares[victim], i > 0, chunk)) {
+                size_t begin = chunk * loop_grain;
+                (*loop_body)(begin, std::min(loop_size, begin + loop_grain));
+            }
+        }
+        inside_loop = false;
+    }
+
+    void worker(size_t participant) {
+        size_t seen = 0;
+        std::unique_lock<std::mutex> guard (lock);
+        while (true) {
+            wake.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (participant >= loop_participants) continue;
+            guard.unlock();
+            work(participant);
+            guard.lock();
+            if (--unfinished == 0) finished.notify_one();
+        }
+    }
+};
+
+void pool_for(size_t n, size_t grain, const std::function<void(size_t, size_t)>& body) {
+    if (n == 0) return;
+    grain = std::max<size_t>(grain, 1);
+    size_t threads = num_threads();
+    if (n <= grain || threads == 1 || inside_loop) return body(0, n);
+    // Loops started by different threads take turns with the pool
+    static std::mutex pool_lock;
+    static std::unique_ptr<ThreadPool> pool;
+    std::lock_guard<std::mutex> guard (pool_lock);
+    if (!pool || pool->size() != threads) {
+        pool.reset();
+        pool = std::make_unique<ThreadPool>(threads);
+    }
+    pool->run(n, grain, body);
+}
+#endif
@@ -226,18 +226,23 @@ Expr* Parser::assignment() {
         Expr* right = assignment();
         return new Assign(id, right);
     } else if (tokens.at(cur_index).type == IDENTIFIER && cur_index < tokens.size() - 1 && tokens.at(cur_index + 1).type == LEFT_BRACK) {
-        size_t dummy_index = cur_index;
-        while (dummy_index < tokens.size() && tokens.at(dummy_index).type != RIGHT_BRACK) dummy_index++;
+        // Finds the bracket closing the indices, which can contain brackets
+        // of their own (e.g. an array of indices)
+        size_t dummy_index = cur_index + 1;
+        for (size_t depth = 0; dummy_index < tokens.size(); dummy_index++) {
+            if (tokens.at(dummy_index).type == LEFT_BRACK) depth++;
+            else if (tokens.at(dummy_index).type == RIGHT_BRACK && --depth == 0) break;
+        }
         if (dummy_index >= tokens.size() || (dummy_index < tokens.size() - 1 && tokens.at(dummy_index + 1).type != EQUALS)) return operation();
         Token id = consume(IDENTIFIER, "Expected identifier");
         Token left_b = consume(LEFT_BRACK, "Unreachable");
-        Expr* first_dim = expression();
+        Expr* first_dim = index();
         std::vector<Expr*> args;
         args.push_back(first_dim);
         while(cur_index < tokens.size() && tokens.at(cur_index).type != RIGHT_BRACK) {
             if (args.size() < MAX_ARGS) {
                 consume(COMMA, "Expected comma in array indexing");
-                Expr* arg = expression();
+                Expr* arg = index();
                 args.push_back(arg);
             }
             else {
@@ -245,6 +250,9 @@ Expr* Parser::assignment() {
             }
         }
         consume(RIGHT_BRACK, "Expected ']' after indices");
+        for (Expr* arg : args) {
+            if (Slice* slice = dynamic_cast<Slice*>(arg)) throw std::runtime_error(create_error(slice->colon, "Can't assign to a slice of an array"));
+        }
         consume(EQUALS, "Expected '=' after identifier");
         Expr* right = assignment();
         return new Assign(id, args, right);
@@ -343,13 +351,13 @@ Expr* Parser::arrAccess() {
     Expr* id = function();
     if(match(LEFT_BRACK)) {
         Token left_b = tokens.at(cur_index - 1);
-        Expr* first_dim = expression();
+        Expr* first_dim = index();
         std::vector<Expr*> args;
         args.push_back(first_dim);
         while(cur_index < tokens.size() && tokens.at(cur_index).type != RIGHT_BRACK) {
             if (args.size() < MAX_ARGS) {
                 consume(COMMA, "Expected comma in array indexing");
-                Expr* arg = expression();
+                Expr* arg = index();
                 args.push_back(arg);
             }
             else {
@@ -362,6 +370,18 @@ Expr* Parser::arrAccess() {
     return id;
 }
 
+// An index in an array access, either an expression or a slice like 1:5,
+// :, ::2 or 3:
+Expr* Parser::index() {
+    Expr* start = currently_at(COLON) ? nullptr : expression();
+    if (!match(COLON)) return start;
+    Token colon = tokens.at(cur_index - 1);
+    Expr* stop = currently_at({COLON, COMMA, RIGHT_BRACK}) ? nullptr : expression();
+    Expr* step = nullptr;
+    if (match(COLON) && !currently_at({COMMA, RIGHT_BRACK})) step = expression();
+    return new Slice(start, colon, stop, step);
+}
+
 Expr* Parser::function() {
     if(tokens.at(cur_index).type == IDENTIFIER && cur_index < tokens.size() - 1 && tokens.at(cur_index+1).type == LEFT_PAREN) {
         Token name = consume(IDENTIFIER, "");
@@ -0,0 +1,285 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "random.hpp"
+#include "operations.hpp"
+#include "indexing.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#ifdef WEAK_X86_KERNELS
+    #include <immintrin.h>
+#endif
+
+static const uint64_t PHILOX_M0 = 0xD2511F53, PHILOX_M1 = 0xCD9E8D57;
+static const uint64_t PHILOX_W0 = 0x9E3779B9, PHILOX_W1 = 0xBB67AE85;
+static const uint64_t LOW_WORD = 0xFFFFFFFF;
+
+//////////////////////////////////////////////////////////////////////////////
+// The Philox rounds are written once as a macro and stamped out for each   //
+// instruction set, like the kernels in kernels.cpp. A vector holds one     //
+// block per 64-bit lane, with each of the block's four 32-bit words in the //
+// low half of a lane of its own vector, so a round's 32x32 bit products    //
+// are single unsigned multiplies of the lanes. Rounds only use integer     //
+// arithmetic, so every instruction set gives the same words.               //
+//////////////////////////////////////////////////////////////////////////////
+
+#define PHILOX_KERNEL(ATTR, NAME, V, W, LOAD, STORE, SET1, ADD, MUL, AND, OR, XOR, HIGH, SHIFT_UP) \
+    ATTR static void NAME(uint64_t seed, uint64_t stream, uint64_t first, size_t blocks, uint64_t* out) { \
+        uint64_t lane_numbers[W]; \
+        for (size_t l = 0; l < W; l++) lane_numbers[l] = l; \
+        const V lanes = LOAD(lane_numbers), low = SET1(LOW_WORD); \
+        const V m0 = SET1(PHILOX_M0), m1 = SET1(PHILOX_M1); \
+        for (size_t done = 0; done < blocks; done += W) { \
+            V block = ADD(SET1(first + done), lanes); \
+            V c0 = AND(block, low), c1 = HIGH(block); \
+            V c2 = SET1(stream & LOW_WORD), c3 = SET1(stream >> 32); \
+            uint64_t k0 = seed & LOW_WORD, k1 = seed >> 32; \
+            for (int round = 0; round < 10; round++) { \
+                V p0 = MUL(c0, m0), p1 = MUL(c2, m1); \
+                c0 = XOR(XOR(HIGH(p1), c1), SET1(k0)); \
+                c1 = AND(p1, low); \
+                c2 = XOR(XOR(HIGH(p0), c3), SET1(k1)); \
+                c3 = AND(p0, low); \
+                k0 = (k0 + PHILOX_W0) & LOW_WORD; \
+                k1 = (k1 + PHILOX_W1) & LOW_WORD; \
+            } \
+            uint64_t first_words[W], second_words[W]; \
+            STORE(first_words, OR(c0, SHIFT_UP(c1))); \
+            STORE(second_words, OR(c2, SHIFT_UP(c3))); \
+            size_t count = std::min((size_t) W, blocks - done); \
+            for (size_t l = 0; l < count; l++) { \
+                out[2 * (done + l)] = first_words[l]; \
+                out[2 * (done + l) + 1] = second_words[l]; \
+            } \
+        } \
+    }
+
+#define SCALAR_LOAD(p) (*(p))
+#define SCALAR_STORE(p, v) (*(p) = (v))
+#define SCALAR_SET1(x) ((uint64_t) (x))
+#define SCALAR_ADD(a, b) ((a) + (b))
+#define SCALAR_MUL(a, b) (((a) & LOW_WORD) * ((b) & LOW_WORD))
+#define SCALAR_AND(a, b) ((a) & (b))
+#define SCALAR_OR(a, b) ((a) | (b))
+#define SCALAR_XOR(a, b) ((a) ^ (b))
+#define SCALAR_HIGH(a) ((a) >> 32)
+#define SCALAR_SHIFT_UP(a) ((a) << 32)
+PHILOX_KERNEL(, philox_scalar, uint64_t, 1, SCALAR_LOAD, SCALAR_STORE, SCALAR_SET1, SCALAR_ADD, SCALAR_MUL, SCALAR_AND, SCALAR_OR, SCALAR_XOR, SCALAR_HIGH, SCALAR_SHIFT_UP)
+
+#ifdef WEAK_X86_KERNELS
+    #define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i*) (p))
+    #define AVX2_STORE(p, v) _mm256_storeu_si256((__m256i*) (p), v)
+    #define AVX2_SET1(x) _mm256_set1_epi64x((long long) (x))
+    #define AVX2_HIGH(a) _mm256_srli_epi64(a, 32)
+    #define AVX2_SHIFT_UP(a) _mm256_slli_epi64(a, 32)
+    PHILOX_KERNEL(__attribute__((target("avx2"))), philox_avx2, __m256i, 4, AVX2_LOAD, AVX2_STORE, AVX2_SET1, _mm256_add_epi64, _mm256_mul_epu32, _mm256_and_si256, _mm256_or_si256, _mm256_xor_si256, AVX2_HIGH, AVX2_SHIFT_UP)
+
+    #define AVX512_LOAD(p) _mm512_loadu_si512((const void*) (p))
+    #define AVX512_STORE(p, v) _mm512_storeu_si512((void*) (p), v)
+    #define AVX512_SET1(x) _mm512_set1_epi64((long long) (x))
+    #define AVX512_HIGH(a) _mm512_srli_epi64(a, 32)
+    #define AVX512_SHIFT_UP(a) _mm512_slli_epi64(a, 32)
+    PHILOX_KERNEL(__attribute__((target("avx512f"))), philox_avx512, __m512i, 8, AVX512_LOAD, AVX512_STORE, AVX512_SET1, _mm512_add_epi64, _mm512_mul_epu32, _mm512_and_si512, _mm512_or_si512, _mm512_xor_si512, AVX512_HIGH, AVX512_SHIFT_UP)
+#endif
+
+typedef void (*PhiloxKernel)(uint64_t seed, uint64_t stream, uint64_t first, size_t blocks, uint64_t* out);
+
+static PhiloxKernel philox_kernel() {
+#ifdef WEAK_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return philox_avx512;
+    if (__builtin_cpu_supports("avx2")) return philox_avx2;
+#endif
+    return philox_scalar;
+}
+
+void philox(uint64_t seed, uint64_t stream, uint64_t first, size_t blocks, uint64_t* out) {
+    static const PhiloxKernel chosen = philox_kernel();
+    chosen(seed, stream, first, blocks, out);
+}
+
+// The seed and the number of streams drawn from since it was set
+struct RandomState {
+    uint64_t seed;
+    uint64_t streams;
+};
+
+static RandomState& random_state() {
+    static RandomState state {std::random_device()() | (uint64_t) std::random_device()() << 32, 0};
+    return state;
+}
+
+// Blocks are generated this many at a time into a buffer on the stack, so
+// the words stay in L1 cache until they're turned into elements
+static const size_t WORD_BATCH = 256;
+
+/**
+ * Draws blocks 0 to blocks - 1 of a new stream across the thread pool,
+ * calling use(first, words, count) with each batch of count blocks starting
+ * at block first, their words in order.
+ */
+template <typename F>
+static void random_words(size_t blocks, const F& use) {
+    RandomState& state = random_state();
+    uint64_t seed = state.seed, stream = state.streams++;
+    parallel_for(blocks, PARALLEL_GRAIN / 2, [&](size_t begin, size_t end) {
+        uint64_t words[2 * WORD_BATCH];
+        for (size_t first = begin; first < end; first += WORD_BATCH) {
+            size_t count = std::min(WORD_BATCH, end - first);
+            philox(seed, stream, first, count, words);
+            use(first, words, count);
+        }
+    });
+}
+
+// A word as a double in [0, 1), from its top 53 bits
+static inline double unit_interval(uint64_t word) {
+    return (double) (word >> 11) * 0x1.0p-53;
+}
+
+// A word as an integer uniform in [0, range), from the high half of their
+// product. Ranges that aren't powers of two are biased by less than
+// range / 2^64, far below what any sample could show.
+static inline uint64_t below(uint64_t word, uint64_t range) {
+    return (uint64_t) (((unsigned __int128) word * range) >> 64);
+}
+
+// The shape argument of a random builtin
+static std::vector<size_t> random_shape(const Variable& shape, const Token& loc) {
+    if (const double* size = std::get_if<double>(&shape.value)) {
+        size_t casted = (size_t) *size;
+        runtime_assert((double) casted == *size, loc, "An expression used in array size is not close to an integer");
+        return {casted};
+    }
+    runtime_assert(shape.is_ndarray(), loc, "The shape of a random array must be a number or an ndarray of sizes");
+    NDArray sizes = std::get<NDArray>(shape.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(sizes.shape().size() == 1, loc, "The shape of a random array must be a number or an ndarray of sizes");
+    std::vector<size_t> dims;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_t casted = (size_t) sizes.data()[i];
+        runtime_assert((double) casted == sizes.data()[i], loc, "An expression used in array size is not close to an integer");
+        dims.push_back(casted);
+    }
+    return dims;
+}
+
+Variable seed_random(const Variable& seed, const Token& loc) {
+    const double* value = std::get_if<double>(&seed.value);
+    runtime_assert(value, loc, "A seed must be a number");
+    uint64_t casted = (uint64_t) *value;
+    runtime_assert(*value >= 0 && (double) casted == *value, loc, "A seed must be a non-negative integer");
+    random_state() = RandomState {casted, 0};
+    return Variable();
+}
+
+// Element i is made from word i, and a stream has two words per block
+Variable random_uniform(const Variable& shape, const Token& loc) {
+    NDArray result = NDArray::uninitialized(random_shape(shape, loc));
+    double* out = result.mutable_data();
+    size_t n = result.size();
+    random_words((n + 1) / 2, [&](size_t first, const uint64_t* words, size_t count) {
+        size_t end = std::min(2 * (first + count), n);
+        for (size_t i = 2 * first; i < end; i++) out[i] = unit_interval(words[i - 2 * first]);
+    });
+    return Variable(std::move(result));
+}
+
+/**
+ * Uses the Box-Muller transform, which turns the two words of a block into
+ * the pair of normal elements 2i and 2i + 1. The radius's uniform is taken
+ * from (0, 1] so its log is finite.
+ */
+Variable random_normal(const Variable& shape, const Token& loc) {
+    NDArray result = NDArray::uninitialized(random_shape(shape, loc));
+    double* out = result.mutable_data();
+    size_t n = result.size();
+    random_words((n + 1) / 2, [&](size_t first, const uint64_t* words, size_t count) {
+        for (size_t b = 0; b < count; b++) {
+            size_t i = 2 * (first + b);
+            double radius = sqrt(-2. * log(1. - unit_interval(words[2 * b])));
+            double angle = 2. * M_PI * unit_interval(words[2 * b + 1]);
+            out[i] = radius * cos(angle);
+            if (i + 1 < n) out[i + 1] = radius * sin(angle);
+        }
+    });
+    return Variable(std::move(result));
+}
+
+Variable random_integers(const Variable& low_var, const Variable& high_var, const Variable& shape, const Token& loc) {
+    const double* low = std::get_if<double>(&low_var.value);
+    const double* high = std::get_if<double>(&high_var.value);
+    runtime_assert(low && high, loc, "The bounds of random integers must be numbers");
+    int64_t lowest = (int64_t) *low, highest = (int64_t) *high;
+    runtime_assert((double) lowest == *low && (double) highest == *high, loc, "The bounds of random integers must be integers");
+    runtime_assert(lowest < highest, loc, "The lower bound of random integers must be below the upper bound");
+    uint64_t range = (uint64_t) highest - (uint64_t) lowest;
+    NDArray result = NDArray::uninitialized(random_shape(shape, loc), DTYPE_I64);
+    int64_t* out = (int64_t*) result.mutable_raw_data();
+    size_t n = result.size();
+    random_words((n + 1) / 2, [&](size_t first, const uint64_t* words, size_t count) {
+        size_t end = std::min(2 * (first + count), n);
+        for (size_t i = 2 * first; i < end; i++) out[i] = (int64_t) ((uint64_t) lowest + below(words[i - 2 * first], range));
+    });
+    return Variable(std::move(result));
+}
+
+// The average number of entries per bucket in a shuffle, few enough that a
+// bucket's part of the permutation stays in L2 cache while it's shuffled
+static const size_t SHUFFLE_BUCKET = 8192;
+
+/**
+ * Shuffles with the Rao-Sandelius method, since a Fisher-Yates shuffle of a
+ * long array misses the cache on nearly every swap. Each entry goes to a
+ * random bucket, keeping the order of entries within a bucket, and then the
+ * buckets are shuffled with Fisher-Yates in parallel. Every permutation
+ * comes out with the same probability. The entries of arr are then
+ * gathered in that order.
+ */
+Variable shuffle(const Variable& arr, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    const NDArray& array = std::get<NDArray>(arr.value);
+    runtime_assert(array.shape().size() > 0, loc, "Can't shuffle an ndarray with no dimensions");
+    size_t n = array.shape()[0];
+    size_t buckets = std::max<size_t>(n / SHUFFLE_BUCKET, 1);
+    // A word per entry, drawn from a new stream each time. The words live in
+    // an ndarray's buffer so they come from the pool.
+    NDArray words_array = NDArray::uninitialized({n + 1}, DTYPE_I64);
+    uint64_t* draws = (uint64_t*) words_array.mutable_raw_data();
+    auto draw = [&]() {
+        random_words((n + 1) / 2, [&](size_t first, const uint64_t* words, size_t count) {
+            std::copy(words, words + 2 * count, draws + 2 * first);
+        });
+    };
+    draw();
+    std::vector<size_t> starts (buckets + 1, 0);
+    for (size_t i = 0; i < n; i++) starts[below(draws[i], buckets) + 1]++;
+    for (size_t b = 0; b < buckets; b++) starts[b + 1] += starts[b];
+    NDArray order = NDArray::uninitialized({n}, DTYPE_I64);
+    int64_t* permutation = (int64_t*) order.mutable_raw_data();
+    std::vector<size_t> ends (starts.begin(), starts.end() - 1);
+    for (size_t i = 0; i < n; i++) permutation[ends[below(draws[i], buckets)]++] = (int64_t) i;
+    draw();
+    parallel_for(buckets, std::max<size_t>(PARALLEL_GRAIN / SHUFFLE_BUCKET, 1), [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+            int64_t* bucket = permutation + starts[b];
+            const uint64_t* words = draws + starts[b];
+            for (size_t j = starts[b + 1] - starts[b]; j-- > 1;) std::swap(bucket[j], bucket[below(words[j], j + 1)]);
+        }
+    });
+    Variable index (std::move(order));
+    return gather(array, &index, 1, loc);
+}
@@ -0,0 +1,214 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "reductions.hpp"
+#include "parallel.hpp"
+
+#include <atomic>
+
+// The value a reduction starts from, which leaves the first element as is
+static double identity(Reduction op) {
+    switch (op) {
+    case REDUCE_PRODUCT: return 1.;
+    case REDUCE_MIN:
+    case REDUCE_ARGMIN: return INFINITY;
+    case REDUCE_MAX:
+    case REDUCE_ARGMAX: return -INFINITY;
+    default: return 0.;
+    }
+}
+
+static KernelOp kernel_op(Reduction op) {
+    switch (op) {
+    case REDUCE_PRODUCT: return KERNEL_MULTIPLY;
+    case REDUCE_MIN: return KERNEL_MIN;
+    case REDUCE_MAX: return KERNEL_MAX;
+    default: return KERNEL_ADD;
+    }
+}
+
+// The index of the first smallest (or largest) of n elements, or 0 if none
+// is smaller (larger) than the identity
+static size_t arg_run(Reduction op, const double* in, size_t n) {
+    double best = identity(op);
+    size_t best_index = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (op == REDUCE_ARGMIN ? in[i] < best : in[i] > best) {
+            best = in[i];
+            best_index = i;
+        }
+    }
+    return best_index;
+}
+
+// Reduces a contiguous run of n elements
+static double reduce_run(Reduction op, const double* in, size_t n) {
+    switch (op) {
+    case REDUCE_MEAN: return kernel_reduce(KERNEL_ADD, in, n) / n;
+    case REDUCE_NORM: return sqrt(kernel_dot(in, in, n));
+    case REDUCE_ARGMIN:
+    case REDUCE_ARGMAX: {
+        // Each chunk finds its own best element, and the first of the best
+        // of those is the best overall
+        std::vector<size_t> chunk_best ((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+        parallel_for(chunk_best.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++) {
+                size_t start = c * PARALLEL_GRAIN;
+                chunk_best[c] = start + arg_run(op, in + start, std::min(PARALLEL_GRAIN, n - start));
+            }
+        });
+        double best = identity(op);
+        size_t best_index = 0;
+        for (size_t index : chunk_best) {
+            if (op == REDUCE_ARGMIN ? in[index] < best : in[index] > best) {
+                best = in[index];
+                best_index = index;
+            }
+        }
+        return (double) best_index;
+    }
+    default: return kernel_reduce(kernel_op(op), in, n);
+    }
+}
+
+/**
+ * Reduces n rows of inner elements each into out, one element per column,
+ * with row j starting at in + j * stride. Rows are folded into out with the
+ * elementwise kernels, so every pass runs over contiguous memory.
+ */
+static void reduce_rows(Reduction op, const double* in, size_t n, size_t stride, size_t inner, double* out) {
+    if (op == REDUCE_ARGMIN || op == REDUCE_ARGMAX) {
+        std::vector<double> best (inner, identity(op));
+        std::fill(out, out + inner, 0.);
+        for (size_t j = 0; j < n; j++) {
+            const double* row = in + j * stride;
+            for (size_t i = 0; i < inner; i++) {
+                if (op == REDUCE_ARGMIN ? row[i] < best[i] : row[i] > best[i]) {
+                    best[i] = row[i];
+                    out[i] = (double) j;
+                }
+            }
+        }
+        return;
+    }
+    std::fill(out, out + inner, identity(op));
+    std::vector<double> squares (op == REDUCE_NORM ? inner : 0);
+    for (size_t j = 0; j < n; j++) {
+        const double* row = in + j * stride;
+        if (op == REDUCE_NORM) {
+            kernel_binary(KERNEL_MULTIPLY, ARRAY_ARRAY, row, row, squares.data(), inner);
+            row = squares.data();
+        }
+        // Each row is the left operand, so min and max skip NaNs as the reduction kernels do
+        kernel_binary(kernel_op(op), ARRAY_ARRAY, row, out, out, inner);
+    }
+    if (op == REDUCE_MEAN) {
+        double count = (double) n;
+        kernel_binary(KERNEL_DIVIDE, ARRAY_SCALAR, out, &count, out, inner);
+    }
+    if (op == REDUCE_NORM) {
+        for (size_t i = 0; i < inner; i++) out[i] = sqrt(out[i]);
+    }
+}
+
+Variable reduce(Reduction op, const Variable& arr, const Variable* axis, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    NDArray array = std::get<NDArray>(arr.value).as_dtype(DTYPE_F64).contiguous();
+    const std::vector<size_t>& shape = array.shape();
+    // The array is treated as outer blocks of length rows of inner elements,
+    // with the rows being reduced
+    size_t outer = 1, length = array.size(), inner = 1;
+    std::vector<size_t> result_shape;
+    if (axis) {
+        const double* axis_double = std::get_if<double>(&axis->value);
+        runtime_assert(axis_double, loc, "Axis of a reduction is not a number");
+        size_t casted = (size_t) *axis_double;
+        runtime_assert((double) casted == *axis_double && casted < shape.size(), loc, "Axis of a reduction is not a dimension of the ndarray");
+        for (size_t d = 0; d < shape.size(); d++) {
+            if (d < casted) outer *= shape[d];
+            if (d > casted) inner *= shape[d];
+            if (d != casted) result_shape.push_back(shape[d]);
+        }
+        length = shape[casted];
+    }
+    if (op == REDUCE_MIN || op == REDUCE_MAX || op == REDUCE_ARGMIN || op == REDUCE_ARGMAX) {
+        runtime_assert(length > 0, loc, "Can't reduce an empty ndarray");
+    }
+
+    NDArray result = NDArray::uninitialized(result_shape);
+    double* out = result.mutable_data();
+    const double* in = array.data();
+    // Threads take separate ranges of the results, each needing about
+    // length elements to be read
+    size_t grain = std::max<size_t>(PARALLEL_GRAIN / std::max<size_t>(length, 1), 1);
+    if (inner == 1) {
+        parallel_for(outer, grain, [&](size_t begin, size_t end) {
+            for (size_t o = begin; o < end; o++) out[o] = reduce_run(op, in + o * length, length);
+        });
+    }
+    else {
+        for (size_t o = 0; o < outer; o++) {
+            parallel_for(inner, grain, [&](size_t begin, size_t end) {
+                reduce_rows(op, in + o * length * inner + begin, length, inner, end - begin, out + o * inner + begin);
+            });
+        }
+    }
+    if (result_shape.size() == 0) return Variable(out[0]);
+    return Variable(std::move(result));
+}
+
+Variable count_nonzero(const Variable& arr, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    NDArray mask = std::get<NDArray>(arr.value).as_dtype(DTYPE_BOOL).contiguous();
+    return Variable((double) count_set((const uint8_t*) mask.raw_data(), mask.size()));
+}
+
+// Masks are counted a byte at a time rather than converted to f64 first
+static size_t count_mask(const NDArray& mask) {
+    NDArray flat = mask.contiguous();
+    return count_set((const uint8_t*) flat.raw_data(), flat.size());
+}
+
+Variable any_of(const Variable& arr, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    const NDArray& mask = std::get<NDArray>(arr.value);
+    if (mask.dtype() == DTYPE_BOOL) return Variable(count_mask(mask) > 0);
+    NDArray array = std::get<NDArray>(arr.value).as_dtype(DTYPE_F64).contiguous();
+    const double* in = array.data();
+    std::atomic<bool> found (false);
+    parallel_for(array.size(), PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        if (!found && std::any_of(in + begin, in + end, [](double x) { return x != 0.; })) found = true;
+    });
+    return Variable((bool) found);
+}
+
+Variable all_of(const Variable& arr, const Token& loc) {
+    runtime_assert(arr.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    const NDArray& mask = std::get<NDArray>(arr.value);
+    if (mask.dtype() == DTYPE_BOOL) return Variable(count_mask(mask) == mask.size());
+    NDArray array = std::get<NDArray>(arr.value).as_dtype(DTYPE_F64).contiguous();
+    const double* in = array.data();
+    std::atomic<bool> found (false);
+    parallel_for(array.size(), PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        if (!found && std::any_of(in + begin, in + end, [](double x) { return x == 0.; })) found = true;
+    });
+    return Variable(!found);
+}
+
+Variable dot(const Variable& left_var, const Variable& right_var, const Token& loc) {
+    runtime_assert(left_var.is_ndarray(), loc, "Left expression isn't an ndarray");
+    runtime_assert(right_var.is_ndarray(), loc, "Right expression isn't an ndarray");
+    NDArray left = std::get<NDArray>(left_var.value).as_dtype(DTYPE_F64).contiguous();
+    NDArray right = std::get<NDArray>(right_var.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(left.shape() == right.shape(), loc, "Expressions evaluate to arrays of differing sizes");
+    return Variable(kernel_dot(left.data(), right.data(), left.size()));
+}
@@ -0,0 +1,199 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "resolver.hpp"
+
+Resolver::Resolver(std::unordered_map<std::string, size_t>& globals): globals(globals), num_globals(globals.size()), scope(&globals), scope_slots(&num_globals) {}
+
+void Resolver::resolve(const std::vector<Stmt*>& stmts) {
+    for (Stmt* stmt : stmts) resolve(stmt);
+}
+
+/**
+ * Returns the slot of a variable in the scope currently being resolved,
+ * giving it the next free slot if it hasn't been seen before.
+ */
+size_t Resolver::slot(const std::string& name) {
+    auto found = scope->find(name);
+    if (found != scope->end()) return found->second;
+    scope->insert(std::pair<std::string, size_t>(name, *scope_slots));
+    return (*scope_slots)++;
+}
+
+size_t Resolver::num_slots() {
+    return num_globals;
+}
+
+void Resolver::resolve(Stmt* stmt) {
+    if (CAN_MAKE(ExprStmt*, exprStmt)_FROM(stmt)) {
+        resolve_expr(exprStmt->expr);
+    }
+    else if (CAN_MAKE(FuncDecl*, funcDecl)_FROM(stmt)) {
+        std::vector<const Token*> params;
+        for (const Token& param : funcDecl->params) params.push_back(&param);
+        funcDecl->num_slots = resolve_function(params, funcDecl->stmts);
+    }
+    else if (CAN_MAKE(If*, ifStmt)_FROM(stmt)) {
+        resolve_expr(ifStmt->cond);
+        resolve_block(ifStmt->stmts);
+    }
+    else if (CAN_MAKE(OpDecl*, opDecl)_FROM(stmt)) {
+        opDecl->num_slots = resolve_function({&opDecl->left, &opDecl->right}, opDecl->stmts);
+    }
+    else if (CAN_MAKE(Print*, print)_FROM(stmt)) {
+        resolve_expr(print->expr);
+    }
+    else if (CAN_MAKE(Return*, returnStmt)_FROM(stmt)) {
+        resolve_expr(returnStmt->expr);
+    }
+    else if (CAN_MAKE(VarDecl*, varDecl)_FROM(stmt)) {
+        resolve_expr(varDecl->expr);
+        varDecl->slot = slot(varDecl->name.lexeme);
+    }
+    else if (CAN_MAKE(While*, whileStmt)_FROM(stmt)) {
+        resolve_expr(whileStmt->cond);
+        resolve_block(whileStmt->stmts);
+    }
+    else if (CAN_MAKE(Assert*, assertStmt)_FROM(stmt)) {
+        resolve_expr(assertStmt->cond);
+    }
+}
+
+void Resolver::resolve_block(const std::vector<Stmt*>& stmts) {
+    for (Stmt* stmt : stmts) resolve(stmt);
+}
+
+void Resolver::resolve_expr(Expr* expr) {
+    if (CAN_MAKE(ArrAccess*, arrAccess)_FROM(expr)) {
+        resolve_expr(arrAccess->id);
+        for (Expr* index : arrAccess->idx) resolve_expr(index);
+    }
+    else if (CAN_MAKE(Assign*, assign)_FROM(expr)) {
+        assign->slot = slot(assign->name.lexeme);
+        resolve_expr(assign->value);
+        for (Expr* index : assign->idx) resolve_expr(index);
+        if (assign->idx.size() == 0) mark_last_use(assign->value, assign->slot);
+    }
+    else if (CAN_MAKE(Binary*, binary)_FROM(expr)) {
+        resolve_expr(binary->left);
+        resolve_expr(binary->right);
+    }
+    else if (CAN_MAKE(Func*, func)_FROM(expr)) {
+        for (Expr* arg : func->args) resolve_expr(arg);
+    }
+    else if (CAN_MAKE(Literal*, literal)_FROM(expr)) {
+        for (Expr* element : literal->array_vals) resolve_expr(element);
+    }
+    else if (CAN_MAKE(Slice*, slice)_FROM(expr)) {
+        for (Expr* part : {slice->start, slice->stop, slice->step}) {
+            if (part) resolve_expr(part);
+        }
+    }
+    else if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        resolve_expr(unary->right);
+    }
+    else if (CAN_MAKE(Var*, var)_FROM(expr)) {
+        var->slot = slot(var->name.lexeme);
+    }
+}
+
+// Collects the operands of an elementwise expression in evaluation order
+static void elementwise_operands(Expr* expr, std::vector<Expr*>& operands) {
+    if (!is_elementwise(expr)) {
+        operands.push_back(expr);
+    }
+    else if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        elementwise_operands(unary->right, operands);
+    }
+    else {
+        Binary* binary = static_cast<Binary*>(expr);
+        elementwise_operands(binary->left, operands);
+        elementwise_operands(binary->right, operands);
+    }
+}
+
+// Whether expr reads or assigns the variable in the given slot
+static bool uses_slot(Expr* expr, size_t slot) {
+    if (CAN_MAKE(ArrAccess*, arrAccess)_FROM(expr)) {
+        if (uses_slot(arrAccess->id, slot)) return true;
+        for (Expr* index : arrAccess->idx) if (uses_slot(index, slot)) return true;
+    }
+    else if (CAN_MAKE(Assign*, assign)_FROM(expr)) {
+        if (assign->slot == slot || uses_slot(assign->value, slot)) return true;
+        for (Expr* index : assign->idx) if (uses_slot(index, slot)) return true;
+    }
+    else if (CAN_MAKE(Binary*, binary)_FROM(expr)) {
+        return uses_slot(binary->left, slot) || uses_slot(binary->right, slot);
+    }
+    else if (CAN_MAKE(Func*, func)_FROM(expr)) {
+        for (Expr* arg : func->args) if (uses_slot(arg, slot)) return true;
+    }
+    else if (CAN_MAKE(Literal*, literal)_FROM(expr)) {
+        for (Expr* element : literal->array_vals) if (uses_slot(element, slot)) return true;
+    }
+    else if (CAN_MAKE(Slice*, slice)_FROM(expr)) {
+        for (Expr* part : {slice->start, slice->stop, slice->step}) {
+            if (part && uses_slot(part, slot)) return true;
+        }
+    }
+    else if (CAN_MAKE(Unary*, unary)_FROM(expr)) {
+        return uses_slot(unary->right, slot);
+    }
+    else if (CAN_MAKE(Var*, var)_FROM(expr)) {
+        return var->slot == slot;
+    }
+    return false;
+}
+
+/**
+ * For an assignment of an elementwise expression to the variable in slot,
+ * marks the operand that reads the variable for the last time. Nothing
+ * evaluated after it uses the variable before the assignment overwrites it,
+ * so the engines can move the value out instead of sharing it, which lets
+ * the operator reuse its buffer for the result.
+ */
+void Resolver::mark_last_use(Expr* value, size_t slot) {
+    if (!is_elementwise(value)) return;
+    std::vector<Expr*> operands;
+    elementwise_operands(value, operands);
+    for (size_t i = operands.size(); i-- > 0;) {
+        if (CAN_MAKE(Var*, var)_FROM(operands[i])) {
+            if (var->slot == slot) {
+                var->last_use = true;
+                return;
+            }
+        }
+        else if (uses_slot(operands[i], slot)) {
+            return;
+        }
+    }
+}
+
+/**
+ * Resolves a function or operator body in a fresh scope, returning the number
+ * of slots it needs. Parameter i always lives in slot i.
+ */
+size_t Resolver::resolve_function(std::vector<const Token*> params, const std::vector<Stmt*>& stmts) {
+    std::unordered_map<std::string, size_t>* enclosing = scope;
+    size_t* enclosing_slots = scope_slots;
+    std::unordered_map<std::string, size_t> locals;
+    size_t num_locals = params.size();
+    scope = &locals;
+    scope_slots = &num_locals;
+    for (size_t i = 0; i < params.size(); i++) {
+        locals.insert(std::pair<std::string, size_t>(params.at(i)->lexeme, i));
+    }
+    resolve_block(stmts);
+    scope = enclosing;
+    scope_slots = enclosing_slots;
+    return num_locals;
+}
@@ -0,0 +1,237 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "sparse.hpp"
+#include "operations.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+
+// The elements of array, each checked to be an integer below bound
+static std::vector<size_t> indices_of(const NDArray& array, size_t bound, const Token& loc) {
+    NDArray in = array.as_dtype(DTYPE_F64).contiguous();
+    const double* values = in.data();
+    std::vector<size_t> indices (in.size());
+    for (size_t i = 0; i < in.size(); i++) {
+        size_t casted = (size_t) values[i];
+        runtime_assert((double) casted == values[i], loc, "An expression used in sparse matrix indexing is not close to an integer");
+        runtime_assert(casted < bound, loc, "An expression used in sparse matrix indexing is larger than a dimension of the matrix");
+        indices[i] = casted;
+    }
+    return indices;
+}
+
+/**
+ * The number of rows of matrix to hand each thread in a loop that does
+ * entry_work operations per stored entry and row_work per row, so that each
+ * chunk of rows does about PARALLEL_GRAIN operations however the entries
+ * are spread between rows.
+ */
+static size_t row_grain(const SparseMatrix& matrix, size_t entry_work, size_t row_work) {
+    size_t work = matrix.nnz() * entry_work + matrix.rows() * row_work;
+    return std::max<size_t>(1, PARALLEL_GRAIN * matrix.rows() / std::max<size_t>(work, 1));
+}
+
+/**
+ * Builds the CSR arrays by counting the entries of each row, placing each
+ * entry in its row, then sorting each row by column. Entries at the same
+ * position are added up in the order they were given.
+ */
+Variable sparse_from_coordinates(const Variable& rows_var, const Variable& cols_var, const Variable& values_var, const Variable& shape_var, const Token& loc) {
+    runtime_assert(rows_var.is_ndarray() && cols_var.is_ndarray() && values_var.is_ndarray() && shape_var.is_ndarray(), loc, "Rows, columns, values and shape of a sparse matrix must be ndarrays");
+    NDArray shape_arr = std::get<NDArray>(shape_var.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(shape_arr.size() == 2, loc, "The shape of a sparse matrix must have two dimensions");
+    const double* shape = shape_arr.data();
+    size_t num_rows = (size_t) shape[0], num_cols = (size_t) shape[1];
+    runtime_assert((double) num_rows == shape[0] && (double) num_cols == shape[1], loc, "An expression used in array size is not close to an integer");
+    std::vector<size_t> rows = indices_of(std::get<NDArray>(rows_var.value), num_rows, loc);
+    std::vector<size_t> cols = indices_of(std::get<NDArray>(cols_var.value), num_cols, loc);
+    NDArray values_arr = std::get<NDArray>(values_var.value).as_dtype(DTYPE_F64).contiguous();
+    const double* values = values_arr.data();
+    size_t n = values_arr.size();
+    runtime_assert(rows.size() == n && cols.size() == n, loc, "Rows, columns and values of a sparse matrix differ in length");
+
+    std::vector<size_t> row_starts (num_rows + 1, 0);
+    for (size_t row : rows) row_starts[row + 1]++;
+    for (size_t r = 0; r < num_rows; r++) row_starts[r + 1] += row_starts[r];
+    std::vector<size_t> next (row_starts.begin(), row_starts.end() - 1);
+    std::vector<std::pair<size_t, double>> entries (n);
+    for (size_t k = 0; k < n; k++) entries[next[rows[k]]++] = {cols[k], values[k]};
+
+    std::vector<size_t> columns;
+    std::vector<double> kept;
+    columns.reserve(n);
+    kept.reserve(n);
+    auto by_column = [](const std::pair<size_t, double>& a, const std::pair<size_t, double>& b) { return a.first < b.first; };
+    for (size_t r = 0, begin = 0; r < num_rows; r++) {
+        size_t end = row_starts[r + 1];
+        row_starts[r] = columns.size();
+        std::stable_sort(entries.begin() + begin, entries.begin() + end, by_column);
+        for (size_t k = begin; k < end;) {
+            size_t col = entries[k].first;
+            double sum = 0;
+            while (k < end && entries[k].first == col) sum += entries[k++].second;
+            if (sum == 0) continue;
+            columns.push_back(col);
+            kept.push_back(sum);
+        }
+        begin = end;
+    }
+    row_starts[num_rows] = columns.size();
+    columns.shrink_to_fit();
+    kept.shrink_to_fit();
+    return Variable(SparseMatrix(num_rows, num_cols, std::move(row_starts), std::move(columns), std::move(kept)));
+}
+
+Variable sparse_from_dense(const Variable& dense_var, const Token& loc) {
+    runtime_assert(dense_var.is_ndarray(), loc, "Expression evaluates to a non-ndarray");
+    NDArray dense = std::get<NDArray>(dense_var.value).as_dtype(DTYPE_F64).contiguous();
+    runtime_assert(dense.shape().size() == 2, loc, "Only a 2d ndarray can be made sparse");
+    size_t num_rows = dense.shape()[0], num_cols = dense.shape()[1];
+    const double* elements = dense.data();
+    std::vector<size_t> row_starts (num_rows + 1, 0);
+    std::vector<size_t> columns;
+    std::vector<double> values;
+    for (size_t r = 0; r < num_rows; r++) {
+        for (size_t c = 0; c < num_cols; c++) {
+            double element = elements[r * num_cols + c];
+            if (element == 0) continue;
+            columns.push_back(c);
+            values.push_back(element);
+        }
+        row_starts[r + 1] = columns.size();
+    }
+    return Variable(SparseMatrix(num_rows, num_cols, std::move(row_starts), std::move(columns), std::move(values)));
+}
+
+Variable sparse_to_dense(const Variable& sparse_var, const Token& loc) {
+    runtime_assert(sparse_var.is_sparse(), loc, "Expression evaluates to a non-sparse matrix");
+    const SparseMatrix& matrix = std::get<SparseMatrix>(sparse_var.value);
+    const size_t* starts = matrix.row_starts().data();
+    const size_t* columns = matrix.columns().data();
+    const double* values = matrix.values().data();
+    size_t num_cols = matrix.cols();
+    NDArray result = NDArray::uninitialized({matrix.rows(), num_cols});
+    double* out = result.mutable_data();
+    parallel_for(matrix.rows(), row_grain(matrix, 1, num_cols), [&](size_t begin, size_t end) {
+        std::fill(out + begin * num_cols, out + end * num_cols, 0.);
+        for (size_t r = begin; r < end; r++) {
+            for (size_t k = starts[r]; k < starts[r + 1]; k++) out[r * num_cols + columns[k]] = values[k];
+        }
+    });
+    return Variable(std::move(result));
+}
+
+/**
+ * out = matrix @ dense, where dense is a row-major matrix of matrix.cols()
+ * rows of width elements each. Each row of out is the sum of the rows of
+ * dense picked out by that row's entries, scaled by their values.
+ */
+static void sparse_dense_product(const SparseMatrix& matrix, const double* dense, size_t width, double* out) {
+    const size_t* starts = matrix.row_starts().data();
+    const size_t* columns = matrix.columns().data();
+    const double* values = matrix.values().data();
+    parallel_for(matrix.rows(), row_grain(matrix, width, width), [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            double* out_row = out + r * width;
+            if (width == 1) {
+                double sum = 0;
+                for (size_t k = starts[r]; k < starts[r + 1]; k++) sum += values[k] * dense[columns[k]];
+                *out_row = sum;
+                continue;
+            }
+            std::fill(out_row, out_row + width, 0.);
+            for (size_t k = starts[r]; k < starts[r + 1]; k++) {
+                double value = values[k];
+                const double* dense_row = dense + columns[k] * width;
+                for (size_t j = 0; j < width; j++) out_row[j] += value * dense_row[j];
+            }
+        }
+    });
+}
+
+/**
+ * out = dense @ matrix, where dense is a row-major matrix of count rows of
+ * matrix.rows() elements each. Each row of out is the sum of the rows of
+ * matrix scaled by the elements of that row of dense, so each row of dense
+ * reads the whole of matrix, and threads take separate rows of dense.
+ */
+static void dense_sparse_product(const double* dense, size_t count, const SparseMatrix& matrix, double* out) {
+    const size_t* starts = matrix.row_starts().data();
+    const size_t* columns = matrix.columns().data();
+    const double* values = matrix.values().data();
+    size_t inner = matrix.rows(), width = matrix.cols();
+    size_t grain = std::max<size_t>(1, PARALLEL_GRAIN / std::max<size_t>(matrix.nnz() + inner + width, 1));
+    parallel_for(count, grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            double* out_row = out + i * width;
+            const double* dense_row = dense + i * inner;
+            std::fill(out_row, out_row + width, 0.);
+            for (size_t r = 0; r < inner; r++) {
+                double scale = dense_row[r];
+                for (size_t k = starts[r]; k < starts[r + 1]; k++) out_row[columns[k]] += scale * values[k];
+            }
+        }
+    });
+}
+
+/**
+ * Like matmul on dense operands, a 1d right operand is a column vector and a
+ * 1d left operand is a row vector, and that dimension is left out of the
+ * result. The dense operand is read as a contiguous f64 array.
+ */
+Variable sparse_matmul(const Variable& left_var, const Variable& right_var, const Token& loc) {
+    runtime_assert(!left_var.is_sparse() || !right_var.is_sparse(), loc, "Can't multiply two sparse matrices");
+    bool sparse_left = left_var.is_sparse();
+    const Variable& dense_var = sparse_left ? right_var : left_var;
+    runtime_assert(dense_var.is_ndarray(), loc, sparse_left ? "Right expression isn't an ndarray" : "Left expression isn't an ndarray");
+    const SparseMatrix& matrix = std::get<SparseMatrix>((sparse_left ? left_var : right_var).value);
+    NDArray dense = std::get<NDArray>(dense_var.value).as_dtype(DTYPE_F64).contiguous();
+    const std::vector<size_t>& dense_shape = dense.shape();
+    runtime_assert(dense_shape.size() == 1 || dense_shape.size() == 2, loc, "A sparse matrix can only be multiplied with a 1d or 2d ndarray");
+    bool vector = dense_shape.size() == 1;
+    if (sparse_left) {
+        runtime_assert(matrix.cols() == dense_shape[0], loc, "Left array's num of cols differs from right array's num of rows");
+        size_t width = vector ? 1 : dense_shape[1];
+        NDArray result = NDArray::uninitialized(vector ? std::vector<size_t> {matrix.rows()} : std::vector<size_t> {matrix.rows(), width});
+        sparse_dense_product(matrix, dense.data(), width, result.mutable_data());
+        return Variable(std::move(result));
+    }
+    runtime_assert(dense_shape.back() == matrix.rows(), loc, "Left array's num of cols differs from right array's num of rows");
+    size_t count = vector ? 1 : dense_shape[0];
+    NDArray result = NDArray::uninitialized(vector ? std::vector<size_t> {matrix.cols()} : std::vector<size_t> {count, matrix.cols()});
+    dense_sparse_product(dense.data(), count, matrix, result.mutable_data());
+    return Variable(std::move(result));
+}
+
+// Counts the entries in each column, then walks the rows in order placing
+// each entry in its column, which leaves every new row sorted
+SparseMatrix sparse_transpose(const SparseMatrix& matrix) {
+    const std::vector<size_t>& starts = matrix.row_starts();
+    const std::vector<size_t>& columns = matrix.columns();
+    const std::vector<double>& values = matrix.values();
+    std::vector<size_t> row_starts (matrix.cols() + 1, 0);
+    for (size_t col : columns) row_starts[col + 1]++;
+    for (size_t c = 0; c < matrix.cols(); c++) row_starts[c + 1] += row_starts[c];
+    std::vector<size_t> next (row_starts.begin(), row_starts.end() - 1);
+    std::vector<size_t> new_columns (matrix.nnz());
+    std::vector<double> new_values (matrix.nnz());
+    for (size_t r = 0; r < matrix.rows(); r++) {
+        for (size_t k = starts[r]; k < starts[r + 1]; k++) {
+            size_t at = next[columns[k]]++;
+            new_columns[at] = r;
+            new_values[at] = values[k];
+        }
+    }
+    return SparseMatrix(matrix.cols(), matrix.rows(), std::move(row_starts), std::move(new_columns), std::move(new_values));
+}
@@ -71,7 +71,7 @@ std::pair<std::string, std::string> ExprStmt::to_string() {
     return make_string("Expression statement", expr);
 }
 
-FuncDecl::FuncDecl(Token name, std::vector<Token> params, std::vector<Stmt*> stmts): name(name), params(params), stmts(stmts) {}
+FuncDecl::FuncDecl(Token name, std::vector<Token> params, std::vector<Stmt*> stmts): name(name), params(params), stmts(stmts), num_slots(0) {}
 
 std::pair<std::string, std::string> FuncDecl::to_string() {
     return make_string("Declare Function " + name.lexeme, stmts);
@@ -83,7 +83,7 @@ std::pair<std::string, std::string> If::to_string() {
     return make_string("If Statement ", stmts);
 }
 
-OpDecl::OpDecl(Token name, Token left, Token right, std::vector<Stmt*> stmts): name(name), left(left), right(right), stmts(stmts) {}
+OpDecl::OpDecl(Token name, Token left, Token right, std::vector<Stmt*> stmts): name(name), left(left), right(right), stmts(stmts), num_slots(0) {}
 
 std::pair<std::string, std::string> OpDecl::to_string() {
     return make_string("Declare Operator " + name.lexeme, stmts);
@@ -101,7 +101,7 @@ std::pair<std::string, std::string> Return::to_string() {
     return make_string("Return Statement", expr);
 }
 
-VarDecl::VarDecl(Token name, Expr* expr): name(name), expr(expr) {}
+VarDecl::VarDecl(Token name, Expr* expr): name(name), expr(expr), slot(0) {}
 
 std::pair<std::string, std::string> VarDecl::to_string() {
     return make_string("Declare variable " + name.lexeme, expr);
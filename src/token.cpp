@@ -30,6 +30,7 @@ std::string print_token_type(TokenType type) {
         case AT: return std::string("AT");
         case COMMA: return std::string("COMMA");
         case SEMI: return std::string("SEMI");
+        case COLON: return std::string("COLON");
         case LEFT_PAREN: return std::string("LEFT_PAREN");
         case RIGHT_PAREN: return std::string("RIGHT_PAREN");
         case LEFT_BRACE: return std::string("LEFT_BRACE");
@@ -11,6 +11,262 @@
 // along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
 
 #include "variable.hpp"
+#include "parallel.hpp"
+
+#include <atomic>
+
+static std::vector<size_t> row_major_strides(const std::vector<size_t>& shape) {
+    std::vector<size_t> strides (shape.size());
+    size_t stride = 1;
+    for (size_t i = shape.size(); i-- > 0;) {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+    return strides;
+}
+
+NDArray::NDArray(std::vector<double> values, std::vector<size_t> shape): buffer(std::allocate_shared<Buffer>(BufferAllocator<Buffer>(), values.size() * sizeof(double))), element_type(DTYPE_F64), start(0), num_elements(values.size()), dims(std::move(shape)), row_strides(row_major_strides(dims)) {
+    std::copy(values.begin(), values.end(), (double*) buffer->data());
+}
+
+NDArray NDArray::uninitialized(std::vector<size_t> shape, DType dtype) {
+    NDArray result;
+    result.num_elements = 1;
+    for (size_t d : shape) result.num_elements *= d;
+    // The vector itself comes from the pool too, along with its elements
+    result.buffer = std::allocate_shared<Buffer>(BufferAllocator<Buffer>(), result.num_elements * dtype_size(dtype));
+    result.element_type = dtype;
+    result.start = 0;
+    result.row_strides = row_major_strides(shape);
+    result.dims = std::move(shape);
+    return result;
+}
+
+size_t NDArray::size() const {
+    return num_elements;
+}
+
+DType NDArray::dtype() const {
+    return element_type;
+}
+
+const double* NDArray::data() const {
+    return (const double*) raw_data();
+}
+
+double* NDArray::mutable_data() {
+    return (double*) mutable_raw_data();
+}
+
+const void* NDArray::raw_data() const {
+    return buffer->data() + start * dtype_size(element_type);
+}
+
+/**
+ * Gives write access to the elements, first taking a private copy of them if
+ * another NDArray still refers to the same buffer.
+ */
+void* NDArray::mutable_raw_data() {
+    if (buffer.use_count() > 1) {
+        if (!is_contiguous()) {
+            *this = contiguous();
+        }
+        else {
+            NDArray copy = uninitialized(dims, element_type);
+            const unsigned char* bytes = (const unsigned char*) raw_data();
+            std::copy(bytes, bytes + size() * dtype_size(element_type), copy.buffer->data());
+            *this = std::move(copy);
+        }
+    }
+    return buffer->data() + start * dtype_size(element_type);
+}
+
+const std::vector<size_t>& NDArray::shape() const {
+    return dims;
+}
+
+const std::vector<size_t>& NDArray::strides() const {
+    return row_strides;
+}
+
+bool NDArray::is_shared() const {
+    return buffer.use_count() > 1;
+}
+
+bool NDArray::is_contiguous() const {
+    size_t stride = 1;
+    for (size_t i = dims.size(); i-- > 0;) {
+        // The stride of a dimension of size 1 is never used
+        if (dims[i] != 1 && row_strides[i] != stride) return false;
+        stride *= dims[i];
+    }
+    return true;
+}
+
+// Copies n elements read through strides into out, in row-major order. T is
+// any type of the same size as the elements, since they're only copied.
+template <typename T>
+static void gather(const T* elements, const std::vector<size_t>& dims, const std::vector<size_t>& strides, size_t n, T* out) {
+    std::vector<size_t> index (dims.size());
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = elements[offset];
+        for (size_t d = dims.size(); d-- > 0;) {
+            offset += strides[d];
+            if (++index[d] < dims[d]) break;
+            offset -= strides[d] * dims[d];
+            index[d] = 0;
+        }
+    }
+}
+
+NDArray NDArray::contiguous() const {
+    if (is_contiguous()) return *this;
+    NDArray result = uninitialized(dims, element_type);
+    switch (dtype_size(element_type)) {
+    case 1: gather((const uint8_t*) raw_data(), dims, row_strides, num_elements, (uint8_t*) result.buffer->data()); break;
+    case 4: gather((const uint32_t*) raw_data(), dims, row_strides, num_elements, (uint32_t*) result.buffer->data()); break;
+    default: gather((const uint64_t*) raw_data(), dims, row_strides, num_elements, (uint64_t*) result.buffer->data()); break;
+    }
+    return result;
+}
+
+NDArray NDArray::as_dtype(DType dtype, bool* exact) const {
+    if (dtype == element_type) return *this;
+    NDArray in = contiguous();
+    NDArray result = uninitialized(dims, dtype);
+    bool converted = convert_elements(element_type, in.raw_data(), dtype, result.buffer->data(), num_elements);
+    if (exact) *exact = converted;
+    return result;
+}
+
+NDArray NDArray::view(size_t offset, std::vector<size_t> shape, std::vector<size_t> strides) const {
+    NDArray result;
+    result.buffer = buffer;
+    result.element_type = element_type;
+    result.start = start + offset;
+    result.num_elements = 1;
+    for (size_t d : shape) result.num_elements *= d;
+    result.dims = std::move(shape);
+    result.row_strides = std::move(strides);
+    return result;
+}
+
+/**
+ * The index of the first of n elements for which differs(i) holds, or n if
+ * there isn't one. Threads search separate ranges, skipping a range once an
+ * earlier difference has been found.
+ */
+template <typename F>
+static size_t first_difference(size_t n, F differs) {
+    std::atomic<size_t> first (n);
+    parallel_for(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        if (begin >= first) return;
+        size_t i = begin;
+        while (i < end && !differs(i)) i++;
+        if (i == end) return;
+        size_t seen = first;
+        while (i < seen && !first.compare_exchange_weak(seen, i));
+    });
+    return first;
+}
+
+// Arrays of different dtypes are never equal, and are ordered by their
+// elements converted to f64
+bool operator==(const NDArray& left_view, const NDArray& right_view) {
+    if (left_view.dtype() != right_view.dtype()) return false;
+    NDArray left = left_view.as_dtype(DTYPE_F64).contiguous();
+    NDArray right = right_view.as_dtype(DTYPE_F64).contiguous();
+    if (left.size() != right.size() || left.shape() != right.shape()) return false;
+    const double* l = left.data();
+    const double* r = right.data();
+    return first_difference(left.size(), [&](size_t i) { return l[i] != r[i]; }) == left.size();
+}
+
+bool operator!=(const NDArray& left, const NDArray& right) {
+    return !(left == right);
+}
+
+// Compares the elements lexicographically, then the shapes, then the dtypes
+bool operator<(const NDArray& left_view, const NDArray& right_view) {
+    NDArray left = left_view.as_dtype(DTYPE_F64).contiguous();
+    NDArray right = right_view.as_dtype(DTYPE_F64).contiguous();
+    const double* l = left.data();
+    const double* r = right.data();
+    size_t common = std::min(left.size(), right.size());
+    size_t i = first_difference(common, [&](size_t i) { return l[i] < r[i] || r[i] < l[i]; });
+    if (i < common) return l[i] < r[i];
+    if (left.size() != right.size()) return left.size() < right.size();
+    if (left.shape() != right.shape()) return left.shape() < right.shape();
+    return left_view.dtype() < right_view.dtype();
+}
+
+bool operator>(const NDArray& left, const NDArray& right) {
+    return right < left;
+}
+
+bool operator<=(const NDArray& left, const NDArray& right) {
+    return !(right < left);
+}
+
+bool operator>=(const NDArray& left, const NDArray& right) {
+    return !(left < right);
+}
+
+SparseMatrix::SparseMatrix(size_t rows, size_t cols, std::vector<size_t> row_starts, std::vector<size_t> columns, std::vector<double> values): storage(std::make_shared<const Storage>(Storage {rows, cols, std::move(row_starts), std::move(columns), std::move(values)})) {}
+
+size_t SparseMatrix::rows() const {
+    return storage->rows;
+}
+
+size_t SparseMatrix::cols() const {
+    return storage->cols;
+}
+
+size_t SparseMatrix::nnz() const {
+    return storage->values.size();
+}
+
+const std::vector<size_t>& SparseMatrix::row_starts() const {
+    return storage->row_starts;
+}
+
+const std::vector<size_t>& SparseMatrix::columns() const {
+    return storage->columns;
+}
+
+const std::vector<double>& SparseMatrix::values() const {
+    return storage->values;
+}
+
+bool operator==(const SparseMatrix& left, const SparseMatrix& right) {
+    if (left.rows() != right.rows() || left.cols() != right.cols()) return false;
+    return left.row_starts() == right.row_starts() && left.columns() == right.columns() && left.values() == right.values();
+}
+
+bool operator!=(const SparseMatrix& left, const SparseMatrix& right) {
+    return !(left == right);
+}
+
+bool operator<(const SparseMatrix& left, const SparseMatrix& right) {
+    if (left.rows() != right.rows()) return left.rows() < right.rows();
+    if (left.cols() != right.cols()) return left.cols() < right.cols();
+    if (left.row_starts() != right.row_starts()) return left.row_starts() < right.row_starts();
+    if (left.columns() != right.columns()) return left.columns() < right.columns();
+    return left.values() < right.values();
+}
+
+bool operator>(const SparseMatrix& left, const SparseMatrix& right) {
+    return right < left;
+}
+
+bool operator<=(const SparseMatrix& left, const SparseMatrix& right) {
+    return !(right < left);
+}
+
+bool operator>=(const SparseMatrix& left, const SparseMatrix& right) {
+    return !(left < right);
+}
 
 Variable::Variable() {
     value.emplace<4>(nullptr);
@@ -28,26 +284,42 @@ Variable::Variable(double var) {
     value.emplace<2>(var);
 }
 
-Variable::Variable(std::pair<std::vector<double>, std::vector<size_t>> var) {
-    value.emplace<3>(var);
+Variable::Variable(NDArray var) {
+    value.emplace<3>(std::move(var));
+}
+
+Variable::Variable(std::shared_ptr<LazyArray> var) {
+    value.emplace<5>(std::move(var));
+}
+
+Variable::Variable(SparseMatrix var) {
+    value.emplace<6>(std::move(var));
 }
 
-bool Variable::is_string() {
+bool Variable::is_string() const {
     return std::get_if<std::string>(&value);
 }
 
-bool Variable::is_bool() {
+bool Variable::is_bool() const {
     return std::get_if<bool>(&value);
 }
 
-bool Variable::is_double() {
+bool Variable::is_double() const {
     return std::get_if<double>(&value);
 }
 
-bool Variable::is_ndarray() {
-    return std::get_if<std::pair<std::vector<double>, std::vector<size_t>>>(&value);
+bool Variable::is_ndarray() const {
+    return std::get_if<NDArray>(&value);
 }
 
-bool Variable::is_nil() {
+bool Variable::is_nil() const {
     return std::get_if<void*>(&value);
 }
+
+bool Variable::is_lazy() const {
+    return std::get_if<std::shared_ptr<LazyArray>>(&value);
+}
+
+bool Variable::is_sparse() const {
+    return std::get_if<SparseMatrix>(&value);
+}
@@ -0,0 +1,399 @@
+// This file is part of weak-lang.
+// weak-lang is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+// weak-lang is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+// You should have received a copy of the GNU Affero General Public License
+// along with weak-lang. If not, see <https://www.gnu.org/licenses/>.
+
+#include "vm.hpp"
+
+static const char* check_messages[] = {
+    "If statement expected a boolean condition",
+    "While statement expected a boolean condition",
+    "Assert statement expected a boolean condition",
+    "Left expression evaluates to non-boolean value",
+    "Right expression evaluates to non-boolean value"
+};
+
+VM::VM(): num_local_decls(0), out(std::cout) {}
+
+VM::VM(std::ostream& out_override): num_local_decls(0), out(out_override) {}
+
+//////////////////////////////////////////////////////////////////////////////
+// The interpreter loop. With direct threading every handler ends by        //
+// jumping to the handler address stored in the next instruction, so there  //
+// is no central switch for the branch predictor to miss on. Compilers      //
+// without computed goto fall back to a switch over the opcode.             //
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef WEAK_DIRECT_THREADED
+    #define TARGET(name) TARGET_##name:
+    #define DISPATCH() goto *ip->handler
+#else
+    #define TARGET(name) case name:
+    #define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() { ip++; DISPATCH(); }
+
+#define LOAD_FRAME() { \
+    CallFrame& frame = frames.back(); \
+    code = frame.proto->code.data(); \
+    slots = locals.data() + frame.base; \
+    slot_declared = declared.data() + frame.base; \
+}
+
+#define ARITHMETIC_OP(type, OP) { \
+    Variable& right = stack.back(); \
+    Variable& left = stack[stack.size() - 2]; \
+    double* left_double = std::get_if<double>(&left.value); \
+    const double* right_double = std::get_if<double>(&right.value); \
+    if (left_double && right_double) *left_double = *left_double OP *right_double; \
+    else left = fused_arithmetic(type, std::move(left), std::move(right), locations[ip->loc], ip->c == 0); \
+    stack.pop_back(); \
+    NEXT(); \
+}
+
+#define COMPARISON_OP(type, OP) { \
+    Variable& right = stack.back(); \
+    Variable& left = stack[stack.size() - 2]; \
+    const double* left_double = std::get_if<double>(&left.value); \
+    const double* right_double = std::get_if<double>(&right.value); \
+    if (left_double && right_double) left = Variable(*left_double OP *right_double); \
+    else left = compare(type, left, right, locations[ip->loc]); \
+    stack.pop_back(); \
+    NEXT(); \
+}
+
+void VM::run(Program& program) {
+#ifdef WEAK_DIRECT_THREADED
+    #define WEAK_OPCODE_LABEL(name) &&TARGET_##name,
+    static const void* dispatch_table[] = { WEAK_OPCODES(WEAK_OPCODE_LABEL) };
+    #undef WEAK_OPCODE_LABEL
+    for (auto& proto : program.functions) {
+        for (Instruction& instr : proto->code) instr.handler = dispatch_table[instr.op];
+    }
+#endif
+    funcs.assign(program.names.size(), nullptr);
+    ops.assign(program.names.size(), nullptr);
+    stack.clear();
+    locals.clear();
+    declared.clear();
+    frames.clear();
+    pending_calls.clear();
+    pending_builtins.clear();
+    builtins.clear();
+    for (const std::string& name : program.names) builtins.push_back(find_builtin(name));
+    num_local_decls = 0;
+
+    const std::vector<Token>& locations = program.locations;
+    const Variable* constants = program.constants.data();
+    const Instruction* code;
+    Variable* slots;
+    char* slot_declared;
+
+    push_frame(program.functions.at(0).get(), 0);
+    LOAD_FRAME();
+    const Instruction* ip = code;
+
+#ifdef WEAK_DIRECT_THREADED
+    DISPATCH();
+#else
+dispatch:
+    switch (ip->op) {
+#endif
+    TARGET(OP_CONSTANT) {
+        stack.push_back(constants[ip->a]);
+        NEXT();
+    }
+    TARGET(OP_NIL) {
+        stack.emplace_back();
+        NEXT();
+    }
+    TARGET(OP_POP) {
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_GET_LOCAL) {
+        runtime_assert(slot_declared[ip->a], locations[ip->loc], "Identifier doesn't correspond to a declared variable name");
+        stack.push_back(slots[ip->a]);
+        NEXT();
+    }
+    TARGET(OP_MOVE_LOCAL) {
+        runtime_assert(slot_declared[ip->a], locations[ip->loc], "Identifier doesn't correspond to a declared variable name");
+        stack.push_back(std::move(slots[ip->a]));
+        slots[ip->a] = Variable();
+        NEXT();
+    }
+    TARGET(OP_CHECK_LOCAL) {
+        runtime_assert(slot_declared[ip->a], locations[ip->loc], "Identifier doesn't correspond to a declared variable name");
+        NEXT();
+    }
+    TARGET(OP_SET_LOCAL) {
+        slots[ip->a] = stack.back();
+        NEXT();
+    }
+    TARGET(OP_DECLARE_LOCAL) {
+        if (!slot_declared[ip->a]) {
+            slots[ip->a] = std::move(stack.back());
+            slot_declared[ip->a] = 1;
+        }
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_GET_INDEX) {
+        Variable* arr = &stack[stack.size() - ip->a - 1];
+        Variable element = index_read(*arr, arr + 1, ip->a, locations[ip->loc]);
+        stack.resize(stack.size() - ip->a);
+        stack.back() = std::move(element);
+        NEXT();
+    }
+    TARGET(OP_GET_LOCAL_INDEX) {
+        Variable* indices = &stack[stack.size() - ip->b];
+        Variable element = index_read(slots[ip->a], indices, ip->b, locations[ip->loc]);
+        stack.resize(stack.size() - ip->b);
+        stack.push_back(std::move(element));
+        NEXT();
+    }
+    TARGET(OP_GET_SLICE) {
+        uint64_t slices = (uint64_t) ip->c << 32 | ip->b;
+        size_t num_parts = ip->a + 2 * std::popcount(slices);
+        Variable* arr = &stack[stack.size() - num_parts - 1];
+        Variable view = slice_read(*arr, arr + 1, ip->a, slices, locations[ip->loc]);
+        stack.resize(stack.size() - num_parts);
+        stack.back() = std::move(view);
+        NEXT();
+    }
+    TARGET(OP_SET_INDEX) {
+        Variable* indices = &stack[stack.size() - ip->b];
+        index_write(slots[ip->a], indices, ip->b, *(indices - 1), locations[ip->loc]);
+        stack.resize(stack.size() - ip->b);
+        NEXT();
+    }
+    TARGET(OP_ARRAY) {
+        NDArray array = NDArray::uninitialized({ip->a});
+        double* nums = array.mutable_data();
+        size_t first = stack.size() - ip->a;
+        for (size_t i = 0; i < ip->a; i++) {
+            const Variable& val = stack[first + i];
+            runtime_assert(val.is_double(), locations[ip->loc], "Expression in array literal evaluates to a non-number");
+            nums[i] = std::get<double>(val.value);
+        }
+        stack.resize(first);
+        stack.push_back(Variable(std::move(array)));
+        NEXT();
+    }
+    TARGET(OP_ADD) ARITHMETIC_OP(PLUS, +)
+    TARGET(OP_SUBTRACT) ARITHMETIC_OP(MINUS, -)
+    TARGET(OP_MULTIPLY) ARITHMETIC_OP(STAR, *)
+    TARGET(OP_DIVIDE) ARITHMETIC_OP(SLASH, /)
+    TARGET(OP_POWER) {
+        Variable& right = stack.back();
+        Variable& left = stack[stack.size() - 2];
+        left = fused_arithmetic(EXP, std::move(left), std::move(right), locations[ip->loc], ip->c == 0);
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_MATMUL) {
+        Variable& left = stack[stack.size() - 2];
+        left = matmul(left, stack.back(), locations[ip->loc]);
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_AS_SHAPE) {
+        Variable& left = stack[stack.size() - 2];
+        left = as_shape(left, stack.back(), locations[ip->loc]);
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_EQUAL) COMPARISON_OP(EQUALS_EQUALS, ==)
+    TARGET(OP_NOT_EQUAL) COMPARISON_OP(EXCLA_EQUALS, !=)
+    TARGET(OP_GREATER) COMPARISON_OP(GREATER, >)
+    TARGET(OP_GREATER_EQUAL) COMPARISON_OP(GREATER_EQUALS, >=)
+    TARGET(OP_LESS) COMPARISON_OP(LESSER, <)
+    TARGET(OP_LESS_EQUAL) COMPARISON_OP(LESSER_EQUALS, <=)
+    TARGET(OP_NEGATE) {
+        Variable& val = stack.back();
+        if (double* val_double = std::get_if<double>(&val.value)) *val_double = -*val_double;
+        else val = fused_negate(std::move(val), locations[ip->loc], ip->c == 0);
+        NEXT();
+    }
+    TARGET(OP_NOT) {
+        Variable& val = stack.back();
+        val = logical_not(val, locations[ip->loc]);
+        NEXT();
+    }
+    TARGET(OP_SHAPE) {
+        Variable& val = stack.back();
+        val = shape_of(val, locations[ip->loc]);
+        NEXT();
+    }
+    TARGET(OP_CHECK_BOOL) {
+        runtime_assert(stack.back().is_bool(), locations[ip->loc], check_messages[ip->b]);
+        NEXT();
+    }
+    TARGET(OP_JUMP) {
+        ip = code + ip->a;
+        DISPATCH();
+    }
+    TARGET(OP_JUMP_IF_FALSE) {
+        bool cond = std::get<bool>(stack.back().value);
+        stack.pop_back();
+        if (cond) ip++;
+        else ip = code + ip->a;
+        DISPATCH();
+    }
+    TARGET(OP_AND_JUMP) {
+        if (!std::get<bool>(stack.back().value)) {
+            ip = code + ip->a;
+            DISPATCH();
+        }
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_OR_JUMP) {
+        if (std::get<bool>(stack.back().value)) {
+            ip = code + ip->a;
+            DISPATCH();
+        }
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_PREPARE_CALL) {
+        FunctionProto* callee = lookup(ip->a, false);
+        if (!callee) {
+            const Builtin* builtin = builtins[ip->a];
+            runtime_assert(builtin, locations[ip->loc], "Identifier doesn't correspond to a defined function name");
+            runtime_assert(ip->b >= builtin->min_args && ip->b <= builtin->max_args, locations[ip->c], "Function called with different number of args than defined with");
+            pending_builtins.push_back(builtin);
+        }
+        else {
+            runtime_assert(callee->arity == ip->b, locations[ip->c], "Function called with different number of args than defined with");
+        }
+        pending_calls.push_back(callee);
+        NEXT();
+    }
+    TARGET(OP_CALL) {
+        FunctionProto* callee = pending_calls.back();
+        pending_calls.pop_back();
+        if (!callee) {
+            const Builtin* builtin = pending_builtins.back();
+            pending_builtins.pop_back();
+            Variable* args = &stack[stack.size() - ip->a];
+            Variable result = builtin->call(args, ip->a, locations[ip->loc]);
+            stack.resize(stack.size() - ip->a);
+            stack.push_back(std::move(result));
+            NEXT();
+        }
+        frames.back().ip = ip + 1;
+        push_frame(callee, ip->a);
+        LOAD_FRAME();
+        ip = code;
+        DISPATCH();
+    }
+    TARGET(OP_CALL_OP) {
+        FunctionProto* callee = lookup(ip->a, true);
+        runtime_assert(callee, locations[ip->loc], "Identifier doesn't correspond to a defined operator name");
+        frames.back().ip = ip + 1;
+        push_frame(callee, 2);
+        LOAD_FRAME();
+        ip = code;
+        DISPATCH();
+    }
+    TARGET(OP_DEFINE_FUNC) {
+        define(ip->a, program.functions.at(ip->b).get(), false);
+        NEXT();
+    }
+    TARGET(OP_DEFINE_OP) {
+        define(ip->a, program.functions.at(ip->b).get(), true);
+        NEXT();
+    }
+    TARGET(OP_PRINT) {
+        print_variable(out, stack.back());
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_ASSERT) {
+        runtime_assert(std::get<bool>(stack.back().value), locations[ip->loc], "Assert failed");
+        stack.pop_back();
+        NEXT();
+    }
+    TARGET(OP_RETURN) {
+        // Returning from the top level ends the program
+        if (frames.size() == 1) {
+            pop_frame();
+            stack.clear();
+            return;
+        }
+        Variable result = std::move(stack.back());
+        stack.pop_back();
+        pop_frame();
+        stack.push_back(std::move(result));
+        LOAD_FRAME();
+        ip = frames.back().ip;
+        DISPATCH();
+    }
+#ifndef WEAK_DIRECT_THREADED
+    default: throw std::runtime_error("Unknown opcode");
+    }
+#endif
+}
+
+/**
+ * Finds the function or operator with the given name that is visible to the
+ * current call. Declarations made inside a call are visible to everything it
+ * calls, so we walk the call stack before falling back to the top level.
+ */
+FunctionProto* VM::lookup(uint32_t name, bool is_op) {
+    if (num_local_decls > 0) {
+        for (size_t i = frames.size(); i-- > 1;) {
+            auto& table = is_op ? frames[i].local_ops : frames[i].local_funcs;
+            if (!table) continue;
+            auto found = table->find(name);
+            if (found != table->end()) return found->second;
+        }
+    }
+    return is_op ? ops[name] : funcs[name];
+}
+
+void VM::define(uint32_t name, FunctionProto* proto, bool is_op) {
+    if (frames.size() == 1) {
+        FunctionProto*& global = is_op ? ops[name] : funcs[name];
+        if (!global) global = proto;
+        return;
+    }
+    if (lookup(name, is_op)) return;
+    auto& table = is_op ? frames.back().local_ops : frames.back().local_funcs;
+    if (!table) {
+        table.reset(new std::unordered_map<uint32_t, FunctionProto*>());
+        num_local_decls++;
+    }
+    table->insert(std::pair<uint32_t, FunctionProto*>(name, proto));
+}
+
+void VM::push_frame(FunctionProto* proto, size_t num_args) {
+    size_t base = locals.size();
+    locals.resize(base + proto->num_slots);
+    declared.resize(base + proto->num_slots, 0);
+    size_t first_arg = stack.size() - num_args;
+    for (size_t i = 0; i < num_args; i++) {
+        locals[base + i] = std::move(stack[first_arg + i]);
+        declared[base + i] = 1;
+    }
+    stack.resize(first_arg);
+    frames.push_back(CallFrame {proto, proto->code.data(), base, nullptr, nullptr});
+}
+
+void VM::pop_frame() {
+    CallFrame& frame = frames.back();
+    if (frame.local_funcs) num_local_decls--;
+    if (frame.local_ops) num_local_decls--;
+    locals.resize(frame.base);
+    declared.resize(frame.base);
+    frames.pop_back();
+}
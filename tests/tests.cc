@@ -22,10 +22,24 @@
 #include "parser.hpp"
 #include "util.hpp"
 #include "environment.hpp"
+#include "resolver.hpp"
+#include "compiler.hpp"
+#include "vm.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "gemm.hpp"
+#include "allocator.hpp"
+#include "dtypes.hpp"
+#include "sparse.hpp"
+#include "linalg.hpp"
+#include "reductions.hpp"
+#include "indexing.hpp"
+#include "random.hpp"
 #include<iostream>
 #include<fstream>
 #include<sstream>
 #include<algorithm>
+#include<cstring>
 
 //////////////////////////////////////////////////////////////////////////////
 //                                Lexer tests                               //
@@ -1333,6 +1347,102 @@ std::string getOutput(std::string program) {
     return output_stream.str();
 }
 
+TEST_CASE("Shared ndarray storage", "[variable]") {
+    Token loc = {IDENTIFIER, "arr", 0, 0};
+    Variable original (NDArray({1, 2, 3, 4}, {2, 2}));
+    Variable copy = original;
+    REQUIRE(std::get<NDArray>(original.value).is_shared());
+    REQUIRE(std::get<NDArray>(copy.value).data() == std::get<NDArray>(original.value).data());
+
+    SECTION("Writing to a copy leaves the original alone") {
+        Variable indices[2] = {Variable(1.0), Variable(0.0)};
+        index_write(copy, indices, 2, Variable(9.0), loc);
+        REQUIRE(!std::get<NDArray>(original.value).is_shared());
+        REQUIRE(!std::get<NDArray>(copy.value).is_shared());
+        REQUIRE(std::get<NDArray>(original.value) == NDArray({1, 2, 3, 4}, {2, 2}));
+        REQUIRE(std::get<double>(index_read(copy, indices, 2, loc).value) == 9.0);
+    }
+
+    SECTION("Arrays passed to functions are still copies") {
+        auto program = R"V0G0N(
+            f zero_first(arr) {
+                arr[0] = 0;
+                r arr;
+            }
+            a arr = [1, 2, 3];
+            p zero_first(arr);
+            p arr;
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[0, 2, 3] sa [3]\n[1, 2, 3] sa [3]");
+    }
+}
+
+TEST_CASE("Uninitialized ndarrays", "[variable]") {
+    NDArray array = NDArray::uninitialized({2, 3});
+    REQUIRE(array.size() == 6);
+    REQUIRE(array.strides() == std::vector<size_t>{3, 1});
+    REQUIRE(!array.is_shared());
+    double* out = array.mutable_data();
+    REQUIRE(out == array.data());
+    for (size_t i = 0; i < 6; i++) out[i] = (double) i;
+    REQUIRE(array == NDArray({0, 1, 2, 3, 4, 5}, {2, 3}));
+
+    NDArray copy = array;
+    copy.mutable_data()[0] = 9;
+    REQUIRE(array == NDArray({0, 1, 2, 3, 4, 5}, {2, 3}));
+    REQUIRE(copy == NDArray({9, 1, 2, 3, 4, 5}, {2, 3}));
+}
+
+TEST_CASE("Ndarray buffers come from a pool", "[variable]") {
+    // The last is too big to pool, and is mapped on its own
+    for (size_t size : {1, 7, 100, 5000, 5000000}) {
+        NDArray array = NDArray::uninitialized({size});
+        REQUIRE((uintptr_t) array.data() % BUFFER_ALIGNMENT == 0);
+        array.mutable_data()[size - 1] = 1;
+        REQUIRE(array.data()[size - 1] == 1);
+    }
+
+    auto program = R"V0G0N(
+        a x = [1, 2, 3] sa [100, 10];
+        a row = [1, 2] sa [10];
+        a n = 0;
+        w (n < 20) {
+            a y = x * 2 + row;
+            x = y - x - row;
+            n = n + 1;
+        }
+        p x[99, 9];
+    )V0G0N";
+    REQUIRE_OUTPUT(program, "1");
+    // Everything the loop allocates the second time round is reused
+    size_t before = allocation_counts().system_allocations;
+    REQUIRE_OUTPUT(program, "1");
+    REQUIRE(allocation_counts().system_allocations == before);
+    REQUIRE(allocation_counts().reused > 0);
+}
+
+TEST_CASE("Strided views", "[variable]") {
+    Token loc = {IDENTIFIER, "arr", 0, 0};
+    Variable original (NDArray({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, {3, 4}));
+    // original[1:3, ::2]
+    Variable parts[6] = {Variable(1.0), Variable(3.0), Variable(), Variable(), Variable(), Variable(2.0)};
+    Variable view = slice_read(original, parts, 2, 3, loc);
+    const NDArray& view_arr = std::get<NDArray>(view.value);
+    REQUIRE(view_arr.shape() == std::vector<size_t>{2, 2});
+    REQUIRE(view_arr.strides() == std::vector<size_t>{4, 2});
+    REQUIRE(view_arr.data() == std::get<NDArray>(original.value).data() + 4);
+    REQUIRE(!view_arr.is_contiguous());
+    REQUIRE(view_arr == NDArray({4, 6, 8, 10}, {2, 2}));
+
+    SECTION("Writing to a view leaves the original alone") {
+        Variable indices[2] = {Variable(1.0), Variable(1.0)};
+        index_write(view, indices, 2, Variable(-1.0), loc);
+        REQUIRE(std::get<NDArray>(view.value) == NDArray({4, 6, 8, -1}, {2, 2}));
+        REQUIRE(std::get<NDArray>(view.value).is_contiguous());
+        REQUIRE(std::get<NDArray>(original.value) == NDArray({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, {3, 4}));
+    }
+}
+
 TEST_CASE("Printing simple expressions", "[environment]") {
     SECTION("string literal") {
         REQUIRE_OUTPUT("p \"hello\";", "\"hello\"");
@@ -1431,6 +1541,20 @@ TEST_CASE("Variable declaration and usage", "[environment]") {
         REQUIRE_OUTPUT(program, "[6, 6, 6, 6] sa [2, 2]");
     }
 
+    SECTION("nd array indexing is row-major") {
+        auto program = R"V0G0N(
+            a arr = [1, 2, 3, 4, 5, 6] sa [2, 3];
+            p arr[1, 0];
+            p arr[0, 2];
+            arr[1, 2] = 0;
+            p arr;
+            a cube = [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11] sa [2, 3, 2];
+            p cube[1, 2, 1];
+            p cube[0, 1, 0];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "4\n3\n[1, 2, 3, 4, 5, 0] sa [2, 3]\n11\n2");
+    }
+
     SECTION("bool declaration and usage") {
         auto program = R"V0G0N(
             a boolean = T;
@@ -1527,6 +1651,41 @@ TEST_CASE("Operator declaration and usage", "[environment]") {
     }
 }
 
+TEST_CASE("Declarations inside calls", "[environment]") {
+    SECTION("Visible to callees until the call returns") {
+        auto program = R"V0G0N(
+            f helper() {
+                r 2 twice 3;
+            }
+            f outer() {
+                o twice(left, right) {
+                    r 2 * (left + right);
+                }
+                r helper();
+            }
+            p outer();
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "10");
+        REQUIRE_THROWS_WITH(getOutput("f g() { f h() {} } g(); p h();"), "Runtime error: Identifier doesn't correspond to a defined function name, occurred at line 0 at column 26");
+    }
+
+    SECTION("Existing declarations take priority") {
+        auto program = R"V0G0N(
+            f name() {
+                r "top level";
+            }
+            f outer() {
+                f name() {
+                    r "inner";
+                }
+                r name();
+            }
+            p outer();
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "\"top level\"");
+    }
+}
+
 TEST_CASE("While usage", "[environment]") {
     // There's really only one unique test we can do here,
     // any other tests would be isomorphic
@@ -1666,6 +1825,10 @@ TEST_CASE("Error tests", "[environment]") {
         REQUIRE_THROWS_WITH(getOutput(program), "Runtime error: Expression evaluates to a non-ndarray, occurred at line 2 at column 15");
     }
 
+    SECTION("sa with an empty shape") {
+        REQUIRE_THROWS_WITH(getOutput("p [1] sa ([1] sa [0]);"), "Runtime error: The shape of an ndarray must have at least one dimension, occurred at line 0 at column 6");
+    }
+
     SECTION("Call to function that does not exist") {
         REQUIRE_THROWS_WITH(getOutput("p dne();"), "Runtime error: Identifier doesn't correspond to a defined function name, occurred at line 0 at column 2");
     }
@@ -1778,3 +1941,918 @@ TEST_CASE("Complete program evaluation", "[environment]") {
         REQUIRE_OUTPUT(program, output);
     };
 }
+
+//////////////////////////////////////////////////////////////////////////////
+//                                Resolver tests                            //
+//////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("Variable slots", "[resolver]") {
+    Lexer lex;
+    auto lexed = lex.lex("a x = 1; a y = x; f func(n, m) { a z = n; r z + m; } x = y;");
+    Parser p (lexed);
+    auto statements = p.parse();
+    std::unordered_map<std::string, size_t> globals;
+    Resolver resolver (globals);
+    resolver.resolve(statements);
+    resolver.resolve(statements);
+
+    SECTION("Top level") {
+        REQUIRE(resolver.num_slots() == 2);
+        REQUIRE(globals.at("x") == 0);
+        REQUIRE(globals.at("y") == 1);
+        REQUIRE(dynamic_cast<VarDecl*>(statements.at(1))->slot == 1);
+        REQUIRE(dynamic_cast<Var*>(dynamic_cast<VarDecl*>(statements.at(1))->expr)->slot == 0);
+        REQUIRE(dynamic_cast<Assign*>(dynamic_cast<ExprStmt*>(statements.at(3))->expr)->slot == 0);
+    }
+
+    SECTION("Function bodies") {
+        FuncDecl* func = dynamic_cast<FuncDecl*>(statements.at(2));
+        REQUIRE(func->num_slots == 3);
+        REQUIRE(dynamic_cast<VarDecl*>(func->stmts.at(0))->slot == 2);
+        REQUIRE(dynamic_cast<Var*>(dynamic_cast<VarDecl*>(func->stmts.at(0))->expr)->slot == 0);
+        REQUIRE(globals.find("z") == globals.end());
+    }
+
+    SECTION("Scoping is unchanged") {
+        REQUIRE_OUTPUT("a x = 1; a x = 2; p x;", "1");
+        REQUIRE_THROWS_WITH(getOutput("a x = 1; f g() { r x; } p g();"), "Runtime error: Identifier doesn't correspond to a declared variable name, occurred at line 0 at column 19");
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                               Bytecode VM tests                          //
+//////////////////////////////////////////////////////////////////////////////
+
+std::string getVMOutput(std::string program) {
+    Lexer lex;
+    auto lexed = lex.lex(program);
+    Parser p (lexed);
+    auto statements = p.parse();
+    Compiler compiler;
+    auto compiled = compiler.compile(statements);
+    std::stringstream output_stream;
+    VM vm (output_stream);
+    vm.run(*compiled);
+    return output_stream.str();
+}
+
+// The VM must be indistinguishable from the tree-walking Environment
+#define REQUIRE_SAME_OUTPUT(prog) REQUIRE(getVMOutput(prog) == getOutput(prog));
+
+TEST_CASE("VM matches environment", "[vm]") {
+    SECTION("Printing and arithmetic") {
+        REQUIRE_SAME_OUTPUT("p \"hello\"; p 2.5; p T; p N; p [1, 2] sa [2, 2]; p 2 + 3 * 5; p (2+3)^(1.5 * 2);");
+        REQUIRE_SAME_OUTPUT("p !(!(T A F) O (!T O F)); p 1 < 2; p [1] == [1]; p [1] != 1; p -(-5);");
+    }
+
+    SECTION("Variables and arrays") {
+        auto program = R"V0G0N(
+            a arr = [0] sa [2, 2];
+            arr = arr + 2;
+            arr[1, 0] = arr[0, 1] * 3;
+            p arr;
+            p s arr;
+            w (arr[0, 0] < 100) {
+                a k = arr[0, 0];
+                arr = arr * arr;
+                p k;
+            }
+        )V0G0N";
+        REQUIRE_SAME_OUTPUT(program);
+        REQUIRE_SAME_OUTPUT("a arr = [1, 2, 3, 4, 5, 6] sa [2, 3]; p arr[1, 0]; p arr[0, 2]; p (arr + 1)[1, 1];");
+    }
+
+    SECTION("Functions, operators and recursion") {
+        auto program = R"V0G0N(
+            f factorial(n) {
+                i (n == 1) {
+                    r n;
+                }
+                r n * factorial(n-1);
+            }
+
+            o choose(n, k) {
+                r factorial(n)/(factorial(k)*factorial(n-k));
+            }
+
+            f find(limit) {
+                a j = 0;
+                w (T) {
+                    i (j == limit) {
+                        r j;
+                    }
+                    j = j + 1;
+                }
+            }
+
+            f nothing() {}
+
+            p 5 choose 2;
+            p find(7);
+            p nothing();
+        )V0G0N";
+        REQUIRE_SAME_OUTPUT(program);
+    }
+
+    SECTION("Functions declared inside functions") {
+        auto program = R"V0G0N(
+            f helper() {
+                r inner();
+            }
+            f outer() {
+                f inner() {
+                    r "inner";
+                }
+                r helper();
+            }
+            p outer();
+        )V0G0N";
+        REQUIRE_SAME_OUTPUT(program);
+        REQUIRE_THROWS_WITH(getVMOutput("f g() { f h() {} } g(); p h();"), "Runtime error: Identifier doesn't correspond to a defined function name, occurred at line 0 at column 26");
+    }
+
+    SECTION("Errors") {
+        REQUIRE_THROWS_WITH(getVMOutput("w (34) {}"), "Runtime error: While statement expected a boolean condition, occurred at line 0 at column 0");
+        REQUIRE_THROWS_WITH(getVMOutput("mat = 3;"), "Runtime error: Identifier doesn't correspond to a declared variable name, occurred at line 0 at column 0");
+        REQUIRE_THROWS_WITH(getVMOutput("a mat = [0, 1];\np mat[2];"), "Runtime error: An expression used in array indexing is larger than a dimension of the ndarray, occurred at line 1 at column 6");
+        REQUIRE_THROWS_WITH(getVMOutput("f func(arg) { r arg; }\np func(1, 2);"), "Runtime error: Function called with different number of args than defined with, occurred at line 1 at column 7");
+        REQUIRE_THROWS_WITH(getVMOutput("p T xor F;"), "Runtime error: Identifier doesn't correspond to a defined operator name, occurred at line 0 at column 4");
+        REQUIRE_THROWS_WITH(getVMOutput("v 2 == 1;"), "Runtime error: Assert failed, occurred at line 0 at column 7");
+    }
+}
+
+TEST_CASE("Fused elementwise expressions", "[fusion]") {
+    SECTION("Same results as one operator at a time") {
+        auto program = R"V0G0N(
+            a x = [1, 2, 3, 4, 5, 6, 7] sa [30, 30];
+            a y = [0.5, 3] sa [30, 30];
+            a fused = -(4 * x + 1) / (y ^ 2 - x) + 2 ^ -y;
+            a step = 4 * x;
+            step = step + 1;
+            step = -step;
+            a other = y ^ 2;
+            other = other - x;
+            step = step / other;
+            other = -y;
+            other = 2 ^ other;
+            step = step + other;
+            p fused == step;
+            p (s fused)[0];
+            p -x[0, 1];
+            p (-[1, 2] + 3) * 2;
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "True\n30\n-2\n[4, 2] sa [2]");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Errors are raised by the operator that caused them") {
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2];\np (x + [1, 2, 3]) * 2 + 1;"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 1 at column 6");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2];\np 2 * (x + 1) - T;"), "Runtime error: At least one of left and right expressions are neither numbers nor ndarrays, occurred at line 1 at column 15");
+        REQUIRE_THROWS_WITH(getVMOutput("a x = [1, 2];\np (x + [1, 2, 3]) * 2 + 1;"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 1 at column 6");
+        REQUIRE_THROWS_WITH(getVMOutput("a x = [1, 2];\np 2 * (x + 1) - T;"), "Runtime error: At least one of left and right expressions are neither numbers nor ndarrays, occurred at line 1 at column 15");
+    }
+}
+
+TEST_CASE("Every kernel set matches the scalar kernels", "[kernels]") {
+    std::vector<const KernelSet*> sets = supported_kernels();
+    const KernelSet& scalar = *sets.at(0);
+    // An odd length exercises both the vector loop and the leftover loop
+    const size_t n = 37;
+    std::vector<double> left (n), right (n);
+    for (size_t i = 0; i < n; i++) {
+        left[i] = (double) i * 0.37 - 5.;
+        right[i] = (double) (n - i) * 1.3 - 4.;
+    }
+    left[3] = -0.;
+    left[4] = NAN;
+    double exponents[] = {2., -1., 1., 0.5};
+
+    for (const KernelSet* set : sets) {
+        for (size_t op = 0; op < NUM_KERNEL_OPS; op++) {
+            for (size_t layout = 0; layout < NUM_KERNEL_LAYOUTS; layout++) {
+                for (double exponent : exponents) {
+                    const double* rhs = layout == ARRAY_SCALAR ? &exponent : right.data();
+                    std::vector<double> expected (n), actual (n);
+                    kernel_binary(scalar, (KernelOp) op, (KernelLayout) layout, left.data(), rhs, expected.data(), n);
+                    kernel_binary(*set, (KernelOp) op, (KernelLayout) layout, left.data(), rhs, actual.data(), n);
+                    REQUIRE(memcmp(expected.data(), actual.data(), n * sizeof(double)) == 0);
+                }
+            }
+        }
+        for (KernelOp op : {KERNEL_ADD, KERNEL_MULTIPLY, KERNEL_MIN, KERNEL_MAX}) {
+            double expected = kernel_reduce(scalar, op, left.data(), n);
+            double actual = kernel_reduce(*set, op, left.data(), n);
+            REQUIRE(memcmp(&expected, &actual, sizeof(double)) == 0);
+        }
+        // Without the NaN, so the result is compared by value
+        left[4] = 2.;
+        double expected_dot = scalar.dot(left.data(), right.data(), n);
+        double actual_dot = set->dot(left.data(), right.data(), n);
+        left[4] = NAN;
+        REQUIRE(expected_dot == actual_dot);
+        // left[5..] as a 4 x 8 matrix times right as an 8 x 4 matrix
+        std::vector<double> expected_product (16), actual_product (16);
+        native_gemm(scalar, 4, 4, 8, left.data() + 5, 8, 1, right.data(), 4, 1, expected_product.data());
+        native_gemm(*set, 4, 4, 8, left.data() + 5, 8, 1, right.data(), 4, 1, actual_product.data());
+        REQUIRE(expected_product == actual_product);
+        std::vector<double> negated (n);
+        set->negate(left.data(), negated.data(), n);
+        REQUIRE(std::signbit(negated[3]) == false);
+        REQUIRE(std::signbit(negated[4]) != std::signbit(left[4]));
+    }
+}
+
+TEST_CASE("Updating a variable from its own value", "[fusion]") {
+    auto program = R"V0G0N(
+        a mat = [1, 2, 3, 4] sa [2, 2];
+        a copy = mat;
+        mat = mat * 2;
+        p mat;
+        p copy;
+        mat = mat * 2 + mat;
+        p mat;
+        mat = (mat + 1) * -mat;
+        p mat;
+        a n = 0;
+        w (n < 3) {
+            mat = mat / 2;
+            n = n + 1;
+        }
+        p mat;
+        copy = 1 - copy;
+        p copy;
+        f twice(arr) {
+            arr = arr * 2;
+            r arr;
+        }
+        p twice(copy);
+        p copy;
+    )V0G0N";
+    REQUIRE_OUTPUT(program, "[2, 4, 6, 8] sa [2, 2]\n[1, 2, 3, 4] sa [2, 2]\n[6, 12, 18, 24] sa [2, 2]\n[-42, -156, -342, -600] sa [2, 2]\n[-5.25, -19.5, -42.75, -75] sa [2, 2]\n[0, -1, -2, -3] sa [2, 2]\n[0, -2, -4, -6] sa [2, 2]\n[0, -1, -2, -3] sa [2, 2]");
+    REQUIRE(getVMOutput(program) == getOutput(program));
+}
+
+TEST_CASE("Broadcasting", "[operations]") {
+    SECTION("Shapes are aligned at their last dimension") {
+        auto program = R"V0G0N(
+            a mat = [1, 2, 3, 4, 5, 6] sa [2, 3];
+            p mat - [1, 2, 3];
+            p mat * ([10, 100] sa [2, 1]);
+            p [1, 2, 3] + ([10, 20] sa [2, 1]);
+            p ([2] sa [1, 1]) ^ mat;
+            p mat + [5];
+            a box = [1, 2] sa [2, 1, 1];
+            p (s (box + mat))[0];
+            p (box + mat)[1, 1, 2];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[0, 0, 0, 3, 3, 3] sa [2, 3]\n[10, 20, 30, 400, 500, 600] sa [2, 3]\n[11, 12, 13, 21, 22, 23] sa [2, 3]\n[2, 4, 8, 16, 32, 64] sa [2, 3]\n[6, 7, 8, 9, 10, 11] sa [2, 3]\n2\n8");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Broadcasting inside fused expressions") {
+        auto program = R"V0G0N(
+            a data = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11] sa [300, 7];
+            a mean = [1, 2, 3, 4, 5, 6, 7];
+            a scale = [1, 2, 3] sa [300, 1];
+            a fused = -(data - mean) * scale + 1;
+            a step = data - mean;
+            step = -step;
+            step = step * scale;
+            step = step + 1;
+            p fused == step;
+            p (-(mean + 1) * ([2, 3] sa [2, 1]))[1, 6];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "True\n-24");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Incompatible shapes") {
+        REQUIRE_THROWS_WITH(getOutput("p ([1, 2, 3, 4] sa [2, 2]) + [1, 2, 3];"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 0 at column 27");
+        REQUIRE_THROWS_WITH(getVMOutput("p ([1, 2, 3, 4] sa [2, 2]) + [1, 2, 3];"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 0 at column 27");
+    }
+}
+
+TEST_CASE("Slicing", "[operations]") {
+    SECTION("Slices are views of the array") {
+        auto program = R"V0G0N(
+            a mat = [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11] sa [3, 4];
+            p mat[1:3, :];
+            p mat[:, 1];
+            p mat[2, 1:];
+            p mat[::2, ::3];
+            p mat[:2, 5:];
+            a col = mat[:, 3];
+            col[0] = 100;
+            p col;
+            p mat[0, 3];
+            p mat[1:, 1:3] * 2 + mat[:2, :2];
+            p -mat[:, 0] + [1, 1, 1];
+            p mat[0:3:2, 1:4:2] @ ([1, 0, 0, 1] sa [2, 2]);
+            p (mat[1:, :] sa [2])[1];
+            p mat[:, 1:2] == [1, 5, 9] sa [3, 1];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[4, 5, 6, 7, 8, 9, 10, 11] sa [2, 4]\n[1, 5, 9] sa [3]\n[9, 10, 11] sa [3]\n[0, 3, 8, 11] sa [2, 2]\n[] sa [2, 0]\n[100, 7, 11] sa [3]\n3\n[10, 13, 22, 25] sa [2, 2]\n[1, -3, -7] sa [3]\n[1, 3, 9, 11] sa [2, 2]\n5\nTrue");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Slicing errors") {
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3];\np x[0:2:0];"), "Runtime error: The step of an array slice must be positive, since slices can't be reversed, occurred at line 1 at column 4");
+        REQUIRE_THROWS_WITH(getVMOutput("a x = [1, 2, 3];\np x[0:2:0];"), "Runtime error: The step of an array slice must be positive, since slices can't be reversed, occurred at line 1 at column 4");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3];\np x[::-1];"), "Runtime error: The step of an array slice must be positive, since slices can't be reversed, occurred at line 1 at column 4");
+        REQUIRE_THROWS_WITH(getVMOutput("a x = [1, 2, 3];\np x[::-1];"), "Runtime error: The step of an array slice must be positive, since slices can't be reversed, occurred at line 1 at column 4");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3];\np x[0.5:];"), "Runtime error: An expression used in array slicing is not close to a non-negative integer, occurred at line 1 at column 4");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3];\nx[1:] = 2;"), "Can't assign to a slice of an array but instead found: \":\", at line 2 and column 5, this token has type COLON");
+    }
+}
+
+TEST_CASE("Transposes", "[operations]") {
+    auto program = R"V0G0N(
+        a mat = [1, 2, 3, 4, 5, 6] sa [2, 3];
+        p transpose(mat);
+        p transpose(mat)[2, 1];
+        p transpose(mat) @ mat;
+        p mat @ transpose(mat);
+        p transpose(mat) @ transpose([1, 2, 3, 4] sa [2, 2]);
+        p transpose([1, 2, 3]) == [1, 2, 3];
+        p transpose(transpose(mat)) == mat;
+        p transpose(mat[:, 1:]) @ mat[:, :2];
+        p transpose(mat) + 1;
+        a tr = 2;
+        p tr * 3;
+    )V0G0N";
+    REQUIRE_OUTPUT(program, "[1, 4, 2, 5, 3, 6] sa [3, 2]\n6\n[17, 22, 27, 22, 29, 36, 27, 36, 45] sa [3, 3]\n[14, 32, 32, 77] sa [2, 2]\n[9, 19, 12, 26, 15, 33] sa [3, 2]\nTrue\nTrue\n[22, 29, 27, 36] sa [2, 2]\n[2, 5, 3, 6, 4, 7] sa [3, 2]\n6");
+    REQUIRE(getVMOutput(program) == getOutput(program));
+    REQUIRE_THROWS_WITH(getOutput("p transpose(2);"), "Runtime error: Expression evaluates to a non-ndarray, occurred at line 0 at column 2");
+}
+
+TEST_CASE("Matrix-vector and batched products", "[operations]") {
+    auto program = R"V0G0N(
+        a mat = [1, 2, 3, 4, 5, 6] sa [2, 3];
+        a vec = [1, 0, 2];
+        p mat @ vec;
+        p [1, 1] @ mat;
+        p vec @ vec;
+        p transpose(mat) @ [1, 2];
+        p [1, 2, 3] @ transpose(mat);
+        a stack = [1, 2, 3, 4, 5, 6, 7, 8] sa [2, 2, 2];
+        p stack @ stack;
+        p stack @ ([1, 0, 0, 1] sa [2, 2]);
+        p stack @ [1, 1];
+        p transpose(stack) @ [1, 1];
+        p mat[:, ::2] @ [1, 1];
+        p ([1, 2, 3, 4] sa [1, 2, 2]) @ stack;
+    )V0G0N";
+    REQUIRE_OUTPUT(program, "[7, 16] sa [2]\n[5, 7, 9] sa [3]\n5\n[9, 12, 15] sa [3]\n[14, 32] sa [2]\n[7, 10, 15, 22, 67, 78, 91, 106] sa [2, 2, 2]\n[1, 2, 3, 4, 5, 6, 7, 8] sa [2, 2, 2]\n[3, 7, 11, 15] sa [2, 2]\n[6, 10, 8, 12] sa [2, 2]\n[4, 10] sa [2]\n[7, 10, 15, 22, 19, 22, 43, 50] sa [2, 2, 2]");
+    REQUIRE(getVMOutput(program) == getOutput(program));
+    REQUIRE_THROWS_WITH(getOutput("p [1, 2] @ [1, 2, 3];"), "Runtime error: Left array's num of cols differs from right array's num of rows, occurred at line 0 at column 9");
+    REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3, 4, 5, 6, 7, 8] sa [2, 2, 2];\np x @ ([1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12] sa [3, 2, 2]);"), "Runtime error: Stacks of matrices differ in size, occurred at line 1 at column 5");
+    REQUIRE_THROWS_WITH(getOutput("p ([1] sa [1, 1, 1, 1]) @ [1];"), "Runtime error: Left expression isn't a 1d, 2d or 3d ndarray, occurred at line 0 at column 24");
+}
+
+TEST_CASE("Reduction builtins", "[reductions]") {
+    SECTION("Whole arrays and axes") {
+        auto program = R"V0G0N(
+            a mat = [3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8] sa [3, 4];
+            p sum(mat);
+            p sum(mat, 0);
+            p sum(mat, 1);
+            p prod([1, 2, 3, 4]);
+            p min(mat);
+            p max(mat, 0);
+            p min(mat, 1);
+            p mean(mat, 0);
+            p argmin(mat);
+            p argmax(mat, 1);
+            p argmin(mat, 0);
+            p norm([3, 4]);
+            p norm([3, 4, 0, 0, 5, 12] sa [3, 2], 1);
+            p dot([1, 2, 3], [4, 5, 6]);
+            p any([0, 0, 1]);
+            p all([0, 0, 1]);
+            p sum(mat[1:, ::2]);
+            p max(transpose(mat), 1);
+            p sum([1, 2, 3, 4, 5, 6, 7, 8] sa [2, 2, 2], 1);
+            p sum(([1, 2] sa [40]) * 0.5);
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "52\n[13, 13, 11, 15] sa [4]\n[9, 22, 21] sa [3]\n24\n1\n[5, 9, 5, 8] sa [4]\n[1, 2, 3] sa [3]\n[4.33333, 4.33333, 3.66667, 5] sa [4]\n1\n[2, 1, 3] sa [3]\n[0, 0, 1, 0] sa [4]\n5\n[5, 0, 13] sa [3]\n32\nTrue\nFalse\n17\n[5, 9, 5, 8] sa [4]\n[4, 6, 12, 14] sa [2, 2]\n30");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Functions the program defines come first") {
+        auto program = R"V0G0N(
+            f sum(arr) {
+                r 0;
+            }
+            p sum([1, 2]);
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "0");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Reduction errors") {
+        REQUIRE_THROWS_WITH(getOutput("p min([] sa [0]);"), "Runtime error: Can't reduce an empty ndarray, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getVMOutput("p min([] sa [0]);"), "Runtime error: Can't reduce an empty ndarray, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p sum([1, 2], 1);"), "Runtime error: Axis of a reduction is not a dimension of the ndarray, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p sum([1, 2], 0, 1);"), "Runtime error: Function called with different number of args than defined with, occurred at line 0 at column 5");
+        REQUIRE_THROWS_WITH(getVMOutput("p sum([1, 2], 0, 1);"), "Runtime error: Function called with different number of args than defined with, occurred at line 0 at column 5");
+    }
+}
+
+TEST_CASE("Ndarray dtypes", "[dtypes]") {
+    SECTION("Arithmetic keeps or promotes dtypes") {
+        auto program = R"V0G0N(
+            a x = f32([1, 2, 3, 4] sa [2, 2]);
+            p x * 2 + 0.5;
+            p dtype(x + [1, 2]);
+            a k = i64([1, 2, 3]);
+            p k * 3 - 1;
+            p k / 2;
+            p -k;
+            p bool([0, 2, 0]) + bool([1, 1, 0]);
+            p dtype(i64([1]) + f32([1]));
+            p dtype(bool([1]) + f32([1]));
+            p dtype(x) == "f32";
+            p f32([0]) sa [2, 3];
+            p x[:, 1] * ([1, 2] sa [2, 1]);
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "f32([2.5, 4.5, 6.5, 8.5] sa [2, 2])\n\"f64\"\ni64([2, 5, 8] sa [3])\n[0.5, 1, 1.5] sa [3]\ni64([-1, -2, -3] sa [3])\ni64([1, 2, 0] sa [3])\n\"f64\"\n\"f32\"\nTrue\nf32([0, 0, 0, 0, 0, 0] sa [2, 3])\n[2, 4, 4, 8] sa [2, 2]");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Products, reductions and indexing") {
+        auto program = R"V0G0N(
+            a x = f32([1, 2, 3, 4] sa [2, 2]);
+            p x @ x;
+            p x @ [1, 1];
+            p sum(x);
+            p x[1, 0];
+            a k = i64([1, 2, 3]);
+            k[0] = 7;
+            p k;
+            p x == f32([1, 2, 3, 4] sa [2, 2]);
+            p x == [1, 2, 3, 4] sa [2, 2];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "f32([7, 10, 15, 22] sa [2, 2])\n[3, 7] sa [2]\n10\n3\ni64([7, 2, 3] sa [3])\nTrue\nFalse");
+    }
+
+    SECTION("Converting to i64 needs integers") {
+        REQUIRE_THROWS_WITH(getOutput("p i64([1.5]);"), "Runtime error: An element isn't an integer that fits in an i64, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("a k = i64([1]); k[0] = 0.5;"), "Runtime error: Can't assign a non-integer to an entry in an i64 array, occurred at line 0 at column 16");
+    }
+
+    SECTION("Typed kernels match f64 arithmetic") {
+        std::vector<double> values (1000);
+        for (size_t i = 0; i < values.size(); i++) values[i] = (double) i - 300.;
+        NDArray f64s (values, {values.size()});
+        NDArray f32s = f64s.as_dtype(DTYPE_F32);
+        NDArray i64s = f64s.as_dtype(DTYPE_I64);
+        for (KernelOp op : {KERNEL_ADD, KERNEL_SUBTRACT, KERNEL_MULTIPLY, KERNEL_MIN, KERNEL_MAX}) {
+            NDArray expected = NDArray::uninitialized({values.size()});
+            kernel_binary(op, ARRAY_ARRAY, f64s.data(), f64s.data(), expected.mutable_data(), values.size());
+            NDArray floats = NDArray::uninitialized({values.size()}, DTYPE_F32);
+            typed_binary(DTYPE_F32, op, ARRAY_ARRAY, f32s.raw_data(), f32s.raw_data(), floats.mutable_raw_data(), values.size());
+            NDArray ints = NDArray::uninitialized({values.size()}, DTYPE_I64);
+            typed_binary(DTYPE_I64, op, ARRAY_ARRAY, i64s.raw_data(), i64s.raw_data(), ints.mutable_raw_data(), values.size());
+            REQUIRE(floats.as_dtype(DTYPE_F64) == expected);
+            REQUIRE(ints.as_dtype(DTYPE_F64) == expected);
+        }
+    }
+}
+
+TEST_CASE("Sparse matrices", "[sparse]") {
+    SECTION("Building, printing and products") {
+        auto program = R"V0G0N(
+            a m = csr([0, 1, 1, 0, 2], [1, 0, 2, 1, 2], [3, 4, 5, 1, 6], [3, 3]);
+            p m;
+            p nnz(m);
+            p dense(m);
+            p m @ [1, 2, 3];
+            p [1, 2, 3] @ m;
+            p m @ ([1, 2, 3, 4, 5, 6] sa [3, 2]);
+            p dense(transpose(m));
+            p s m;
+            p csr(dense(m)) == m;
+            p nnz(csr([0, 0], [1, 1], [2, -2], [2, 2]));
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "csr([0, 1, 1, 2] sa [4], [1, 0, 2, 2] sa [4], [4, 4, 5, 6] sa [4], [3, 3] sa [2])\n4\n[0, 4, 0, 4, 0, 5, 0, 0, 6] sa [3, 3]\n[8, 19, 18] sa [3]\n[8, 4, 28] sa [3]\n[12, 16, 29, 38, 30, 36] sa [3, 2]\n[0, 4, 0, 4, 0, 0, 0, 5, 6] sa [3, 3]\n[3, 3] sa [2]\nTrue\n0");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Indices and shapes are checked") {
+        REQUIRE_THROWS_WITH(getOutput("p csr([2], [0], [1], [2, 2]);"), "Runtime error: An expression used in sparse matrix indexing is larger than a dimension of the matrix, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p csr([0], [0], [1], [2, 2]) @ [1, 2, 3];"), "Runtime error: Left array's num of cols differs from right array's num of rows, occurred at line 0 at column 29");
+    }
+
+    SECTION("Products match dense products on any number of threads") {
+        std::vector<double> values (400 * 300, 0.);
+        for (size_t i = 0; i < values.size(); i += 7) values[i] = (double) (i % 13) - 6.;
+        Token loc (AT, "@", 0, 0);
+        Variable dense_matrix (NDArray(values, {400, 300}));
+        Variable sparse_matrix = sparse_from_dense(dense_matrix, loc);
+        std::vector<double> others (300 * 20);
+        for (size_t i = 0; i < others.size(); i++) others[i] = (double) (i % 17) - 8.;
+        Variable right (NDArray(others, {300, 20}));
+        Variable left (NDArray(std::vector<double>(values.begin(), values.begin() + 20 * 400), {20, 400}));
+        set_num_threads(4);
+        Variable product = matmul(sparse_matrix, right, loc);
+        Variable left_product = matmul(left, sparse_matrix, loc);
+        set_num_threads(0);
+        // Every product is an integer, so the order they're added in doesn't matter
+        REQUIRE(product.value == matmul(dense_matrix, right, loc).value);
+        REQUIRE(left_product.value == matmul(left, dense_matrix, loc).value);
+        REQUIRE(sparse_to_dense(sparse_matrix, loc).value == dense_matrix.value);
+    }
+}
+
+TEST_CASE("Linear algebra", "[linalg]") {
+    SECTION("Small systems and factors") {
+        auto program = R"V0G0N(
+            a m = [4, 3, 2, 6, 3, 1, 2, 5, 7] sa [3, 3];
+            p solve(m, [1, 2, 3]);
+            p det(m);
+            p lu(m, "p") @ lu(m, "l") @ lu(m, "u");
+            p chol([4, 2, 2, 3] sa [2, 2]);
+            p solve([1, 1, 1, 2, 1, 3, 1, 4] sa [4, 2], [6, 5, 7, 10]);
+            p det([1, 2, 2, 4] sa [2, 2]);
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[1.875, -4, 2.75] sa [3]\n-8\n[4, 3, 2, 6, 3, 1, 2, 5, 7] sa [3, 3]\n[2, 0, 1, 1.41421] sa [2, 2]\n[3.5, 1.4] sa [2]\n0");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Singular and indefinite matrices are errors") {
+        REQUIRE_THROWS_WITH(getOutput("p solve([1, 2, 2, 4] sa [2, 2], [1, 1]);"), "Runtime error: Matrix is singular, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p chol([1, 2, 2, 1] sa [2, 2]);"), "Runtime error: Matrix isn't positive definite, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p qr([1, 2] sa [1, 2], \"x\");"), "Runtime error: Unknown factor of a factorization, occurred at line 0 at column 2");
+    }
+
+    SECTION("Blocked factorizations reproduce their matrix") {
+        Token loc (IDENTIFIER, "linalg", 0, 0);
+        auto largest_difference = [](const Variable& left, const Variable& right) {
+            NDArray l = std::get<NDArray>(left.value).contiguous(), r = std::get<NDArray>(right.value).contiguous();
+            REQUIRE(l.shape() == r.shape());
+            double largest = 0;
+            for (size_t i = 0; i < l.size(); i++) largest = std::max(largest, fabs(l.data()[i] - r.data()[i]));
+            return largest;
+        };
+        // Sizes spanning several blocks, on both CBLAS and the native kernels
+        size_t n = 200, tall = 130;
+        std::vector<double> values (n * n);
+        for (size_t i = 0; i < values.size(); i++) values[i] = sin((double) i * 1.3) + (i % (n + 1) == 0 ? 4. : 0.);
+        Variable a (NDArray(values, {n, n}));
+        Variable spd = matmul(transpose(a, loc), a, loc);
+        Variable wide (NDArray(std::vector<double>(values.begin(), values.begin() + tall * n), {tall, n}));
+        Variable narrow = transpose(wide, loc);
+        Variable b (NDArray(std::vector<double>(values.begin(), values.begin() + n * 3), {n, 3}));
+        for (BlasBackend backend : {BLAS_NATIVE, BLAS_CBLAS}) {
+            set_blas_backend(backend);
+            REQUIRE(largest_difference(matmul(a, solve(a, b, loc), loc), b) < 1e-9);
+            Variable plu = matmul(matmul(lu(a, Variable(std::string("\"p\"")), loc), lu(a, Variable(std::string("\"l\"")), loc), loc), lu(a, Variable(std::string("\"u\"")), loc), loc);
+            REQUIRE(largest_difference(plu, a) < 1e-9);
+            Variable l = cholesky(spd, loc);
+            REQUIRE(largest_difference(matmul(l, transpose(l, loc), loc), spd) < 1e-8);
+            for (const Variable& m : {wide, narrow}) {
+                Variable q = qr(m, Variable(std::string("\"q\"")), loc);
+                Variable r = qr(m, Variable(std::string("\"r\"")), loc);
+                REQUIRE(largest_difference(matmul(q, r, loc), m) < 1e-9);
+                size_t k = std::get<NDArray>(q.value).shape()[1];
+                std::vector<double> identity (k * k, 0.);
+                for (size_t i = 0; i < k; i++) identity[i * k + i] = 1.;
+                REQUIRE(largest_difference(matmul(transpose(q, loc), q, loc), Variable(NDArray(identity, {k, k}))) < 1e-9);
+            }
+            // The least squares solution leaves a residual orthogonal to the columns
+            Variable x = solve(narrow, b, loc);
+            Variable residual = arithmetic(MINUS, matmul(narrow, x, loc), b, loc);
+            Variable zero (NDArray(std::vector<double>(tall * 3, 0.), {tall, 3}));
+            REQUIRE(largest_difference(matmul(transpose(narrow, loc), residual, loc), zero) < 1e-8);
+            REQUIRE(fabs(std::get<double>(determinant(a, loc).value) * std::get<double>(determinant(inverse(a, loc), loc).value) - 1.) < 1e-9);
+        }
+        set_blas_backend(BLAS_AUTO);
+    }
+}
+
+TEST_CASE("Comparison masks", "[masks]") {
+    SECTION("Comparisons, where and mask indexing") {
+        auto program = R"V0G0N(
+            a x = [1, 5, 3, 7, 2];
+            p x > 3;
+            p ([1, 2, 3, 4, 5, 6] sa [2, 3]) <= [2, 1, 3];
+            p 4 < x;
+            p equal(x, 3);
+            p not_equal(i64(x), [1, 5, 0, 0, 2]);
+            p x[x >= 3];
+            p where(x > 3, x, 0);
+            p dtype(where(x > 3, i64(x), 10));
+            p count(x > 1);
+            p any(x > 6);
+            p all(x > 1);
+            x[x < 3] = 0;
+            p x;
+            p x == [0, 5, 3, 7, 0];
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "bool([0, 1, 0, 1, 0] sa [5])\nbool([1, 0, 1, 0, 0, 0] sa [2, 3])\nbool([0, 1, 0, 1, 0] sa [5])\nbool([0, 0, 1, 0, 0] sa [5])\nbool([0, 0, 1, 1, 0] sa [5])\n[5, 3, 7] sa [3]\n[0, 5, 0, 7, 0] sa [5]\n\"i64\"\n4\nTrue\nFalse\n[0, 5, 3, 7, 0] sa [5]\nTrue");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Masks must match the array") {
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3, 4] sa [2, 2]; p x[x > 1, 0];"), "Runtime error: A bool mask used in array indexing must be the only index, occurred at line 0 at column 33");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3]; p x[x > [1, 2]];"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 0 at column 23");
+        REQUIRE_THROWS_WITH(getOutput("a k = i64([1, 2]); k[k > 1] = 0.5;"), "Runtime error: Can't assign a non-integer to an entry in an i64 array, occurred at line 0 at column 19");
+    }
+
+    SECTION("Long masks give the same results on any number of threads") {
+        size_t n = 300000;
+        std::vector<double> values (n);
+        for (size_t i = 0; i < n; i++) values[i] = (double) (i * 7919 % 1000);
+        Token loc (GREATER, ">", 0, 0);
+        Variable x (NDArray(values, {n}));
+        Variable mask = compare(GREATER, x, Variable(500.), loc);
+        Variable picked = index_read(x, &mask, 1, loc);
+        std::vector<double> expected;
+        for (double value : values) if (value > 500.) expected.push_back(value);
+        set_num_threads(4);
+        REQUIRE(index_read(x, &mask, 1, loc).value == picked.value);
+        REQUIRE(select(mask, x, Variable(0.), loc).value == arithmetic(STAR, x, Variable(std::get<NDArray>(mask.value).as_dtype(DTYPE_F64)), loc).value);
+        set_num_threads(0);
+        REQUIRE(picked.value == Variable(NDArray(expected, {expected.size()})).value);
+        REQUIRE(std::get<double>(count_nonzero(mask, loc).value) == (double) expected.size());
+    }
+}
+
+TEST_CASE("Gather and scatter", "[indexing]") {
+    SECTION("Integer arrays as indices") {
+        auto program = R"V0G0N(
+            a m = [1, 2, 3, 4, 5, 6] sa [3, 2];
+            p m[[2, 0]];
+            p m[[2, 0], [1, 1]];
+            p m[[0, 2], 1];
+            p m[i64([0, 1, 2, 0] sa [2, 2]), 0];
+            a x = [10, 20, 30, 40];
+            x[[3, 0]] = [7, 8];
+            p x;
+            x[[1, 1, 2]] = 5;
+            p x;
+            m[[0, 2]] = [0, 9];
+            p m;
+            p scatter_add([0, 0, 0], [0, 2, 2, 1, 2], 1);
+            p scatter_add(i64([0, 0, 0, 0] sa [2, 2]), [1, 1], i64([1, 2]));
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[5, 6, 1, 2] sa [2, 2]\n[6, 2] sa [2]\n[2, 6] sa [2]\n[1, 3, 5, 1] sa [2, 2]\n[8, 20, 30, 7] sa [4]\n[8, 5, 5, 7] sa [4]\n[0, 9, 3, 4, 0, 9] sa [3, 2]\n[1, 1, 3] sa [3]\ni64([0, 0, 2, 4] sa [2, 2])");
+        REQUIRE(getVMOutput(program) == getOutput(program));
+    }
+
+    SECTION("Indices are checked before anything is written") {
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3]; x[[0, 3]] = 0;"), "Runtime error: An expression used in array indexing is larger than a dimension of the ndarray, occurred at line 0 at column 17");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3]; p x[[0, -1]];"), "Runtime error: An expression used in array indexing is larger than a dimension of the ndarray, occurred at line 0 at column 20");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3]; p x[[0.5]];"), "Runtime error: An ndarray used in array indexing has an element that isn't an integer, occurred at line 0 at column 20");
+        REQUIRE_THROWS_WITH(getOutput("a x = [1, 2, 3]; x[[0, 1]] = [1, 2, 3];"), "Runtime error: Expressions evaluate to arrays of differing sizes, occurred at line 0 at column 17");
+        REQUIRE_OUTPUT("a x = [1, 2, 3]; a y = x; y[[0, 1]] = 0; p x;", "[1, 2, 3] sa [3]");
+    }
+
+    SECTION("Repeated indices give the same results on any number of threads") {
+        size_t n = 200000, bins = 1000;
+        std::vector<double> keys (n), values (n);
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = (double) (i * 7919 % bins);
+            values[i] = (double) (i % 10);
+        }
+        Token loc (LEFT_BRACK, "[", 0, 0);
+        Variable index (NDArray(keys, {n}));
+        Variable vals (NDArray(values, {n}));
+        Variable zeros (NDArray(std::vector<double>(bins, 0.), {bins}));
+        Variable sums = scatter_add(zeros, index, vals, loc);
+        NDArray written = std::get<NDArray>(zeros.value);
+        scatter(written, &index, 1, vals, loc);
+        std::vector<double> expected_sums (bins, 0.), expected_written (bins, 0.);
+        for (size_t i = 0; i < n; i++) {
+            expected_sums[(size_t) keys[i]] += values[i];
+            expected_written[(size_t) keys[i]] = values[i];
+        }
+        REQUIRE(sums.value == Variable(NDArray(expected_sums, {bins})).value);
+        REQUIRE(written == NDArray(expected_written, {bins}));
+        set_num_threads(4);
+        NDArray threaded = std::get<NDArray>(zeros.value);
+        scatter(threaded, &index, 1, vals, loc);
+        REQUIRE(scatter_add(zeros, index, vals, loc).value == sums.value);
+        REQUIRE(threaded == written);
+        REQUIRE(gather(written, &index, 1, loc).value == gather(threaded, &index, 1, loc).value);
+        set_num_threads(0);
+    }
+}
+
+TEST_CASE("Random numbers", "[random]") {
+    SECTION("Philox matches its known answers") {
+        // Test vectors from the Random123 library's Philox4x32-10
+        uint64_t out[2];
+        philox(0, 0, 0, 1, out);
+        REQUIRE(out[0] == 0xe169c58d6627e8d5ull);
+        REQUIRE(out[1] == 0x9b00dbd8bc57ac4cull);
+        philox(~0ull, ~0ull, ~0ull, 1, out);
+        REQUIRE(out[0] == 0x41c83b0e408f276dull);
+        REQUIRE(out[1] == 0x6d5451fda20bc7c6ull);
+        philox(0x299f31d0a4093822ull, 0x0370734413198a2eull, 0x85a308d3243f6a88ull, 1, out);
+        REQUIRE(out[0] == 0x94fdccebd16cfe09ull);
+        REQUIRE(out[1] == 0x24126ea15001e420ull);
+    }
+
+    SECTION("Builtins are reproducible for a seed") {
+        auto program = R"V0G0N(
+            seed(42);
+            a u = rand([2, 3]);
+            p s u;
+            p all(u >= 0) A all(u < 1);
+            a k = randint(-3, 4, 1000);
+            p dtype(k);
+            p min(k);
+            p max(k);
+            p s randn([4, 5]);
+            p sum(shuffle([1, 2, 3, 4, 5, 6] sa [3, 2]));
+            seed(42);
+            p rand([2, 3]) == u;
+            p rand([2, 3]) == u;
+        )V0G0N";
+        REQUIRE_OUTPUT(program, "[2, 3] sa [2]\nTrue\n\"i64\"\n-3\n3\n[4, 5] sa [2]\n21\nTrue\nFalse");
+        REQUIRE(getVMOutput("seed(1); p rand(5); p randn(3); p randint(0, 100, 4); p shuffle([1, 2, 3, 4]);") == getOutput("seed(1); p rand(5); p randn(3); p randint(0, 100, 4); p shuffle([1, 2, 3, 4]);"));
+    }
+
+    SECTION("Arguments are checked") {
+        REQUIRE_THROWS_WITH(getOutput("p rand(1.5);"), "Runtime error: An expression used in array size is not close to an integer, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("p randint(3, 3, 2);"), "Runtime error: The lower bound of random integers must be below the upper bound, occurred at line 0 at column 2");
+        REQUIRE_THROWS_WITH(getOutput("seed(-1);"), "Runtime error: A seed must be a non-negative integer, occurred at line 0 at column 0");
+    }
+
+    SECTION("Fills give the same numbers on any number of threads") {
+        Token loc (IDENTIFIER, "rand", 0, 0);
+        size_t n = 300001;
+        std::vector<double> entries (n);
+        for (size_t i = 0; i < n; i++) entries[i] = (double) i;
+        Variable arange (NDArray(entries, {n}));
+        std::vector<Variable> results[2];
+        for (size_t threads : {1, 4}) {
+            set_num_threads(threads);
+            seed_random(Variable(9.), loc);
+            std::vector<Variable>& drawn = results[threads == 4];
+            drawn.push_back(random_uniform(Variable((double) n), loc));
+            drawn.push_back(random_normal(Variable((double) n), loc));
+            drawn.push_back(random_integers(Variable(0.), Variable(1e12), Variable((double) n), loc));
+            drawn.push_back(shuffle(arange, loc));
+        }
+        set_num_threads(0);
+        for (size_t i = 0; i < results[0].size(); i++) REQUIRE(results[0][i].value == results[1][i].value);
+        // A shuffle spanning many buckets is still a permutation
+        NDArray shuffled = std::get<NDArray>(results[0][3].value);
+        REQUIRE(!(shuffled == std::get<NDArray>(arange.value)));
+        std::vector<double> sorted (shuffled.data(), shuffled.data() + n);
+        std::sort(sorted.begin(), sorted.end());
+        REQUIRE(sorted == entries);
+        NDArray normal = std::get<NDArray>(results[0][1].value);
+        double sum = 0, squares = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += normal.data()[i];
+            squares += normal.data()[i] * normal.data()[i];
+        }
+        REQUIRE(fabs(sum / n) < 0.01);
+        REQUIRE(fabs(squares / n - 1.) < 0.01);
+    }
+}
+
+TEST_CASE("Threads give the same results as one thread", "[parallel]") {
+    SECTION("Every index is visited once") {
+        set_num_threads(4);
+        std::vector<int> visits (100000);
+        parallel_for(visits.size(), 1000, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) visits[i]++;
+        });
+        set_num_threads(0);
+        REQUIRE(std::all_of(visits.begin(), visits.end(), [](int count) { return count == 1; }));
+    }
+
+    SECTION("Kernels") {
+        const size_t n = 10 * PARALLEL_GRAIN + 7;
+        std::vector<double> left (n), right (n);
+        for (size_t i = 0; i < n; i++) {
+            left[i] = sin((double) i) * 100.;
+            right[i] = cos((double) i) + 2.;
+        }
+        std::vector<double> serial (n), threaded (n);
+        set_num_threads(1);
+        kernel_binary(KERNEL_DIVIDE, ARRAY_ARRAY, left.data(), right.data(), serial.data(), n);
+        double serial_sum = kernel_reduce(KERNEL_ADD, left.data(), n);
+        double serial_dot = kernel_dot(left.data(), right.data(), n);
+        set_num_threads(4);
+        kernel_binary(KERNEL_DIVIDE, ARRAY_ARRAY, left.data(), right.data(), threaded.data(), n);
+        double threaded_sum = kernel_reduce(KERNEL_ADD, left.data(), n);
+        double threaded_dot = kernel_dot(left.data(), right.data(), n);
+        set_num_threads(0);
+        REQUIRE(memcmp(serial.data(), threaded.data(), n * sizeof(double)) == 0);
+        REQUIRE(memcmp(&serial_sum, &threaded_sum, sizeof(double)) == 0);
+        REQUIRE(memcmp(&serial_dot, &threaded_dot, sizeof(double)) == 0);
+    }
+
+    SECTION("Programs") {
+        auto program = R"V0G0N(
+            a x = [0.1, 0.7, 0.3] sa [300000, 3];
+            a y = x * 3 - [1, 2, 3] sa [3] / 7;
+            a mat = y sa [900, 1000];
+            p sum(y);
+            p mean(mat * mat - 1);
+            p max(mat, 0)[17];
+            p argmax(y);
+            p sum(mat, 1)[899];
+            p (x sa [900, 1000] - mat) == (-mat + x sa [900, 1000]);
+            p x < y;
+        )V0G0N";
+        set_num_threads(1);
+        std::string serial = getOutput(program);
+        set_num_threads(4);
+        std::string threaded = getOutput(program);
+        std::string threaded_vm = getVMOutput(program);
+        set_num_threads(0);
+        REQUIRE(serial == threaded);
+        REQUIRE(serial == threaded_vm);
+    }
+}
+
+TEST_CASE("Native matrix products", "[gemm]") {
+    SECTION("Matches a plain loop") {
+        // Sizes around the tile and block sizes, with a read transposed
+        const size_t sizes[][3] = {{1, 1, 1}, {5, 7, 3}, {37, 29, 300}, {130, 70, 257}, {4, 8, 16}};
+        for (auto size : sizes) {
+            size_t rows = size[0], cols = size[1], depth = size[2];
+            std::vector<double> a (rows * depth), b (depth * cols), out (rows * cols, NAN);
+            for (size_t i = 0; i < a.size(); i++) a[i] = sin((double) i);
+            for (size_t i = 0; i < b.size(); i++) b[i] = cos((double) i * 0.7);
+            native_gemm(rows, cols, depth, a.data(), 1, rows, b.data(), cols, 1, out.data());
+            for (size_t i = 0; i < rows; i++) {
+                for (size_t j = 0; j < cols; j++) {
+                    double expected = 0;
+                    for (size_t k = 0; k < depth; k++) expected += a[k * rows + i] * b[k * cols + j];
+                    REQUIRE(fabs(out[i * cols + j] - expected) < 1e-9);
+                }
+            }
+        }
+    }
+
+    SECTION("Gives the same products on any number of threads") {
+        // One size spanning several row blocks, and one small enough that
+        // @ picks native_gemm over CBLAS by default
+        const size_t sizes[][3] = {{130, 70, 257}, {12, 8, 2}};
+        for (auto size : sizes) {
+            size_t rows = size[0], cols = size[1], depth = size[2];
+            std::vector<double> a (rows * depth), b (depth * cols), one (rows * cols), four (rows * cols);
+            for (size_t i = 0; i < a.size(); i++) a[i] = sin((double) i);
+            for (size_t i = 0; i < b.size(); i++) b[i] = cos((double) i * 0.7);
+            set_num_threads(1);
+            native_gemm(rows, cols, depth, a.data(), depth, 1, b.data(), cols, 1, one.data());
+            set_num_threads(4);
+            native_gemm(rows, cols, depth, a.data(), depth, 1, b.data(), cols, 1, four.data());
+            set_num_threads(0);
+            REQUIRE(one == four);
+        }
+        REQUIRE(gemm_method(12, 8, 2) == GEMM_NATIVE);
+    }
+
+    SECTION("Tiny products match native_gemm exactly") {
+        std::vector<double> a (GEMM_TINY_MAX * GEMM_TINY_MAX), b (GEMM_TINY_MAX * GEMM_TINY_MAX);
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = sin((double) i) * 3.;
+            b[i] = cos((double) i * 1.3);
+        }
+        for (size_t rows = 1; rows <= GEMM_TINY_MAX; rows++) {
+            for (size_t cols = 1; cols <= GEMM_TINY_MAX; cols++) {
+                for (size_t depth = 1; depth <= GEMM_TINY_MAX; depth++) {
+                    std::vector<double> tiny (rows * cols), native (rows * cols);
+                    tiny_gemm(rows, cols, depth, a.data(), 1, rows, b.data(), cols, 1, tiny.data());
+                    native_gemm(rows, cols, depth, a.data(), 1, rows, b.data(), cols, 1, native.data());
+                    REQUIRE(tiny == native);
+                }
+            }
+        }
+        REQUIRE(gemm_method(4, 4, 4) == GEMM_TINY);
+        REQUIRE(gemm_method(4, 5, 4) != GEMM_TINY);
+        set_blas_backend(BLAS_NATIVE);
+        REQUIRE(gemm_method(500, 500, 500) == GEMM_NATIVE);
+        set_blas_backend(BLAS_AUTO);
+        set_gemm_cblas_min(100 * 100 * 100);
+        REQUIRE(gemm_method(50, 50, 50) == GEMM_NATIVE);
+        REQUIRE(gemm_method(100, 100, 100) == GEMM_CBLAS);
+        set_gemm_cblas_min(0);
+    }
+
+    SECTION("Gives the same results as CBLAS") {
+        auto program = R"V0G0N(
+            a mat = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12] sa [3, 4];
+            p mat @ transpose(mat);
+            p transpose(mat) @ mat[:, ::2];
+            p mat @ [1, 2, 3, 4];
+            p [1, 2, 3] @ mat;
+            p (mat sa [2, 3, 2]) @ ([1, 0, 2, 1] sa [2, 2]);
+            p ([1] sa [5, 0]) @ ([1] sa [0, 6]);
+        )V0G0N";
+        set_blas_backend(BLAS_CBLAS);
+        std::string cblas = getOutput(program);
+        set_blas_backend(BLAS_NATIVE);
+        std::string native = getOutput(program);
+        set_blas_backend(BLAS_AUTO);
+        REQUIRE(cblas == native);
+    }
+}